@@ -0,0 +1,77 @@
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#define POLY 0x82f63b78 // reversed Castagnoli polynomial
+
+static unsigned int table[8][256];
+static pthread_once_t init_once = PTHREAD_ONCE_INIT; // the tables are filled in by the first caller
+static bool use_sse42 = false;
+
+static void crc32c_init() {
+	for (int n = 0; n < 256; n++) {
+		unsigned int c = n;
+		for (int k = 0; k < 8; k++) {
+			c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+		}
+		table[0][n] = c;
+	}
+	// table[k][n] is the crc of byte n followed by k zero bytes
+	for (int n = 0; n < 256; n++) {
+		for (int k = 1; k < 8; k++) {
+			table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xff];
+		}
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	use_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+// slice-by-8: 8 table lookups per 8 bytes of input
+static unsigned int crc32c_sw(unsigned int crc, const unsigned char *p, int len) {
+	crc = ~crc;
+	while (len >= 8) {
+		unsigned int lo, hi;
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= crc;
+		crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24]
+			^ table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	}
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_hw(unsigned int crc, const unsigned char *p, int len) {
+	unsigned long long c = ~crc;
+	while (len >= 8) {
+		unsigned long long v;
+		memcpy(&v, p, 8);
+		c = __builtin_ia32_crc32di(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		c = __builtin_ia32_crc32qi(c, *p++);
+	}
+	return ~c;
+}
+#endif
+
+unsigned int crc32c(unsigned int crc, const void *buf, int len) {
+	pthread_once(&init_once, crc32c_init);
+#if defined(__x86_64__)
+	if (use_sse42) {
+		return crc32c_hw(crc, buf, len);
+	}
+#endif
+	return crc32c_sw(crc, buf, len);
+}
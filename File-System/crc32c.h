@@ -0,0 +1,9 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+// CRC32C (Castagnoli) used for sfs block checksums. Uses the SSE4.2 crc32 instruction
+// when the cpu has it, and a slice-by-8 table otherwise.
+
+// continue crc (0 to start) over len bytes of buf
+unsigned int crc32c(unsigned int crc, const void *buf, int len);
+
+#endif
@@ -1,72 +1,583 @@
+/*Byte offsets are 64-bit (off_t) everywhere, so images can be larger than 2 GB*/
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <stdlib.h> 
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include "disk_emu.h"
 
+#define STRIPE_IOV 64   /*chunks per preadv/pwritev call*/
 
-FILE* fp = NULL;
+
+struct disk default_disk_state;
 double L, p;
 double r;
-int BLOCK_SIZE, MAX_BLOCK;
 
+static void stripe_stop(struct disk *disk);
+
+
+/*-------------------------------------------------------*/
+/*Returns the disk used by the functions without a handle*/
+/*-------------------------------------------------------*/
+struct disk *default_disk()
+{
+    return &default_disk_state;
+}
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
+int disk_close(struct disk *disk)
+{
+    int i;
+
+    stripe_stop(disk);
+    for (i = 0; i < disk->nfiles; i++)
+    {
+        close(disk->fds[i]);
+    }
+    disk->nfiles = 0;
+    if(NULL != disk->fp)
+    {
+        fclose(disk->fp);
+        disk->fp = NULL;
+    }
+    return 0;
+}
+
 int close_disk()
 {
-    if(NULL != fp)
+    return disk_close(&default_disk_state);
+}
+
+/*--------------------------------------------------------------*/
+/*Returns the file descriptor of the disk file. Block n starts at */
+/*byte n * block_size, and every write is flushed, so reading the */
+/*descriptor directly always sees what has been written. A striped */
+/*or RAM disk has no single file, so it returns -1                 */
+/*--------------------------------------------------------------*/
+int disk_fd(struct disk *disk)
+{
+    return disk->fp == NULL ? -1 : fileno(disk->fp);
+}
+
+/*-----------------------------------------------------------------*/
+/*Striping: block b is in chunk c = b / stripe_blocks, which is held */
+/*by file c % nfiles at block (c / nfiles) * stripe_blocks +         */
+/*b % stripe_blocks of that file                                     */
+/*-----------------------------------------------------------------*/
+struct stripe_job {
+    int fd;
+    int write;
+    off_t offset;           /*where the first piece goes in the file*/
+    struct iovec *iov;      /*pieces of the caller's buffer, in file order*/
+    int iovcnt;
+    int failed;
+};
+
+/*The worker threads of a striped disk. A request hands the jobs of all */
+/*but one file to them and does that one itself, then takes back any   */
+/*job no worker has started on. One request uses them at a time; the   */
+/*request that finds them busy does all its jobs itself                */
+struct stripe_pool {
+    pthread_mutex_t busy;           /*held by the request using the workers*/
+    pthread_mutex_t lock;
+    pthread_cond_t work;            /*jobs were handed out, or the workers should stop*/
+    pthread_cond_t done;            /*a worker finished a job*/
+    struct stripe_job *jobs[MAX_STRIPE_FILES]; /*jobs no one has started on*/
+    int queued;
+    int pending;                    /*jobs handed out and not finished*/
+    int stop;
+    int nthreads;
+    pthread_t threads[MAX_STRIPE_FILES];
+};
+
+static void *stripe_run(void *arg);
+
+/*Takes a job no one has started on, NULL if there is none. Called with pool->lock held*/
+static struct stripe_job *stripe_take(struct stripe_pool *pool)
+{
+    return pool->queued > 0 ? pool->jobs[--pool->queued] : NULL;
+}
+
+static void *stripe_worker(void *arg)
+{
+    struct stripe_pool *pool = arg;
+    struct stripe_job *job;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop)
+    {
+        if ((job = stripe_take(pool)) == NULL)
+        {
+            pthread_cond_wait(&pool->work, &pool->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        stripe_run(job);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+        {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*Starts a worker for every file but one. If none can be started, the */
+/*requests do all their jobs themselves                                */
+static void stripe_start(struct disk *disk)
+{
+    struct stripe_pool *pool = calloc(1, sizeof(struct stripe_pool));
+    int i;
+
+    pthread_mutex_init(&pool->busy, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (i = 0; i < disk->nfiles - 1; i++)
+    {
+        if (pthread_create(&pool->threads[pool->nthreads], NULL, stripe_worker, pool) == 0)
+        {
+            pool->nthreads++;
+        }
+    }
+    disk->pool = pool;
+}
+
+static void stripe_stop(struct disk *disk)
+{
+    struct stripe_pool *pool = disk->pool;
+    int i;
+
+    if (pool == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->busy);
+    free(pool);
+    disk->pool = NULL;
+}
+
+/*Opens or creates every file of a striped disk. spec is a comma separated*/
+/*list of image files, optionally followed by @chunk (blocks per chunk)   */
+static int stripe_open(struct disk *disk, char *spec, int block_size, int num_blocks, int fresh)
+{
+    char names[strlen(spec) + 1];
+    char *name, *at, *save;
+    int chunks, i;
+
+    strcpy(names, spec);
+    disk->pool = NULL;
+    disk->block_size = block_size;
+    disk->max_block = num_blocks;
+    disk->stripe_blocks = DEFAULT_STRIPE_BLOCKS;
+    disk->nfiles = 0;
+    if ((at = strrchr(names, '@')) != NULL)
+    {
+        *at = '\0';
+        disk->stripe_blocks = atoi(at + 1);
+        if (disk->stripe_blocks <= 0)
+        {
+            printf("Bad stripe chunk size in %s\n\n", spec);
+            return -1;
+        }
+    }
+
+    for (name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save))
+    {
+        int fd;
+
+        if (disk->nfiles == MAX_STRIPE_FILES)
+        {
+            printf("Too many stripe files in %s\n\n", spec);
+            disk_close(disk);
+            return -1;
+        }
+        fd = open(name, fresh ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+        if (fd < 0)
+        {
+            printf("Could not open %s\n\n", name);
+            disk_close(disk);
+            return -1;
+        }
+        disk->fds[disk->nfiles++] = fd;
+    }
+
+    /*A new file is sized to its share of the chunks; the holes read as 0's*/
+    if (fresh)
+    {
+        chunks = (num_blocks + disk->stripe_blocks - 1) / disk->stripe_blocks;
+        for (i = 0; i < disk->nfiles; i++)
+        {
+            off_t file_chunks = (chunks - i + disk->nfiles - 1) / disk->nfiles;
+
+            if (ftruncate(disk->fds[i], file_chunks * disk->stripe_blocks * block_size) < 0)
+            {
+                printf("Could not create new disk file %d of %s\n\n", i, spec);
+                disk_close(disk);
+                return -1;
+            }
+        }
+    }
+    stripe_start(disk);
+    return 0;
+}
+
+/*Does the reads or writes of one file, STRIPE_IOV chunks per call*/
+static void *stripe_run(void *arg)
+{
+    struct stripe_job *job = arg;
+    off_t offset = job->offset;
+    int i, j, cnt;
+
+    for (i = 0; i < job->iovcnt; i += cnt)
+    {
+        ssize_t want = 0, done;
+
+        cnt = job->iovcnt - i < STRIPE_IOV ? job->iovcnt - i : STRIPE_IOV;
+        for (j = 0; j < cnt; j++)
+        {
+            want += job->iov[i + j].iov_len;
+        }
+        if (job->write)
+        {
+            done = pwritev(job->fd, job->iov + i, cnt, offset);
+        }
+        else
+        {
+            done = preadv(job->fd, job->iov + i, cnt, offset);
+        }
+        if (done != want)
+        {
+            job->failed = 1;
+            return NULL;
+        }
+        offset += want;
+    }
+    return NULL;
+}
+
+/*Splits a request into one job per file and runs the jobs in parallel.*/
+/*The chunks a contiguous request touches in one file are contiguous in */
+/*that file, so each job is a single scatter/gather range               */
+static int stripe_io(struct disk *disk, int start_address, int nblocks, void *buffer, int write)
+{
+    struct stripe_pool *pool = disk->pool;
+    struct stripe_job jobs[MAX_STRIPE_FILES];
+    struct stripe_job *job;
+    int max_iov = nblocks / disk->stripe_blocks + 2;
+    struct iovec *iovs = malloc(sizeof(struct iovec) * disk->nfiles * max_iov);
+    int b, i, first = -1, failed = 0;
+
+    for (i = 0; i < disk->nfiles; i++)
+    {
+        jobs[i].fd = disk->fds[i];
+        jobs[i].write = write;
+        jobs[i].iov = iovs + i * max_iov;
+        jobs[i].iovcnt = 0;
+        jobs[i].failed = 0;
+    }
+
+    for (b = start_address; b < start_address + nblocks; )
+    {
+        int chunk = b / disk->stripe_blocks;
+        int within = b % disk->stripe_blocks;
+        int len = disk->stripe_blocks - within;
+
+        job = &jobs[chunk % disk->nfiles];
+        if (len > start_address + nblocks - b)
+        {
+            len = start_address + nblocks - b;
+        }
+        if (job->iovcnt == 0)
+        {
+            job->offset = ((off_t) (chunk / disk->nfiles) * disk->stripe_blocks + within) * disk->block_size;
+        }
+        job->iov[job->iovcnt].iov_base = (char *)buffer + (long) (b - start_address) * disk->block_size;
+        job->iov[job->iovcnt].iov_len = (size_t) len * disk->block_size;
+        job->iovcnt++;
+        b += len;
+    }
+
+    /*The first file is done on this thread, the others are handed to the workers*/
+    if (pool != NULL && pthread_mutex_trylock(&pool->busy) != 0)
+    {
+        pool = NULL;
+    }
+    if (pool != NULL)
+    {
+        pthread_mutex_lock(&pool->lock);
+    }
+    for (i = 0; i < disk->nfiles; i++)
+    {
+        if (jobs[i].iovcnt == 0)
+        {
+            continue;
+        }
+        if (first < 0)
+        {
+            first = i;
+        }
+        else if (pool != NULL)
+        {
+            pool->jobs[pool->queued++] = &jobs[i];
+        }
+        else
+        {
+            stripe_run(&jobs[i]);
+        }
+    }
+    if (pool != NULL)
+    {
+        pool->pending = pool->queued;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (first >= 0)
+    {
+        stripe_run(&jobs[first]);
+    }
+    if (pool != NULL)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while ((job = stripe_take(pool)) != NULL)
+        {
+            pool->pending--;
+            pthread_mutex_unlock(&pool->lock);
+            stripe_run(job);
+            pthread_mutex_lock(&pool->lock);
+        }
+        while (pool->pending > 0)
+        {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        pthread_mutex_unlock(&pool->busy);
+    }
+    for (i = 0; i < disk->nfiles; i++)
+    {
+        failed |= jobs[i].failed;
+    }
+    free(iovs);
+    if (failed)
+    {
+        printf("striped %s error at block %d\n", write ? "write" : "read", start_address);
+        return -1;
+    }
+    return nblocks;
+}
+
+/*------------------------------------------------------------------*/
+/*RAM disk: the blocks are kept in disk->mem instead of a file, which */
+/*stays allocated across disk_close until disk_release               */
+/*------------------------------------------------------------------*/
+static int is_memory(char *filename)
+{
+    return strncmp(filename, MEMORY_DISK, strlen(MEMORY_DISK)) == 0;
+}
+
+/*Frees the memory of a RAM disk. Does nothing for other disks*/
+void disk_release(struct disk *disk)
+{
+    free(disk->mem);
+    disk->mem = NULL;
+    disk->mem_bytes = 0;
+}
+
+/*Replaces the contents of a RAM disk with a copy of an image file*/
+int disk_load(struct disk *disk, char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    off_t bytes;
+    char *mem;
+
+    if (fp == NULL)
     {
+        printf("Could not open %s\n\n", filename);
+        return -1;
+    }
+    fseeko(fp, 0, SEEK_END);
+    bytes = ftello(fp);
+    fseeko(fp, 0, SEEK_SET);
+    mem = malloc(bytes > 0 ? bytes : 1);
+    if (mem == NULL || fread(mem, 1, bytes, fp) != (size_t) bytes)
+    {
+        printf("Could not load %s\n\n", filename);
+        free(mem);
         fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    free(disk->mem);
+    disk->mem = mem;
+    disk->mem_bytes = bytes;
+    return 0;
+}
+
+/*Writes the contents of a RAM disk to an image file, which can be opened*/
+/*as a normal disk or loaded again with ":memory:filename"               */
+int disk_snapshot(struct disk *disk, char *filename)
+{
+    FILE *fp;
+
+    if (disk->mem == NULL)
+    {
+        printf("Only a RAM disk can be saved to a file\n\n");
+        return -1;
+    }
+    fp = fopen(filename, "wb");
+    if (fp == NULL)
+    {
+        printf("Could not create %s\n\n", filename);
+        return -1;
+    }
+    if (fwrite(disk->mem, 1, disk->mem_bytes, fp) != (size_t) disk->mem_bytes)
+    {
+        printf("Could not write %s\n\n", filename);
+        fclose(fp);
+        return -1;
+    }
+    return fclose(fp);
+}
+
+/*Opens a RAM disk. A fresh one is zeroed; an existing one keeps its     */
+/*contents, which come from the image named after MEMORY_DISK if it has */
+/*none yet. Blocks past the end of a smaller disk read as 0's           */
+static int memory_open(struct disk *disk, char *filename, int block_size, int num_blocks, int fresh)
+{
+    long long bytes = (long long) num_blocks * block_size;
+    char *image = filename + strlen(MEMORY_DISK);
+
+    disk->block_size = block_size;
+    disk->max_block = num_blocks;
+    if (fresh)
+    {
+        disk_release(disk);
+    }
+    else if (disk->mem == NULL)
+    {
+        if (*image == '\0')
+        {
+            printf("Could not open %s, the RAM disk is empty\n\n", filename);
+            return -1;
+        }
+        if (disk_load(disk, image) < 0)
+        {
+            return -1;
+        }
+    }
+    if (bytes > disk->mem_bytes)
+    {
+        /*calloc gives a large new disk untouched zero pages, like a sparse file*/
+        char *mem = calloc(1, bytes);
+
+        if (mem == NULL)
+        {
+            printf("Could not allocate a RAM disk of %lld bytes\n\n", bytes);
+            return -1;
+        }
+        if (disk->mem != NULL)
+        {
+            memcpy(mem, disk->mem, disk->mem_bytes);
+            free(disk->mem);
+        }
+        disk->mem = mem;
+        disk->mem_bytes = bytes;
     }
     return 0;
 }
 
+/*-------------------------------------------------------*/
+/*Copies the block I/O counters since the program started*/
+/*-------------------------------------------------------*/
+void get_io_stats(struct disk_io_stats *stats)
+{
+    *stats = default_disk_state.stats;
+}
+
 /*---------------------------------------*/
 /*Initializes a disk file filled with 0's*/
 /*---------------------------------------*/
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
+int disk_init_fresh(struct disk *disk, char *filename, int block_size, int num_blocks)
 {
-    int i, j;
-
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
+
+    if (is_memory(filename))
+    {
+        return memory_open(disk, filename, block_size, num_blocks, 1);
+    }
+    disk_release(disk);
+    if (strchr(filename, ',') != NULL)
+    {
+        return stripe_open(disk, filename, block_size, num_blocks, 1);
+    }
+    disk->block_size = block_size;
+    disk->max_block = num_blocks;
     /*Creates a new file*/
-    fp = fopen (filename, "w+b");
+    disk->fp = fopen (filename, "w+b");
 
-    if (fp == NULL)
+    if (disk->fp == NULL)
     {
         printf("Could not create new disk file %s\n\n", filename);
         return -1;
     }
     
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+    /*Sizes the file without writing it, so even a large disk is made at once.
+      The blocks read as 0's until they're written*/
+    if (ftruncate(fileno(disk->fp), (off_t) disk->max_block * disk->block_size) < 0)
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
+        printf("Could not create new disk file %s\n\n", filename);
+        fclose(disk->fp);
+        disk->fp = NULL;
+        return -1;
     }
     return 0;
 }
+
+int init_fresh_disk(char *filename, int block_size, int num_blocks)
+{
+    return disk_init_fresh(&default_disk_state, filename, block_size, num_blocks);
+}
+
 /*----------------------------*/
 /*Initializes an existing disk*/
 /*----------------------------*/
-int init_disk(char *filename, int block_size, int num_blocks)
+int disk_init(struct disk *disk, char *filename, int block_size, int num_blocks)
 {
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
+    if (is_memory(filename))
+    {
+        return memory_open(disk, filename, block_size, num_blocks, 0);
+    }
+    disk_release(disk);
+    if (strchr(filename, ',') != NULL)
+    {
+        return stripe_open(disk, filename, block_size, num_blocks, 0);
+    }
+    disk->block_size = block_size;
+    disk->max_block = num_blocks;
     
     /*Opens a file*/
-    fp = fopen (filename, "r+b");
+    disk->fp = fopen (filename, "r+b");
 
-    if (fp == NULL)
+    if (disk->fp == NULL)
     {
         printf("Could not open %s\n\n", filename);
         return -1;
@@ -74,71 +585,114 @@ int init_disk(char *filename, int block_size, int num_blocks)
     return 0;
 }
 
+int init_disk(char *filename, int block_size, int num_blocks)
+{
+    return disk_init(&default_disk_state, filename, block_size, num_blocks);
+}
+
 /*-------------------------------------------------------------------*/
 /*Reads a series of blocks from the disk into the buffer             */
 /*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
+int disk_read(struct disk *disk, int start_address, int nblocks, void *buffer)
 {
-    int i, s;
+    int s;
     s = 0;
 
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address + nblocks > disk->max_block)
     {
         printf("out of bound error %d\n", start_address);
         return -1;
     }
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    if (disk->nfiles > 0)
+    {
+        s = stripe_io(disk, start_address, nblocks, buffer, 0);
+        if (s < 0)
+        {
+            return -1;
+        }
+        disk->stats.reads++;
+        disk->stats.blocks_read += s;
+        return s;
+    }
 
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
+    if (disk->mem != NULL)
     {
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+        memcpy(buffer, disk->mem + (long long) start_address * disk->block_size, (size_t) nblocks * disk->block_size);
+        disk->stats.reads++;
+        disk->stats.blocks_read += nblocks;
+        return nblocks;
     }
 
-    free(blockRead);
+    /*Goto the data requested from the disk*/
+    fseeko(disk->fp, (off_t) start_address * disk->block_size, SEEK_SET);
+
+    /*All the blocks requested are read with one transfer*/
+    s = nblocks;
+    fread(buffer, disk->block_size, nblocks, disk->fp);
+
+    disk->stats.reads++;
+    disk->stats.blocks_read += s;
     return s;
 }
 
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    return disk_read(&default_disk_state, start_address, nblocks, buffer);
+}
+
 /*------------------------------------------------------------------*/
 /*Writes a series of blocks to the disk from the buffer             */
 /*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
+int disk_write(struct disk *disk, int start_address, int nblocks, void *buffer)
 {
-    int i, s;
+    int s;
     s = 0;
 
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address + nblocks > disk->max_block)
     {
         printf("out of bound error\n");
         return -1;
     }
 
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    if (disk->nfiles > 0)
+    {
+        s = stripe_io(disk, start_address, nblocks, buffer, 1);
+        if (s < 0)
+        {
+            return -1;
+        }
+        disk->stats.writes++;
+        disk->stats.blocks_written += s;
+        return s;
+    }
 
-    /*For every block requested*/        
-    for (i = 0; i < nblocks; ++i)
+    if (disk->mem != NULL)
     {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
+        memcpy(disk->mem + (long long) start_address * disk->block_size, buffer, (size_t) nblocks * disk->block_size);
+        disk->stats.writes++;
+        disk->stats.blocks_written += nblocks;
+        return nblocks;
+    }
 
-        memcpy(blockWrite, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
+    /*Goto where the data is to be written on the disk*/        
+    fseeko(disk->fp, (off_t) start_address * disk->block_size, SEEK_SET);
 
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
-    }
-    free(blockWrite);
+    /*Pause until the latency duration of every block is elapsed*/
+    usleep(L * nblocks);
+
+    /*All the blocks are written with one transfer*/
+    s = nblocks;
+    fwrite(buffer, disk->block_size, nblocks, disk->fp);
+    fflush(disk->fp);
+    disk->stats.writes++;
+    disk->stats.blocks_written += s;
     return s;
 }
+
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    return disk_write(&default_disk_state, start_address, nblocks, buffer);
+}
@@ -1,5 +1,52 @@
+#include <stdio.h>
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
 int close_disk();
+
+/*Block I/O counters, for benchmarking*/
+struct disk_io_stats {
+    long reads;             /*read_blocks calls*/
+    long writes;            /*write_blocks calls*/
+    long blocks_read;
+    long blocks_written;
+};
+void get_io_stats(struct disk_io_stats *stats);
+
+/*One emulated disk. The functions above all work on a single default disk;
+  the disk_ functions below take the disk to use, so several can be open at once.
+  A filename with commas, like "d0.img,d1.img,d2.img@32", stripes the disk across
+  those files in chunks of 32 blocks (DEFAULT_STRIPE_BLOCKS without the @), and
+  the files of a request are read or written in parallel, by worker threads that
+  last as long as the disk is open.
+  A filename starting with MEMORY_DISK keeps the disk in memory: reads and writes
+  are a memcpy. The memory outlives disk_close, like a file would, so the disk can
+  be opened again until disk_release frees it. ":memory:image" starts from a copy
+  of the image file the first time it's opened, and disk_snapshot saves it to one*/
+#define MEMORY_DISK ":memory:"
+#define MAX_STRIPE_FILES 16
+#define DEFAULT_STRIPE_BLOCKS 16
+struct disk {
+    FILE *fp;
+    int block_size;
+    int max_block;
+    struct disk_io_stats stats;
+    int nfiles;                     /*number of stripe files, 0 if not striped*/
+    int fds[MAX_STRIPE_FILES];
+    int stripe_blocks;              /*blocks per chunk*/
+    struct stripe_pool *pool;       /*worker threads of a striped disk, NULL if none*/
+    char *mem;                      /*contents of a RAM disk, NULL if not in memory*/
+    long long mem_bytes;
+};
+struct disk *default_disk();
+int disk_init_fresh(struct disk *disk, char *filename, int block_size, int num_blocks);
+int disk_init(struct disk *disk, char *filename, int block_size, int num_blocks);
+int disk_read(struct disk *disk, int start_address, int nblocks, void *buffer);
+int disk_write(struct disk *disk, int start_address, int nblocks, void *buffer);
+int disk_close(struct disk *disk);
+int disk_fd(struct disk *disk);
+int disk_load(struct disk *disk, char *filename);
+int disk_snapshot(struct disk *disk, char *filename);
+void disk_release(struct disk *disk);
@@ -10,42 +10,242 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
 
+/* FUSE serves requests from several threads, but the file system is not
+ * safe to use from more than one thread at a time, so every call into it
+ * holds sfs_lock. Only the calls do: copying, allocating and filling in
+ * replies happen outside it. Until the file system has finer-grained
+ * locking of its own, what runs in parallel is the kernel's queueing and
+ * that work, not the file system itself.
+ */
+static pthread_mutex_t sfs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define MAX_EXTENTS 32
+
+/* Paths recently looked up that don't exist, so a program probing for
+ * files that aren't there (as build tools do) gets its answer without
+ * waiting for sfs_lock. A path is only added, and is dropped when a file
+ * of that name is created, with sfs_lock held, so the cache never hides
+ * a file. Each path has one slot, which a later miss can take over.
+ */
+#define MISS_SLOTS 1024
+#define MISS_PATH 128       /* longer paths aren't cached */
+
+static char miss_cache[MISS_SLOTS][MISS_PATH];
+static pthread_mutex_t miss_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *miss_slot(const char *path)
+{
+    unsigned int h = 2166136261u;
+    
+    while (*path)
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    return miss_cache[h % MISS_SLOTS];
+}
+
+static int miss_cached(const char *path)
+{
+    int res;
+    
+    pthread_mutex_lock(&miss_lock);
+    res = strcmp(miss_slot(path), path) == 0;
+    pthread_mutex_unlock(&miss_lock);
+    return res;
+}
+
+/* miss_add() and miss_forget() are called with sfs_lock held.
+ */
+static void miss_add(const char *path)
+{
+    if (strlen(path) >= MISS_PATH)
+        return;
+    pthread_mutex_lock(&miss_lock);
+    strcpy(miss_slot(path), path);
+    pthread_mutex_unlock(&miss_lock);
+}
+
+static void miss_forget(const char *path)
+{
+    pthread_mutex_lock(&miss_lock);
+    miss_slot(path)[0] = '\0';
+    pthread_mutex_unlock(&miss_lock);
+}
+
+/* A read-only virtual file with the statistics of the file system
+ * (sfs_get_stats). Each open takes a snapshot of them as text, which the
+ * handle keeps in fi->fh until release.
+ */
+#define STATS_FILE "/.sfs_stats"
+
+/* stats_snapshot() - the statistics as text, in a buffer of their own.
+ * Called with sfs_lock held.
+ */
+static char *stats_snapshot(void)
+{
+    struct sfs_stats stats;
+    char *text;
+    int len;
+    
+    sfs_get_stats(&stats);
+    len = sfs_stats_text(&stats, NULL, 0);
+    text = malloc(len + 1);
+    sfs_stats_text(&stats, text, len + 1);
+    return text;
+}
+
+static int read_stats(struct fuse_file_info *fi, char *buf, size_t size, off_t offset)
+{
+    char *text = (char *)(uintptr_t)fi->fh;
+    size_t len = strlen(text);
+    
+    if (offset >= len)
+        return 0;
+    if (size > len - offset)
+        size = len - offset;
+    memcpy(buf, text + offset, size);
+    return size;
+}
+
+/* An open file keeps its sfs file id in fi->fh until release. Opening a
+ * file that is already open gives the same id, so handle_refs counts the
+ * FUSE handles sharing each id and the file is closed with the last one.
+ */
+static int *handle_refs;
+static int handle_refs_size;
+
+/* name_too_long() - whether a name in path is longer than the file
+ * system allows.
+ */
+static int name_too_long(const char *path)
+{
+    size_t len;
+    
+    for (; *path; path += len) {
+        if (*path == '/')
+            path++;
+        len = strcspn(path, "/");
+        if (len > MAXFILENAME)
+            return 1;
+    }
+    return 0;
+}
+
+/* open_handle() - open path for a FUSE handle. Called with sfs_lock held.
+ */
+static int open_handle(const char *path, struct fuse_file_info *fi)
+{
+    int fd;
+    
+    /* the stats file is read directly, since its size keeps changing */
+    if (strcmp(path, STATS_FILE) == 0) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+        fi->fh = (uintptr_t)stats_snapshot();
+        fi->direct_io = 1;
+        return 0;
+    }
+    if (name_too_long(path))
+        return -ENAMETOOLONG;
+    
+    fd = sfs_fopen((char *)path);
+    if (fd == -1)
+        return -ENOSPC;
+    miss_forget(path);
+    
+    if (fd >= handle_refs_size) {
+        int size = handle_refs_size ? handle_refs_size : 16;
+        while (size <= fd)
+            size *= 2;
+        handle_refs = realloc(handle_refs, size * sizeof(int));
+        memset(handle_refs + handle_refs_size, 0, (size - handle_refs_size) * sizeof(int));
+        handle_refs_size = size;
+    }
+    handle_refs[fd]++;
+    
+    fi->fh = fd;
+    /* files only change through this mount, so the page cache stays valid
+     * across opens (unless the mount asked for -o direct_io)
+     */
+    fi->keep_cache = 1;
+    return 0;
+}
+
 static int fuse_getattr(const char *path, struct stat *stbuf)
 {
-    int res = 0;
-    int size;
+    struct sfs_dirent entry;
+    int res;
+    char *text;
     
     memset(stbuf, 0, sizeof(struct stat));
+    if (miss_cached(path))
+        return -ENOENT;
+    
+    pthread_mutex_lock(&sfs_lock);
+    if (strcmp(path, STATS_FILE) == 0) {
+        text = stats_snapshot();
+        pthread_mutex_unlock(&sfs_lock);
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = strlen(text);
+        free(text);
+        return 0;
+    }
+    res = sfs_stat(path, &entry);
+    if (res == -1)
+        miss_add(path);
+    pthread_mutex_unlock(&sfs_lock);
     
-    if (strcmp(path, "/") == 0) {
+    if (res == -1)
+        return -ENOENT;
+    stbuf->st_ino = entry.inode;
+    if (entry.dir) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
-    } else if((size = sfs_getfilesize(path)) != -1) {
+    } else {
         stbuf->st_mode = S_IFREG | 0666;
         stbuf->st_nlink = 1;
-        stbuf->st_size = size;
-    } else
-        res = -ENOENT;
-    
-    return res;
+        stbuf->st_size = entry.size;
+    }
+    return 0;
 }
 
 static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         off_t offset, struct fuse_file_info *fi)
 {
-    char file_name[MAXFILENAME];
+    struct sfs_dirent entries[64];
+    struct sfs_dir_cursor cursor = { 0 };
+    struct stat st;
+    int i, n;
     
-    if (strcmp(path, "/") != 0)
+    pthread_mutex_lock(&sfs_lock);
+    n = sfs_listdir(path, &cursor, entries, 64);
+    pthread_mutex_unlock(&sfs_lock);
+    if (n == -1)
         return -ENOENT;
     
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
+    if (strcmp(path, "/") == 0)
+        filler(buf, STATS_FILE + 1, NULL, 0);
     
-    while(sfs_getnextfilename(file_name)) {
-        filler(buf, &file_name[1], NULL, 0);
+    /* list the directory in batches, with the attributes getattr would give */
+    memset(&st, 0, sizeof(st));
+    while (n > 0) {
+        for(i = 0; i < n; i++) {
+            st.st_ino = entries[i].inode;
+            st.st_mode = entries[i].dir ? S_IFDIR | 0755 : S_IFREG | 0666;
+            st.st_nlink = entries[i].dir ? 2 : 1;
+            st.st_size = entries[i].size;
+            filler(buf, entries[i].name, &st, 0);
+        }
+        pthread_mutex_lock(&sfs_lock);
+        n = sfs_listdir(path, &cursor, entries, 64);
+        pthread_mutex_unlock(&sfs_lock);
     }
     
     return 0;
@@ -54,94 +254,214 @@ static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int fuse_unlink(const char *path)
 {
     int res;
-    char filename[MAXFILENAME];
     
-    strcpy(filename, path);
-    res = sfs_remove(filename);
+    if (strcmp(path, STATS_FILE) == 0)
+        return -EACCES;
+    pthread_mutex_lock(&sfs_lock);
+    res = sfs_remove((char *)path);
+    pthread_mutex_unlock(&sfs_lock);
     if (res == -1)
-        return -errno;
+        return -EBUSY;
     
     return 0;
 }
 
-static int fuse_open(const char *path, struct fuse_file_info *fi)
+static int fuse_mkdir(const char *path, mode_t mode)
 {
+    struct sfs_dirent entry;
     int res;
-    char filename[MAXFILENAME];
     
-    strcpy(filename, path);
+    if (name_too_long(path))
+        return -ENAMETOOLONG;
+    pthread_mutex_lock(&sfs_lock);
+    res = sfs_mkdir((char *)path);
+    if (res == 0)
+        miss_forget(path);
+    else
+        res = sfs_stat(path, &entry) == 0 ? -EEXIST : -ENOSPC;
+    pthread_mutex_unlock(&sfs_lock);
+    return res;
+}
+
+static int fuse_rmdir(const char *path)
+{
+    struct sfs_dirent entry;
+    int res;
     
-    res = sfs_fopen(filename);
+    pthread_mutex_lock(&sfs_lock);
+    res = sfs_rmdir((char *)path);
     if (res == -1)
-        return -errno;
+        res = sfs_stat(path, &entry) == -1 ? -ENOENT : entry.dir ? -ENOTEMPTY : -ENOTDIR;
+    pthread_mutex_unlock(&sfs_lock);
+    return res;
+}
+
+static int fuse_open(const char *path, struct fuse_file_info *fi)
+{
+    int res;
+    
+    pthread_mutex_lock(&sfs_lock);
+    res = open_handle(path, fi);
+    pthread_mutex_unlock(&sfs_lock);
+    return res;
+}
+
+static int fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    int fd = fi->fh;
     
-    sfs_fclose(res);
+    if (strcmp(path, STATS_FILE) == 0) {
+        free((char *)(uintptr_t)fi->fh);
+        return 0;
+    }
+    pthread_mutex_lock(&sfs_lock);
+    if (--handle_refs[fd] == 0)
+        sfs_fclose(fd);
+    pthread_mutex_unlock(&sfs_lock);
     return 0;
 }
 
 static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
-    int fd;
     int res;
     
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
-    
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
-    
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
-    
-    res = sfs_fread(fd, buf, size);
+    if (strcmp(path, STATS_FILE) == 0)
+        return read_stats(fi, buf, size, offset);
+    pthread_mutex_lock(&sfs_lock);
+    res = sfs_pread(fi->fh, buf, size, offset);
+    pthread_mutex_unlock(&sfs_lock);
     if (res == -1)
-        return -errno;
+        return -EIO;
     
-    sfs_fclose(fd);
     return res;
 }
 
 static int fuse_write(const char *path, const char *buf, size_t size,
         off_t offset, struct fuse_file_info *fi)
 {
-    int fd;
     int res;
     
-    char filename[MAXFILENAME];
+    pthread_mutex_lock(&sfs_lock);
+    res = sfs_pwrite(fi->fh, buf, size, offset);
+    pthread_mutex_unlock(&sfs_lock);
+    if (res == -1)
+        return -EIO;
+    if (res == 0 && size > 0)
+        return -EFBIG;
     
-    strcpy(filename, path);
+    return res;
+}
+
+/* fuse_read_buf() - read the parts of the file stored as they are in the
+ * disk image straight from the image's file descriptor into the reply,
+ * and only the rest through sfs_pread. They are copied before sfs_lock is
+ * released: FUSE would splice from the image after this returns, by which
+ * time a write, dedup, the log cleaner or a remove could have given the
+ * blocks to another file.
+ */
+static int fuse_read_buf(const char *path, struct fuse_bufvec **bufp,
+        size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec empty = FUSE_BUFVEC_INIT(0);
+    struct fuse_bufvec *bv;
+    struct sfs_extent ext[MAX_EXTENTS];
+    size_t done = 0;
+    char *mem;
+    int i, n, disk_fd, res = 0;
     
-    fd = sfs_fopen(filename);
-    if (fd == -1) 
-        return -errno;
+    bv = malloc(sizeof(struct fuse_bufvec));
+    *bv = empty;
+    mem = malloc(size);
+    bv->buf[0].mem = mem;
+    *bufp = bv;
     
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+    if (strcmp(path, STATS_FILE) == 0) {
+        bv->buf[0].size = read_stats(fi, mem, size, offset);
+        return 0;
+    }
+    pthread_mutex_lock(&sfs_lock);
+    disk_fd = sfs_disk_fd();
+    while (done < size && res == 0) {
+        n = sfs_fmap(fi->fh, offset + done, size - done, ext, MAX_EXTENTS);
+        if (n <= 0) {
+            res = n < 0 ? -EIO : 0;
+            break;
+        }
+        for (i = 0; i < n && res == 0; i++) {
+            if (ext[i].pos >= 0) {
+                if (pread(disk_fd, mem + done, ext[i].length, ext[i].pos) != ext[i].length)
+                    res = -EIO;
+            } else {
+                if (sfs_pread(fi->fh, mem + done, ext[i].length, ext[i].offset) != ext[i].length)
+                    res = -EIO;
+            }
+            done += ext[i].length;
+        }
+    }
+    pthread_mutex_unlock(&sfs_lock);
     
-    res = sfs_fwrite(fd, buf, size);
+    bv->buf[0].size = done;
+    return res;
+}
+
+/* fuse_write_buf() - a write that arrives in one memory buffer is passed
+ * on as it is. Anything else (a pipe, or several pieces) is gathered into
+ * one buffer first, since the file system needs the data in memory to
+ * checksum, fingerprint or compress it.
+ */
+static int fuse_write_buf(const char *path, struct fuse_bufvec *buf,
+        off_t offset, struct fuse_file_info *fi)
+{
+    size_t size = fuse_buf_size(buf);
+    struct fuse_bufvec flat = FUSE_BUFVEC_INIT(size);
+    char *data, *mem = NULL;
+    int res;
+    
+    if (buf->count == 1 && buf->idx == 0 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+        data = (char *)buf->buf[0].mem + buf->off;
+    } else {
+        mem = malloc(size);
+        flat.buf[0].mem = mem;
+        res = fuse_buf_copy(&flat, buf, 0);
+        if (res < 0) {
+            free(mem);
+            return res;
+        }
+        size = res;
+        data = mem;
+    }
+    
+    pthread_mutex_lock(&sfs_lock);
+    res = sfs_pwrite(fi->fh, data, size, offset);
+    pthread_mutex_unlock(&sfs_lock);
+    free(mem);
     if (res == -1)
-        return -errno;
+        return -EIO;
+    if (res == 0 && size > 0)
+        return -EFBIG;
     
-    sfs_fclose(fd);
     return res;
 }
 
+/* Truncating works on open files too (ftruncate, or open with O_TRUNC
+ * while another handle is open), so the file is cut to size in place.
+ */
 static int fuse_truncate(const char *path, off_t size)
 {
-    char filename[MAXFILENAME];
-    int fd;
-    
-    strcpy(filename, path);
+    int res, exists;
     
-    fd = sfs_remove(filename);
-    if (fd == -1)
-        return -errno;
+    if (strcmp(path, STATS_FILE) == 0)
+        return -EACCES;
+    if (size > INT_MAX)
+        return -EFBIG;
     
-    fd = sfs_fopen(filename);
-    sfs_fclose(fd);
+    pthread_mutex_lock(&sfs_lock);
+    res = sfs_truncate((char *)path, (int)size);
+    exists = res == -1 && sfs_getfilesize((char *)path) != -1;
+    pthread_mutex_unlock(&sfs_lock);
+    if (res == -1)
+        return exists ? -EFBIG : -ENOENT;
     return 0;
 }
 
@@ -155,33 +475,96 @@ static int fuse_mknod(const char *path, mode_t mode, dev_t rdev)
     return 0;
 }
 
-static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp)
+static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-    char filename[MAXFILENAME];
-    int fd;
+    int res;
     
-    strcpy(filename, path);
-    fd = sfs_fopen(filename);
+    pthread_mutex_lock(&sfs_lock);
+    res = open_handle(path, fi);
+    pthread_mutex_unlock(&sfs_lock);
+    return res;
+}
+
+/* With -o writeback, writes go to memory and are written back by a
+ * thread in the file system, so a crash can lose the last second or so of
+ * writes the kernel was told had succeeded. It's off unless asked for.
+ * The thread is started here rather than in main, since fuse_main forks
+ * into the background first, and stopped (writing everything out) when
+ * the file system is unmounted.
+ */
+static int writeback_opt;
+
+static const struct fuse_opt sfs_opts[] = {
+    { "writeback", 0, 1 },
+    FUSE_OPT_END
+};
+
+static void *fuse_init(struct fuse_conn_info *conn)
+{
+    if (writeback_opt) {
+        pthread_mutex_lock(&sfs_lock);
+        sfs_writeback(1);
+        pthread_mutex_unlock(&sfs_lock);
+    }
+    return NULL;
+}
+
+static void fuse_destroy(void *private_data)
+{
+    pthread_mutex_lock(&sfs_lock);
+    sfs_writeback(0);
+    pthread_mutex_unlock(&sfs_lock);
+}
+
+static int fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    int res;
     
-    sfs_fclose(fd);
-    return 0;
+    pthread_mutex_lock(&sfs_lock);
+    res = sfs_fsync(fi->fh);
+    pthread_mutex_unlock(&sfs_lock);
+    return res < 0 ? -EBADF : 0;
 }
 
 static struct fuse_operations xmp_oper = {
     .getattr = fuse_getattr,
     .readdir = fuse_readdir,
     .mknod = fuse_mknod,
+    .mkdir = fuse_mkdir,
     .unlink = fuse_unlink,
+    .rmdir = fuse_rmdir,
     .truncate = fuse_truncate,
     .open = fuse_open, 
+    .release = fuse_release,
     .read = fuse_read, 
     .write = fuse_write, 
+    .read_buf = fuse_read_buf,
+    .write_buf = fuse_write_buf,
     .access = fuse_access,
     .create = fuse_create,
+    .fsync = fuse_fsync,
+    .init = fuse_init,
+    .destroy = fuse_destroy,
 };
 
 int main(int argc, char *argv[])
 {
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    int i, res;
+    
+    /* Nothing else changes the disk while it's mounted, so the kernel can
+     * cache attributes and lookups for a while. Options on the command line
+     * come later and override these; -s still gives a single-threaded loop.
+     */
+    fuse_opt_add_arg(&args, argv[0]);
+    fuse_opt_add_arg(&args, "-oattr_timeout=10,entry_timeout=10,negative_timeout=1");
+    for (i = 1; i < argc; i++)
+        fuse_opt_add_arg(&args, argv[i]);
+    if (fuse_opt_parse(&args, &writeback_opt, sfs_opts, NULL) == -1)
+        return 1;
+    
     mksfs(1);
-    return fuse_main(argc, argv, &xmp_oper, NULL);
+    res = fuse_main(args.argc, args.argv, &xmp_oper, NULL);
+    fuse_opt_free_args(&args);
+    return res;
 }
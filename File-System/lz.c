@@ -0,0 +1,171 @@
+#include <string.h>
+#include "lz.h"
+
+/*
+Each sequence is a token byte (literal count in the high 4 bits, match length - 4 in the low 4 bits),
+the literals, then a 2 byte little-endian match offset. A count of 15 continues in extra bytes
+(255 = keep adding). The last sequence only has literals, and the last 5 bytes are always literals.
+*/
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12 // no match starts in the last 12 bytes
+#define MAX_OFFSET 65535
+
+static unsigned int hash4(const unsigned char *p) {
+	unsigned int v;
+	memcpy(&v, p, 4);
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// write the extra bytes of a length that didn't fit in its 4 bit field. returns the new output position
+static unsigned char *put_length(unsigned char *op, int len) {
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (unsigned char) len;
+	return op;
+}
+
+// emit one sequence: literals [anchor, anchor + lit) followed by a match (match_len 0 = last sequence)
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend, const unsigned char *anchor,
+		int lit, int offset, int match_len) {
+	// token + literal length bytes + literals + offset + match length bytes
+	if (op + 1 + lit/255 + 1 + lit + 2 + match_len/255 + 1 > oend) {
+		return NULL;
+	}
+	int ml = match_len > 0 ? match_len - MIN_MATCH : 0;
+	unsigned char *token = op++;
+
+	*token = (unsigned char) ((lit < 15 ? lit : 15) << 4);
+	if (lit >= 15) {
+		op = put_length(op, lit - 15);
+	}
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	if (match_len > 0) {
+		*op++ = offset & 0xff;
+		*op++ = (offset >> 8) & 0xff;
+		*token |= ml < 15 ? ml : 15;
+		if (ml >= 15) {
+			op = put_length(op, ml - 15);
+		}
+	}
+	return op;
+}
+
+int lz_compress(const char *src, int n, char *dst, int cap) {
+	const unsigned char *base = (const unsigned char *) src;
+	const unsigned char *ip = base;
+	const unsigned char *anchor = base;
+	const unsigned char *end = base + n;
+	unsigned char *op = (unsigned char *) dst;
+	unsigned char *oend = op + cap;
+	int table[1 << HASH_BITS];
+
+	for (int i = 0; i < (1 << HASH_BITS); i++) {
+		table[i] = -1;
+	}
+
+	// 1. find matches with a hash table of the last position of each 4 byte sequence
+	while (n > MATCH_LIMIT && ip < end - MATCH_LIMIT) {
+		unsigned int h = hash4(ip);
+		int ref = table[h];
+		table[h] = ip - base;
+
+		if (ref < 0 || (ip - base) - ref > MAX_OFFSET || memcmp(base + ref, ip, MIN_MATCH) != 0) {
+			ip++;
+			continue;
+		}
+		// extend the match as far as it goes
+		const unsigned char *match = base + ref;
+		int len = MIN_MATCH;
+		while (ip + len < end - LAST_LITERALS && match[len] == ip[len]) {
+			len++;
+		}
+		op = put_sequence(op, oend, anchor, ip - anchor, ip - match, len);
+		if (op == NULL) {
+			return -1;
+		}
+		ip += len;
+		anchor = ip;
+	}
+
+	// 2. everything after the last match is literals
+	op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+	if (op == NULL) {
+		return -1;
+	}
+	return op - (unsigned char *) dst;
+}
+
+// read the extra bytes of a length field. returns -1 if the input runs out
+static int get_length(const unsigned char **ip, const unsigned char *iend) {
+	int len = 0;
+	unsigned char b;
+	do {
+		if (*ip >= iend) {
+			return -1;
+		}
+		b = *(*ip)++;
+		len += b;
+	} while (b == 255);
+	return len;
+}
+
+int lz_decompress(const char *src, int n, char *dst, int cap) {
+	const unsigned char *ip = (const unsigned char *) src;
+	const unsigned char *iend = ip + n;
+	unsigned char *op = (unsigned char *) dst;
+	unsigned char *oend = op + cap;
+
+	while (ip < iend) {
+		unsigned char token = *ip++;
+		int lit = token >> 4;
+		if (lit == 15) {
+			int extra = get_length(&ip, iend);
+			if (extra < 0) {
+				return -1;
+			}
+			lit += extra;
+		}
+		if (lit > iend - ip || lit > oend - op) {
+			return -1;
+		}
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+
+		// last sequence has no match
+		if (ip == iend) {
+			break;
+		}
+		if (iend - ip < 2) {
+			return -1;
+		}
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		int len = (token & 0x0f);
+		if (len == 15) {
+			int extra = get_length(&ip, iend);
+			if (extra < 0) {
+				return -1;
+			}
+			len += extra;
+		}
+		len += MIN_MATCH;
+		if (offset == 0 || offset > op - (unsigned char *) dst || len > oend - op) {
+			return -1;
+		}
+		// copy byte by byte, the match may overlap the output
+		const unsigned char *match = op - offset;
+		for (int i = 0; i < len; i++) {
+			op[i] = match[i];
+		}
+		op += len;
+	}
+	return op - (unsigned char *) dst;
+}
@@ -0,0 +1,12 @@
+#ifndef LZ_H
+#define LZ_H
+// Small LZ77 codec (LZ4 block format) used for compressed sfs files.
+
+// compress n bytes of src into dst. returns the compressed size, or -1 if it doesn't fit in cap bytes
+int lz_compress(const char *src, int n, char *dst, int cap);
+
+// decompress n bytes of src into dst. returns the decompressed size, or -1 if the data is corrupt
+// or doesn't fit in cap bytes
+int lz_decompress(const char *src, int n, char *dst, int cap);
+
+#endif
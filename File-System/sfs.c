@@ -6,56 +6,88 @@
 #include <time.h>
 #include <math.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
+#include "lz.h"
+#include "crc32c.h"
+#include "sfs_trace.h"
 
 /*
 Name: Jasmine Taggart
 ID: 261056534
 
 NOTE: include -lm in Make file to use ceil() and floor()
-max number of files = 100
 man file name length = 16
-number of available data blocks = 4096 - 3 for directory, 4093 for files + block pointers
+the number of files and data blocks is set when the disk is created (sfs_geometry), by default
+100 files and 4096 data blocks
 
-disk structure: 
+disk structure (sizes for the default geometry):
  block 0 - super node
- blocks 1 to 6 - i-node table
- blocks 7 to 4102 - data blocks
-   - 7 to 9 = directory
-   - 10 to 4102 = file data blocks
- blocks 4103 to 4106 - free bit map
+ blocks 1 to 6 - i-node table (inode 0 is the root directory)
+ blocks 7 to 8 - directory
+ blocks 9 to 4104 - data blocks
+ blocks 4105 to 4108 - free bit map
+ blocks 4109 to 4112 - block reference counts (data blocks shared by cloned or deduplicated files)
+ blocks 4113 to 4144 - data block fingerprints (dedup mode)
+ blocks 4145 to 4161 - crc32c of every block from 1 to 4144 (checksum mode)
+ block 4162 - log checkpoint (log-structured disks only)
 
- num inodes per inode block = 18.3
+ with block groups (sfs_blockgroups), the directory comes first and the data blocks are split into
+ groups of 1024, each starting with its fbm block and its slice of the inode table:
+ block 0 - super node
+ blocks 1 to 2 - directory
+ blocks 3 to 4110 - 4 groups of 1027 blocks: fbm block, 2 inode table blocks, 1024 data blocks
+ blocks 4111 to 4163 - block reference counts, fingerprints and crc32c, as above
+
+ compressed files are stored in clusters of 4 file blocks. a cluster that compresses to 3 blocks
+ or less is stored as [2 byte compressed length][lz data], with COMPRESSED_PTR set on its first pointer
+ and the pointers it doesn't need left 0. other clusters are stored as plain blocks
+
+ on-disk format (version 3): the inode table and directory follow the superblock, so a mount reads
+ them with a single read. inodes are stored packed as struct disk_inode (60 bytes, 17 per block)
+ and directory entries as struct disk_dirent (20 bytes). index blocks and the fingerprint table are
+ only read when a file first needs them
 */
-char *disk_file = "sfs_disk";
 int DISK_BLOCK_SIZE = 1024;
-int NUM_BLOCKS = 4107;
-int FBM_BLOCK = 4103;
-int INODE_BLOCK = 1;
-int DATA_BLOCK = 7; // first 3 data blocks are root dir
 int ROOT_INODE = 0;
+int INODE_BLOCK = 1;
 
-char free_bit_map[4096];
+#define MAX_GEOMETRY (1 << 24) // max files and data blocks
+#define DEFAULT_FILES 100
+#define DEFAULT_DATA_BLOCKS 4096
 
 struct dir_entry {
 	char filename[17];
 	int inode;
 	bool occupied;
-} directory[100]; // each entry = 21B
+};
 
 struct opened_file {
 	int inode;
 	int fp; //read/write ptr
 	bool open;
-} fdt[100];
+	int resv_start; // the allocation window reserved for it in resv_map
+	int resv_len;
+};
+
+// open file descriptor table, doubled in size whenever every slot is in use
+#define FDT_START_SIZE 16
+
+// tiny files keep their data in the inode, where the block pointers would be, until they grow past
+// INLINE_BYTES. reading one needs no data blocks at all
+#define INLINE_BYTES 52 // direct_ptr + indirect_ptr
 
 struct inode {
 	bool occupied;
+	bool dir; // a subdirectory, whose data is its entries
+	bool compressed; // data is stored in compressed clusters
+	bool inlined; // data is stored in inline_data (the block pointers are all 0)
 	int filesize; // in bytes
 	int direct_ptr[12];
 	int indirect_ptr;
-} inode_table[101];
+	char inline_data[INLINE_BYTES];
+};
 
 struct super_block {
 	int magic;
@@ -63,524 +95,5047 @@ struct super_block {
 	int sfs_size;
 	int inode_table_length;
 	int root_inode;
+	int flags;
+	int version;
+	int num_inodes;
+	int num_data_blocks;
 };
 
-int get_next_file_num = 0;
+#define SFS_MAGIC 1
+#define SFS_VERSION 3 // version 2 had a fixed geometry with the directory in the data blocks
 
-void mksfs(int fresh) {
-	if (!fresh) {
-		// 1. load existing disk - if unsuccessful, exit
-		if (init_disk(disk_file, DISK_BLOCK_SIZE, NUM_BLOCKS) != 0) {
-			perror("init_disk error");
-			exit(1);
-		}
-		
-		// 2. cache inode table
-		read_blocks(INODE_BLOCK, 6, inode_table);
-		
-		// 3. cache root directory
-		int dir_size = inode_table[0].filesize; // num bytes in directory
-		int numDirBlocks = (int) ceil(dir_size/3.0); // num blocks to read for dir
+// packed on-disk inode and directory entry: only int and char fields, so there is no padding
+struct disk_inode {
+	int flags; // DI_OCCUPIED | DI_COMPRESSED | DI_INLINE | DI_DIR
+	int filesize;
+	int direct_ptr[12]; // with DI_INLINE, direct_ptr and indirect_ptr hold the file's data instead
+	int indirect_ptr;
+};
 
-		// read directory data blocks
-		char *dir_blocks = malloc(numDirBlocks*DISK_BLOCK_SIZE);
-		for (int i = 0; i < numDirBlocks; i++) {
-			read_blocks(inode_table[0].direct_ptr[i], 1, dir_blocks + DISK_BLOCK_SIZE*i);
-		}
-		
-		// copy 21B of directory data blocks at a time into the corresponding file entry in dir table
-		// (each entry is 21B)
-		for (int i = 0; i < dir_size/21; i++) {
-			memcpy(directory[i].filename, dir_blocks + i*21, 16);
-			
-			int* inode = (int *) malloc(sizeof(int));
-			memcpy(inode, dir_blocks + i*21 +16, 4);
-			directory[i].inode = *inode;
-			
-			bool* occupied = (bool *) malloc(sizeof(bool));
-			memcpy(occupied, dir_blocks + i*21 +20, 1);
-			directory[i].occupied = *occupied;
+#define DI_OCCUPIED 1
+#define DI_COMPRESSED 2
+#define DI_INLINE 4
+#define DI_DIR 8
 
-			free(inode);
-			free(occupied);
-		}
+struct disk_dirent {
+	char filename[16]; // not null terminated if the name is 16 characters long
+	int inode; // -1 = free entry (in a subdirectory: DIR_FREE or DIR_REMOVED)
+};
 
-		// 4. cache free bit map
-		read_blocks(FBM_BLOCK, 4, free_bit_map);
+#define SB_COMPRESS 1 // new files are compressed
+#define SB_DEDUP 2 // written blocks are deduplicated
+#define SB_CHECKSUM 4 // blocks are checksummed
+#define SB_HASHED 8 // the fingerprint table has been written to (otherwise it's all 0)
+#define SB_LOG 16 // log-structured: every update is appended to the log
+#define SB_GROUPS 32 // block groups: the fbm and inode table are split up and kept with the data blocks
 
-		// 5. free unneeded allocated memory
-		free(dir_blocks);
-	}
-	else {
-		// 1. initialize disk - if unsuccessful, exit
-		if (init_fresh_disk(disk_file, DISK_BLOCK_SIZE, NUM_BLOCKS) != 0) {
-			perror("init_fresh_disk error");
-			exit(1);
-		}
+#define CLUSTER_BLOCKS 4
+#define CLUSTER_SIZE (CLUSTER_BLOCKS*1024)
+#define COMPRESSED_PTR 0x40000000 // flag on the first pointer of a compressed cluster
 
-		// 2. set up free bit map (cached in memory)
-		for (int i = 0; i < DISK_BLOCK_SIZE*4; i++) { // first 3 are for directory so leave those bytes as 0
-			if (i < 3) {
-				free_bit_map[i] = '0';
-			}
-			else free_bit_map[i] = '1';
-		}
-		write_blocks(FBM_BLOCK, 4, free_bit_map); // write fbm to disk using 4 blocks
-		
-		// 3. set up empty root directory on disk
-		write_blocks(DATA_BLOCK, 3, directory); // put directory in first 3 data blocks
-		
-		// 4. create i node table + root dir i node
-		inode_table[0].occupied = true;
-		inode_table[0].filesize = 0;
-		inode_table[0].direct_ptr[0] = DATA_BLOCK;
-		inode_table[0].direct_ptr[1] = DATA_BLOCK + 1;
-		inode_table[0].direct_ptr[2] = DATA_BLOCK + 2;
-		write_blocks(INODE_BLOCK, 6, inode_table);
-		
-		// 5. set up super block on disk
-		struct super_block *superblock = (struct super_block *) calloc(1, sizeof(struct super_block));
-		superblock->magic = 1;
-		superblock->block_size = 1024;
-		superblock->sfs_size = 4107;
-		superblock->inode_table_length = 6;
-		superblock->root_inode = 0; // directory is the first i-node in i-node table
-		write_blocks(0, 1, superblock);
-		free(superblock);
-	}
-}
+#define SCRUB_CHUNK 64 // blocks per read when checksumming the whole disk
 
-int sfs_fopen(char *fname) {
-	// first check if file name is too long
-	if (strlen(fname) > 16) {
-		printf("sfs_fopen error: file name %s is too long\n", fname);
-		return -1;
-	}
-	// 1. search directory for file
-	int f_inode = -1;
-	int fd = -1;
+// directory name filter (find_file): NAME_FILTER_COUNTERS one-byte counters per directory entry, at least
+// NAME_FILTER_MIN, and each name is hashed to NAME_HASHES of them (about 3% false positives when full)
+#define NAME_FILTER_COUNTERS 8
+#define NAME_FILTER_MIN 64
+#define NAME_HASHES 3
 
-	for (int i = 0; i < 100; i++) {
-		// 2. if file is found, check if file is already opened (if it is, return its fd)
-		if (strcmp(directory[i].filename, fname) == 0) { 
-			f_inode = directory[i].inode;
-			for (int j = 0; j < 100; j++) {
-				if (fdt[j].inode == f_inode && fdt[j].open) {
-					fd = j;
-					break;
-				}
-			}
-			// if file is not opened, find next empty slot in fdt and add file to it
-			if (fd == -1) {
-				for (int j = 0; j < 100; j++) {
-					if (!fdt[j].open) {
-						fdt[j].inode = f_inode;
-						fdt[j].fp = inode_table[f_inode].filesize;
-						fdt[j].open = true;
-						fd = j;
-						break;
-					}
-				}
-			}
-			if (fd == -1) {
-				printf("sfs_fopen: no fdt slot found\n");
-				return -1;
-			}
-			break;
-		}
-	}
+// subdirectories (sfs_mkdir) are files of struct disk_dirent slots (DIR_SLOTS a block), kept as a hash
+// table so a name is found, added or removed by reading a block or two however large the directory is.
+// slot 0 is a struct dir_header. a name goes in the first unused slot from the one its hash picks
+// (linear probing), and a removed name leaves a DIR_REMOVED slot so the names after it are still found.
+// the table is rebuilt twice as large (or just without its removed slots) when DIR_LOAD of it is used.
+// a table can't grow past DIR_MAX_BLOCKS (about 10000 names), so then the directory is sharded (extendible
+// hashing): its names move to tables of their own (shards, directory inodes that aren't in any directory),
+// and the directory becomes 2^depth shard pointers (DIR_PTRS a block, from block 1), one for each value of
+// the low depth bits of the top half of a name's hash. a shard that is full is split in two by the next
+// bit of the hash, doubling the pointers if it had as many bits as they do, so a directory can hold as many
+// names as there are inodes for them (up to 2^DIR_MAX_DEPTH shards). shards aren't merged again
+#define DIR_SLOTS 51 // 1024/sizeof(struct disk_dirent)
+#define DIR_MAX_BLOCKS 268
+#define DIR_LOAD 0.75
+#define DIR_MAGIC 0x53444952
+#define DIR_SHARDS_MAGIC 0x53484453 // a sharded directory's header
+#define DIR_PTRS (DISK_BLOCK_SIZE/(int) sizeof(int))
+#define DIR_MAX_DEPTH 16 // 256 blocks of pointers
+#define DIR_SHARD_POS 16384 // listing position: pointer*DIR_SHARD_POS + slot (more than DIR_MAX_BLOCKS*DIR_SLOTS)
+#define DIR_FREE 0 // inode of an unused slot (blocks start out all 0)
+#define DIR_REMOVED -1
 
-	// 3. if file is not found, create a new file and add it to fdt
-	if (f_inode == -1) {
-		// find next available slot in inode table and create inode for new file
-		for (int i = 0; i < 101; i++) {
-			if (!inode_table[i].occupied) {
-				f_inode = i;
-				inode_table[i].occupied = true;
-				inode_table[i].filesize = 0;
-				break;
-			}
-		}
-		// if no available slot was found in inode table, print error
-		if (f_inode == -1) {
-			printf("sfs_fopen error: failed to create file %s, inode table is full.\n", fname);
-			return -1;
-		}
+struct dir_header {
+	int magic;
+	int entries; // names in the directory (0 in a sharded one)
+	int used; // slots that aren't DIR_FREE (entries + removed)
+	int depth; // bits of the hash that pick a shard (sharded directory), or that a shard's names share
+	int parent; // the sharded directory a shard is part of, or 0
+};
 
-		// create directory entry
-		int entry = -1;
-		for (int i = 0; i < 100; i++) {
-			if (!directory[i].occupied) {
-				entry = i;
-				strcpy(directory[i].filename, fname);
-				directory[i].inode = f_inode;
-				directory[i].occupied = true;
-				break;
-			}
-		}
-		// if no available slot was found in directory table, print error
-		if (entry == -1) {
-			printf("sfs_fopen error: failed to create file %s, directory table is full.\n", fname);
-			return -1;
-		}
+// sfs_fsck counts the block pointers of the inodes, then checks the fbm and reference counts of the data
+// blocks against the counts, each split between FSCK_THREADS threads. index blocks that aren't cached are
+// read in block order, with one read for each run of them less than FSCK_SPAN blocks apart
+#define FSCK_THREADS 4
+#define FSCK_SPAN 64
 
-		// add file to fdt
-		for (int i = 0; i < 100; i++) {
-			if (!fdt[i].open) {
-				fdt[i].inode = f_inode;
-				fdt[i].fp = 0;
-				fdt[i].open = true;
-				fd = i;
-				break;
-			}
-		}
-		if (fd == -1) {
-				printf("sfs_fopen: no fdt slot found\n");
-				return -1;
-			}
+// the part of the inodes (or data blocks) one sfs_fsck thread checks, and what it found
+struct fsck_job {
+	struct sfs *sfs;
+	int first;
+	int last;
+	bool repair;
+	bool *live; // inodes that keep their blocks: occupied, with a directory entry
+	bool *has_index; // set for each live inode whose index block is counted
+	int *uses; // number of file block pointers to each data block, indexed like the fbm
+	int *fixed; // number of index blocks (and log mode inode table and directory blocks) in each data block
+	bool *freed; // data blocks freed by the repair, whose fingerprints are dropped afterwards
+	int bad_inodes;
+	int double_allocated;
+	int leaked;
+	int unmarked;
+};
 
-		// update disk (directory + inode)
-		write_blocks(DATA_BLOCK, 3, directory); // write directory to disk
-		write_blocks(INODE_BLOCK, 6, inode_table); // write inode table to disk
-	}
-	return fd;
-}
+// log-structured mode: the data blocks are split into segments, and every block that's written (data,
+// index blocks and the inode table and directory blocks) goes to the head of the log in the current
+// segment instead of being rewritten in place. the blocks of one operation are buffered and written
+// with a single sequential write, starting with a summary block that says which of them are inode table
+// or directory blocks. meta_map says where each of those blocks is now. it's saved in the checkpoint
+// whenever the log moves to a new segment, and a mount brings it up to date from the summaries written
+// since. the fbm isn't written, a mount works it out from the inodes. the cleaner frees segments by
+// moving their live blocks to the head of the log
+#define SEGMENT_BLOCKS 64
+#define LOG_MIN_SEGMENTS 12 // smaller disks can't be log-structured
+#define LOG_MIN_FREE 6 // the cleaner runs when fewer segments than this are free (enough for the largest write)
+#define LOG_MAGIC 0x534c4f47
 
-int sfs_fclose(int fileID) {
-	if (fileID > 99 || !fdt[fileID].open) {
-		printf("sfs_fclose: file id %d is not open\n", fileID);
-		return -1;
-	}
-	fdt[fileID].open = false;
-	return 0;
-}
+struct log_summary {
+	int magic;
+	int seq; // summaries are numbered in the order they're written
+	int nblocks; // blocks after the summary
+	int meta[SEGMENT_BLOCKS]; // inode table / directory block each block holds (-1 = other data)
+};
 
-int sfs_remove(char* fname) {
-	int dir_entry = -1;
-	int inode = -1;
-	int index_block[256];
-	
-	// 1. search for file in directory
-	for (int i = 0; i < 100; i++) {
-			if (strcmp(directory[i].filename, fname) == 0) {
-				// if file is found in dir then make sure it is closed before removing it
-				for (int j = 0; j < 100; j++) {
-					if (fdt[j].inode == directory[i].inode && fdt[j].open) {
-						printf("sfs_remove error: file %s is still open.\n", fname);
-						return -1;
-					}
-				}
-				dir_entry = i;
-				inode = directory[i].inode;
-
-				// 2. free the data blocks associated to file in fbm
-				int numPtrs = (int) ceil((double) inode_table[inode].filesize/DISK_BLOCK_SIZE); // get number of blocks the file uses
-
-				// if file used index block to point to data blocks, cache index block and free it
-				if (numPtrs > 12) {
-					read_blocks(inode_table[inode].indirect_ptr, 1, index_block);
-					free_bit_map[inode_table[inode].indirect_ptr] = '0';
-				} 
-
-				for (int j = 0; j < numPtrs; j++) {
-					if (j < 12) {
-						free_bit_map[inode_table[inode].direct_ptr[j]] = '0';
-					}
-					else {
-						free_bit_map[index_block[j - 12]] = '0';
-					}
-				}
+struct log_checkpoint {
+	int magic;
+	int seq; // of the next summary
+	int seg_start; // the segment being written
+	int head; // next block of it
+	int meta_map[]; // one per inode table and directory block (0 = in its place after the superblock)
+};
 
-				// 3. set entry's occupied flag to false so that entry slot can be reused
-				directory[i].occupied = false;
-				break;
-			}
-	}
-	if (dir_entry == -1) {
-		printf("sfs_remove error: file %s not found.\n", fname);
-		return -1;
-	}
+// block groups: the data blocks are split into groups of GROUP_DATA_BLOCKS, and each group starts with
+// its own slice of the fbm (one block) and of the inode table. a file's blocks are allocated in the group
+// of its inode, so writing to it touches the inode, fbm and data blocks of one part of the disk instead of
+// both ends of it. the directory stays after the superblock and the other tables stay at the end
+#define GROUP_DATA_BLOCKS 1024 // one fbm block
 
-	// remove inode entry 
-	inode_table[inode].occupied = false;
+// write-back (sfs_writeback): blocks are written to memory, and a flusher thread writes them to the disk
+// once they've been dirty for WB_EXPIRE seconds, or all of them once more than WB_BACKGROUND_RATIO
+// percent of the disk is dirty. a write that finds WB_DIRTY_RATIO percent dirty writes them out itself.
+// sfs_sync and sfs_fsync write everything out
+#define WB_EXPIRE 1.0
+#define WB_INTERVAL 0.1 // how often the flusher wakes up, in seconds
+#define WB_BACKGROUND_RATIO 2
+#define WB_DIRTY_RATIO 10
+#define WB_MIN_DIRTY 16 // the dirty limits on very small disks
+#define WB_HASH_SIZE 1024
 
-	// update disk (fbm + inode + directory)
-	write_blocks(FBM_BLOCK, 4, free_bit_map); // write fbm to disk using 4 blocks
-	write_blocks(DATA_BLOCK, 3, directory); // write directory to disk
-	write_blocks(INODE_BLOCK, 6, inode_table); // write inode table to disk
-	return 0;
-}
+struct wb_block {
+	int block_num;
+	double dirtied; // when it was first written since it was last on disk
+	struct wb_block *hash_next;
+	struct wb_block *next; // in the order they were first written
+	char data[];
+};
 
-int sfs_fwrite(int fileID, const char* buffer, int length) {
-	// check if file is open. if not, return 0
-	if (!fdt[fileID].open) {
-		printf("sfs_fwrite: file not open\n");
-		return 0;
-	}
+// in-memory allocation windows: fd + 1 of the open file each free data block is reserved for (0 = not reserved).
+// appends to different open files take blocks from their own windows, so their blocks don't interleave
+#define RESV_WINDOW 8
 
-	// define variables needed to determine number of blocks to allocate on disk and which data blocks to write to
-	int inode = fdt[fileID].inode;
-	int start_byte = fdt[fileID].fp;
-	int end_byte = start_byte + length - 1;
-	// printf("start byte: %d\n", start_byte);
-	// printf("end byte: %d\n", end_byte);
+// free data blocks are counted in chunks of the fbm, so allocation can skip over full ones
+#define FREE_CHUNK 1024
 
-	// check if file is full
-	if (start_byte >= 268*DISK_BLOCK_SIZE) {
-		puts("sfs_fwrite: file is full");
-		return 0;
-	}
-	// check if write exceeds max number of data blocks a file can have (268) and reduce write size if necessary
-	if (end_byte >= 268*DISK_BLOCK_SIZE) {
-		end_byte = 268*DISK_BLOCK_SIZE - 1;
-		length = end_byte - start_byte + 1;
-	}
+// everything about one mounted file system. the tables are allocated by alloc_tables() when the disk
+// is mounted; tables that are written to disk are allocated in whole blocks
+struct sfs {
+	char *disk_file;
+	struct disk *disk;
+	struct disk own_disk; // the disk of an instance made by sfs_mount (mksfs uses the default disk)
 
-	int last_block = (int) ceil((double) inode_table[inode].filesize/DISK_BLOCK_SIZE) - 1; // the last file block allocated for this file before the write
-	int startw_block = (int) floor((double) start_byte/DISK_BLOCK_SIZE); // file block that our write starts in
-	int endw_block = (int) floor((double) end_byte/DISK_BLOCK_SIZE); // file block that our write ends in
-	int num_new_blocks = endw_block - last_block; //number of new data blocks to allocate for this write
-	int new_block_num = -1; // data block number obtained from fbm for each new block for this file
-	int index_block[256]; // cache for the index block, if necessary to retrieve it
-	
-	// cache index block if pointers will be needed beyond the 12 direct ptrs
-	if (endw_block > 11) {
-		// if indirect ptr hasn't been used yet, find a free block for index block in fbm
-		if (inode_table[inode].indirect_ptr == 0) {
-			for (int i = 0; i < 4096; i++) {
-				if (free_bit_map[i] == '1') {
-					free_bit_map[i] = '0';
-					inode_table[inode].indirect_ptr = i + DATA_BLOCK;
-					break;
-				}
-			}
-			if (inode_table[inode].indirect_ptr == 0) {
-				printf("sfs_fwrite: no space to allocate to index block\n");
-				return -1;
-			}
-		}
-		read_blocks(inode_table[inode].indirect_ptr, 1, index_block);
-	}
+	// disk geometry, read from the superblock when the disk is mounted. the block numbers of each region
+	// are worked out from it by set_layout()
+	int num_inodes; // one per file + the root directory
+	int num_files; // directory entries
+	int num_data_blocks;
+	int num_blocks;
+	int inode_blocks;
+	int dir_block;
+	int dir_blocks;
+	int data_block;
+	int fbm_block;
+	int map_blocks; // size of the fbm and of the reference count table (one byte per data block)
+	int ref_block;
+	int hash_block;
+	int hash_blocks;
+	int crc_block;
+	int crc_blocks;
 
-	// allocate new blocks needed for write and assign an inode pointer to each block
-	for (int i = 1; i <= num_new_blocks; i++) {
-		// search fbm for a free data block to allocate
-		for (int j = 0; j < 4096; j++) {
-			if (free_bit_map[j] == '1') {
-				free_bit_map[j] = '0';
-				new_block_num = j + DATA_BLOCK;
-				break;
-			}
-		}
-		// check if a free block was found
-		if (new_block_num == -1) {
-			endw_block = last_block + i - 1;
-			end_byte = (endw_block + 1)*1024 - 1;
+	// block groups (SB_GROUPS). data_block is the start of the first group
+	bool groups;
+	bool new_groups; // for the next fresh disk
+	int num_groups;
+	int group_size; // fbm slice + inode table slice + data blocks
+	int group_inode_blocks; // inode table blocks per group
+	char *fbm_written; // the fbm as it is on disk, so only the group slices that changed are written
 
-			if (endw_block < startw_block) {
-				printf("sfs_fwrite: not enough space to write any bytes\n");
-				return 0;
-			}
-			break;
-		}
+	// geometry of the next disk made by mksfs(1)
+	int new_num_files;
+	int new_num_data_blocks;
 
-		// if free block was found, add it to file's inode 
-		int cur_block = last_block + i; // the file block number whose pointer to update
+	char *free_bit_map;
+	int *free_count; // free blocks in each FREE_CHUNK of the fbm
 
-		// check if block ptr to update is part of direct pointer array or indirect pointer's index block
-		if (cur_block < 12) {
-			inode_table[inode].direct_ptr[cur_block] = new_block_num;
-		}
-		else {
-			index_block[cur_block - 12] = new_block_num;
-		}
-		new_block_num = -1;
-	}
+	// number of extra files sharing each data block (0 = block belongs to one file only),
+	// indexed like the fbm. a shared block is copied before it is written (copy-on-write)
+	unsigned char *block_refs;
+	bool refs_dirty;
 
-	// all necessary data blocks for write are allocated, so begin writing:
-	int bytes_written = 0;
-	int start_position = start_byte % DISK_BLOCK_SIZE; // writing start position in block to write in
-	int bytes_to_write; // number of bytes to write in a specific block
-	int block_num; // number of data block to write in
-	char* temp_buf = (char *) malloc(DISK_BLOCK_SIZE*(sizeof(char)));
+	// dedup mode: fingerprint of each data block's contents (0 = not fingerprinted), indexed like the fbm.
+	// blocks with the same fingerprint are chained in hash buckets (one per data block) so a duplicate can
+	// be found without scanning. a block written with the same contents as an existing one shares it instead
+	// (via block_refs)
+	unsigned long long *block_hash;
+	int *hash_bucket; // first block index in each bucket (-1 = empty)
+	int *hash_next; // next block index in the same bucket
+	bool *hash_dirty; // block_hash blocks that need writing
+	bool dedup_enabled;
+	bool hashes_loaded; // the fingerprint table is only read when it's first used
+	bool hashes_used; // SB_HASHED
 
-	// check if we need to append to a previously allocated block
-	if (startw_block == last_block) {
-		if (startw_block < 12) {
-			block_num = inode_table[inode].direct_ptr[startw_block];
-		}
-		else {
-			block_num = index_block[startw_block - 12];
-		}
-		read_blocks(block_num, 1, temp_buf);
+	// checksum mode: crc32c of each block's contents, indexed by block number. blocks are checked
+	// whenever they're read, and sfs_scrub checks the whole disk
+	unsigned int *block_crc;
+	bool *crc_dirty; // block_crc blocks that need writing
+	bool checksums_enabled;
+	int checksum_errors;
 
-		if (DISK_BLOCK_SIZE - start_position < length - bytes_written) {
-			bytes_to_write = DISK_BLOCK_SIZE - start_position;
-		}
-		else {
-			bytes_to_write = length - bytes_written;
-		}
-		
-		memcpy(temp_buf + start_position, buffer, bytes_to_write);
-		startw_block++;
-		bytes_written += bytes_to_write;
-		fdt[fileID].fp += bytes_to_write;
-		write_blocks(block_num, 1, temp_buf);
-	}
+	int *resv_map;
 
-	// write to the newly allocated blocks
-	for (int i = startw_block; i <= endw_block; i++) {
-		// calc num bytes to write in block i 
-		if ((length - bytes_written) <= DISK_BLOCK_SIZE) {
-			bytes_to_write = length - bytes_written;
-		}
-		else bytes_to_write = DISK_BLOCK_SIZE;
+	struct dir_entry *directory;
+	unsigned char *name_filter; // counting Bloom filter of the names in the directory
+	unsigned int name_filter_mask; // counters - 1 (a power of 2 - 1)
+	int *name_bucket; // directory entries chained by name hash: first entry in each bucket (-1 = empty)
+	int *name_next; // next entry in the same bucket
+	unsigned int name_bucket_mask;
+	int inode_hint; // no inode below this one is free
+	int entry_hint; // no directory entry below this one is free
+	struct opened_file *fdt;
+	int fdt_size;
+	struct inode *inode_table;
+
+	// index blocks of files, read from disk the first time they're needed (NULL = not loaded yet)
+	int **index_cache;
+
+	// the inode table and directory as they're stored on disk (whole blocks), kept up to date with
+	// inode_table and directory so a changed entry can be written without packing the whole table
+	struct disk_inode *disk_inodes;
+	struct disk_dirent *disk_dir;
+
+	bool compress_new_files;
+	int get_next_file_num;
+
+	// log-structured mode (SB_LOG)
+	bool log_mode;
+	bool new_log_mode; // for the next fresh disk
+	int ckpt_block;
+	int ckpt_blocks;
+	int meta_blocks; // inode table + directory blocks
+	int *meta_map;
+	bool *meta_dirty; // inode table and directory blocks to append to the log at the end of the operation
+	char *seg_buf; // the blocks of the current segment that aren't written yet
+	int *seg_meta; // what each block of the current segment holds, for its summary
+	int seg_start;
+	int seg_used; // blocks of the current segment in use
+	int seg_flushed; // blocks of the current segment written to disk
+	int log_seq;
+	bool cleaning;
+
+	// write-back (sfs_writeback). the flusher writes to the disk while the file system works on it, so
+	// io_lock is held for disk I/O, and wb_lock for the table of dirty blocks (in that order)
+	bool wb_enabled;
+	bool wb_stop;
+	pthread_t wb_thread;
+	pthread_mutex_t io_lock;
+	pthread_mutex_t wb_lock;
+	pthread_cond_t wb_wake;
+	struct wb_block **wb_table; // dirty blocks by block number
+	struct wb_block *wb_oldest;
+	struct wb_block *wb_newest;
+	int wb_dirty;
+
+	struct sfs_op_stats stats[SFS_OPS]; // per-call statistics (sfs_get_stats)
+
+	int trace_id; // number of the file system in the trace
+	int trace_gen; // trace trace_id belongs to (0 = not recorded yet)
+};
+
+// the file system the calling thread is working on. every public function sets it from its sfs_t
+// argument (or to the default file system), so the code below can use fs-> without passing it around,
+// and threads working on different file systems don't interfere
+static __thread struct sfs *fs;
+
+// the file system used by mksfs and the functions without an sfs_t argument
+static struct sfs *default_fs;
 
-		memcpy(temp_buf, buffer + bytes_written, bytes_to_write);
-		if (i < 12) {
-			write_blocks(inode_table[inode].direct_ptr[i], 1, temp_buf);
+// tracing (sfs_trace): every public function appends a trace_record to trace_file when it's called.
+// trace_nested is set while a public function calls another one, so only the outer call is recorded
+static FILE *trace_file;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec trace_start;
+static int trace_gen; // file systems are numbered again in each trace
+static int trace_fs_count;
+static __thread int trace_nested;
+static pthread_once_t trace_env_once = PTHREAD_ONCE_INIT;
+
+static void trace_names(int op, const char *name, int name_len, int a0, int a1, int a2, int a3) {
+	if (trace_file == NULL || trace_nested) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	struct trace_record rec = { 0 };
+	rec.time = (now.tv_sec - trace_start.tv_sec)*1000000000LL + (now.tv_nsec - trace_start.tv_nsec);
+	rec.op = op;
+	rec.name_len = name_len;
+	rec.args[0] = a0;
+	rec.args[1] = a1;
+	rec.args[2] = a2;
+	rec.args[3] = a3;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file != NULL) {
+		if (fs->trace_gen != trace_gen) {
+			fs->trace_gen = trace_gen;
+			fs->trace_id = ++trace_fs_count;
 		}
-		else {
-			write_blocks(index_block[i - 12], 1, temp_buf);
+		rec.fs = fs->trace_id;
+		fwrite(&rec, sizeof(rec), 1, trace_file);
+		if (name_len > 0) {
+			fwrite(name, 1, name_len, trace_file);
 		}
-		bytes_written += bytes_to_write;
-		fdt[fileID].fp += bytes_to_write;
-	}
-	// update file size 
-	if (inode_table[inode].filesize < end_byte + 1) {
-		inode_table[inode].filesize = end_byte + 1;
 	}
+	pthread_mutex_unlock(&trace_lock);
+}
 
-	// update inode in disk
-	write_blocks(INODE_BLOCK, 6, inode_table);
+// record a call to fs with a file name (or NULL) and up to 4 arguments
+static void trace(int op, const char *name, int a0, int a1, int a2, int a3) {
+	trace_names(op, name, name != NULL ? strlen(name) : 0, a0, a1, a2, a3);
+}
 
-	// update index block in disk
-	write_blocks(inode_table[inode].indirect_ptr, 1, index_block);
+// per-call statistics (sfs_get_stats). COUNT_OP at the start of a public function times it and adds it to
+// fs->stats when it returns. the blocks allocated, metadata blocks written and bytes read or written while
+// it runs are added to cur_op, the statistics of the outermost public call on this thread
+static __thread struct sfs_op_stats *cur_op;
 
-	// update fbm in disk
-	write_blocks(FBM_BLOCK, 4, free_bit_map);
+struct op_timer {
+	struct sfs *fs;
+	struct sfs_op_stats *stats; // NULL for a call made by another public function
+	int fd; // for sfs_fread and sfs_fwrite, the file whose pointer moves by the bytes read or written
+	int fp;
+	struct timespec start;
+};
 
-	return bytes_written;
+static void count_blocks(int n) {
+	if (cur_op != NULL) {
+		cur_op->blocks_allocated += n;
+	}
 }
 
-int sfs_fread(int fileID, char* buffer, int length) {
-	// check if file is open. if not, return 0
-	if (!fdt[fileID].open) {
-		printf("sfs_fread: file not open\n");
-		return 0;
+static void count_meta(int n) {
+	if (cur_op != NULL) {
+		cur_op->meta_blocks += n;
 	}
-	int inode = fdt[fileID].inode;
+}
 
-	// check if fp is out of bounds
-	if (inode_table[inode].filesize <= fdt[fileID].fp) {
-		printf("sfs_fread: read is out of file bounds\n");
-		return 0;
+static void count_bytes(int n) {
+	if (cur_op != NULL) {
+		cur_op->bytes += n;
 	}
+}
 
-	// check if read goes out of bounds. if it does, edit the length to be in bounds
-	if (fdt[fileID].fp + length > inode_table[inode].filesize) {
-		length = inode_table[inode].filesize - fdt[fileID].fp; // num bytes to read is everything from fp to end of file
+// add a call that started at start to s. latency[b] counts calls under 2^b usec (and at least 2^(b-1))
+static void count_call(struct sfs_op_stats *s, const struct timespec *start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	long long ns = (end.tv_sec - start->tv_sec)*1000000000LL + (end.tv_nsec - start->tv_nsec);
+	int b = 0;
+	while (b < SFS_LATENCY_BUCKETS - 1 && ns >= 1000LL << b) {
+		b++;
 	}
+	s->calls++;
+	s->ns += ns;
+	if (ns > s->max_ns) {
+		s->max_ns = ns;
+	}
+	s->latency[b]++;
+}
 
-	// determine data block numbers to read from disk
-	char* temp_buf = (char *) malloc(DISK_BLOCK_SIZE*(sizeof(char))); // buffer to read a data block into
-	int bytes_left = length;
-	int start_block = (int) floor((double) fdt[fileID].fp/DISK_BLOCK_SIZE); // calculate which file block the fp is in
-	int end_block = (int) floor((double) (fdt[fileID].fp + length - 1)/DISK_BLOCK_SIZE); // calculate which file block the read ends in
+// first block of group g (its fbm slice, then its inode table slice and its data blocks)
+static int group_start(int g) {
+	return fs->data_block + g*fs->group_size;
+}
 
-	int index_block[256];
-	if (end_block > 11) {	
-		read_blocks(inode_table[inode].indirect_ptr, 1, index_block);
+// index of data block block_num in the fbm and the tables indexed like it. with block groups, a block
+// of a group's fbm or inode table slice gives the group's first data block, so an allocation goal just
+// past the end of a group moves on to the next group
+static int data_index(int block_num) {
+	if (!fs->groups) {
+		return block_num - fs->data_block;
 	}
+	int g = (block_num - fs->data_block)/fs->group_size;
+	int offset = (block_num - fs->data_block)%fs->group_size - 1 - fs->group_inode_blocks;
+	return g*GROUP_DATA_BLOCKS + (offset > 0 ? offset : 0);
+}
 
-	// if read starts somewhere in a block
-	if (fdt[fileID].fp % DISK_BLOCK_SIZE != 0) {
-		// if file block # < 12, read data block pointed to by direct pointer (direct pointers are file blocks 0-11)
-		if (start_block < 12) {
-			read_blocks(inode_table[inode].direct_ptr[start_block], 1, temp_buf);
-		}
-		
-		// if file block # >= 12, read data block from index block 
-		else {
-			read_blocks(index_block[start_block-12], 1, temp_buf);
-		}
-		// if num bytes available to read in block is less than the num bytes left to read, then
-		// read all the bytes available in block and decrement bytes left
-		if (DISK_BLOCK_SIZE - fdt[fileID].fp % DISK_BLOCK_SIZE < bytes_left) {
-			memcpy(buffer, temp_buf + fdt[fileID].fp % DISK_BLOCK_SIZE, DISK_BLOCK_SIZE - fdt[fileID].fp % DISK_BLOCK_SIZE);
-			bytes_left -= DISK_BLOCK_SIZE - fdt[fileID].fp % DISK_BLOCK_SIZE;
-		}
-		// if not, then just read num bytes left to read
-		else {
-			memcpy(buffer, temp_buf + fdt[fileID].fp % DISK_BLOCK_SIZE, bytes_left);
-			bytes_left = 0;
-		}
-		start_block++;
+static int data_block_num(int i) {
+	if (!fs->groups) {
+		return i + fs->data_block;
 	}
+	return group_start(i/GROUP_DATA_BLOCKS) + 1 + fs->group_inode_blocks + i%GROUP_DATA_BLOCKS;
+}
 
-	// read data blocks into buffer
-	for (int i = start_block; i <= end_block; i++) {
-		// if file block # < 12, read data block pointed to by direct pointer (direct pointers are file blocks 0-11)
-		if (i < 12) {
-			read_blocks(inode_table[inode].direct_ptr[i], 1, temp_buf);
-		}
-		
-		// if file block # >= 12, read data block from index block 
-		else {
-			read_blocks(index_block[i-12], 1, temp_buf);
-		}
+// mark data block i (indexed like the fbm) free or in use, keeping free_count up to date
+static void set_free(int i) {
+	if (fs->free_bit_map[i] != '1') {
+		fs->free_bit_map[i] = '1';
+		fs->free_count[i/FREE_CHUNK]++;
+	}
+}
 
-		//copy num of bytes needed from data block into buffer 
-		if (bytes_left <= DISK_BLOCK_SIZE) {
-			memcpy(buffer + length - bytes_left, temp_buf, bytes_left);
-			bytes_left = 0; // read is complete
-		}
-		else {
-			memcpy(buffer + length - bytes_left, temp_buf, DISK_BLOCK_SIZE); // copy whole block into buffer
-			bytes_left -= DISK_BLOCK_SIZE; // decrement bytes remaining by block size
-		}
+static void set_used(int i) {
+	if (fs->free_bit_map[i] == '1') {
+		fs->free_bit_map[i] = '0';
+		fs->free_count[i/FREE_CHUNK]--;
 	}
-	free(temp_buf);
-	fdt[fileID].fp += length;
-	return length;
 }
 
-int sfs_fseek(int fileID, int location) {
-	 if (!fdt[fileID].open) {
-	 	printf("sfs_fseek error: file with id %d is not open.\n", fileID);
-	 	return -1;
-	 }
-	 fdt[fileID].fp = location;
-	 return 0;
+// work out free_count again after the fbm was read or filled in as a whole
+static void count_free() {
+	memset(fs->free_count, 0, (fs->num_data_blocks + FREE_CHUNK - 1)/FREE_CHUNK*sizeof(int));
+	for (int i = 0; i < fs->num_data_blocks; i++) {
+		fs->free_count[i/FREE_CHUNK] += fs->free_bit_map[i] == '1';
+	}
 }
 
-int sfs_getnextfilename(char* fname) {
-	// if next entry in directory is empty, return 0
-	if (!directory[get_next_file_num].occupied) {
-		return 0;
+// where block k of the inode table and directory (numbered one after the other, as in meta_map) is
+// stored on disk
+static int table_block_num(int k) {
+	if (!fs->groups) {
+		return INODE_BLOCK + k;
 	}
-	// get next directory entry, copy next file name into buffer, increment counter
-	char* found_file = directory[get_next_file_num].filename;
-	strcpy(fname, found_file);
-	get_next_file_num++;
+	if (k >= fs->inode_blocks) {
+		return fs->dir_block + k - fs->inode_blocks;
+	}
+	return group_start(k/fs->group_inode_blocks) + 1 + k%fs->group_inode_blocks;
+}
 
-	return 1;
+// where a new file's first block is allocated. files are spread over the data blocks by inode number,
+// so each has room to grow contiguously. with block groups, they're spread over their inode's group
+static int first_goal(int inode) {
+	if (!fs->groups) {
+		return fs->data_block + (int) ((long long) inode*fs->num_data_blocks/fs->num_inodes);
+	}
+	long long pos = (long long) inode*sizeof(struct disk_inode);
+	long long slice = (long long) fs->group_inode_blocks*DISK_BLOCK_SIZE;
+	int g = pos/slice;
+	int group_blocks = fs->num_data_blocks - g*GROUP_DATA_BLOCKS;
+	if (group_blocks > GROUP_DATA_BLOCKS) {
+		group_blocks = GROUP_DATA_BLOCKS;
+	}
+	return data_block_num(g*GROUP_DATA_BLOCKS + (int) (pos%slice*group_blocks/slice));
 }
 
-int sfs_getfilesize(const char* path) {
-	int inode_num = -1;
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
 
-	// search directory for file and get its inode num
-	for (int i = 0; i < 100; i++) {
-		if (strcmp(directory[i].filename, path) == 0) {
-			inode_num = directory[i].inode;
+static int wb_limit(int ratio) {
+	int limit = (int) ((long long) fs->num_blocks*ratio/100);
+	return limit > WB_MIN_DIRTY ? limit : WB_MIN_DIRTY;
+}
+
+// the dirty copy of block_num, or NULL if the disk has its latest contents. called with wb_lock held
+static struct wb_block *wb_find(int block_num) {
+	struct wb_block *b = fs->wb_table[block_num % WB_HASH_SIZE];
+	while (b != NULL && b->block_num != block_num) {
+		b = b->hash_next;
+	}
+	return b;
+}
+
+static bool wb_cached(int block_num) {
+	if (!fs->wb_enabled) {
+		return false;
+	}
+	pthread_mutex_lock(&fs->wb_lock);
+	bool cached = wb_find(block_num) != NULL;
+	pthread_mutex_unlock(&fs->wb_lock);
+	return cached;
+}
+
+static int compare_wb_blocks(const void *a, const void *b) {
+	return (*(struct wb_block **) a)->block_num - (*(struct wb_block **) b)->block_num;
+}
+
+// write dirty blocks to the disk: all of them if all is set, otherwise the ones that have expired (or all
+// of them, if more than the background limit are dirty). they're written in block order, with one write
+// per run of consecutive blocks. blocks written again meanwhile get a new dirty copy, which is written later
+static void wb_flush(bool all) {
+	pthread_mutex_lock(&fs->io_lock);
+	pthread_mutex_lock(&fs->wb_lock);
+	if (fs->wb_dirty > wb_limit(WB_BACKGROUND_RATIO)) {
+		all = true;
+	}
+	double expired = now() - WB_EXPIRE;
+	struct wb_block **batch = malloc((fs->wb_dirty + 1)*sizeof(struct wb_block *));
+	int n = 0;
+	while (fs->wb_oldest != NULL && (all || fs->wb_oldest->dirtied <= expired)) {
+		struct wb_block *b = fs->wb_oldest;
+		struct wb_block **link = &fs->wb_table[b->block_num % WB_HASH_SIZE];
+		while (*link != b) {
+			link = &(*link)->hash_next;
+		}
+		*link = b->hash_next;
+		fs->wb_oldest = b->next;
+		batch[n++] = b;
+	}
+	if (fs->wb_oldest == NULL) {
+		fs->wb_newest = NULL;
+	}
+	fs->wb_dirty -= n;
+	pthread_mutex_unlock(&fs->wb_lock);
+
+	qsort(batch, n, sizeof(struct wb_block *), compare_wb_blocks);
+	char *run = malloc(SEGMENT_BLOCKS*DISK_BLOCK_SIZE);
+	for (int i = 0; i < n; ) {
+		int len = 1;
+		memcpy(run, batch[i]->data, DISK_BLOCK_SIZE);
+		while (i + len < n && len < SEGMENT_BLOCKS && batch[i + len]->block_num == batch[i]->block_num + len) {
+			memcpy(run + len*DISK_BLOCK_SIZE, batch[i + len]->data, DISK_BLOCK_SIZE);
+			len++;
+		}
+		disk_write(fs->disk, batch[i]->block_num, len, run);
+		i += len;
+	}
+	pthread_mutex_unlock(&fs->io_lock);
+	for (int i = 0; i < n; i++) {
+		free(batch[i]);
+	}
+	free(run);
+	free(batch);
+}
+
+static void *wb_main(void *arg) {
+	fs = arg;
+	pthread_mutex_lock(&fs->wb_lock);
+	while (!fs->wb_stop) {
+		struct timespec wake;
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_nsec += (long) (WB_INTERVAL*1e9);
+		if (wake.tv_nsec >= 1000000000) {
+			wake.tv_sec++;
+			wake.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&fs->wb_wake, &fs->wb_lock, &wake);
+		if (!fs->wb_stop && fs->wb_dirty > 0) {
+			pthread_mutex_unlock(&fs->wb_lock);
+			wb_flush(false);
+			pthread_mutex_lock(&fs->wb_lock);
+		}
+	}
+	pthread_mutex_unlock(&fs->wb_lock);
+	return NULL;
+}
+
+static void wb_start() {
+	pthread_mutex_init(&fs->io_lock, NULL);
+	pthread_mutex_init(&fs->wb_lock, NULL);
+	pthread_cond_init(&fs->wb_wake, NULL);
+	fs->wb_table = calloc(WB_HASH_SIZE, sizeof(struct wb_block *));
+	fs->wb_oldest = NULL;
+	fs->wb_newest = NULL;
+	fs->wb_dirty = 0;
+	fs->wb_stop = false;
+	fs->wb_enabled = true;
+	pthread_create(&fs->wb_thread, NULL, wb_main, fs);
+}
+
+// stop the flusher and write everything it hasn't written yet
+static void wb_shutdown() {
+	pthread_mutex_lock(&fs->wb_lock);
+	fs->wb_stop = true;
+	pthread_cond_signal(&fs->wb_wake);
+	pthread_mutex_unlock(&fs->wb_lock);
+	pthread_join(fs->wb_thread, NULL);
+	wb_flush(true);
+	fs->wb_enabled = false;
+	free(fs->wb_table);
+	fs->wb_table = NULL;
+	pthread_cond_destroy(&fs->wb_wake);
+	pthread_mutex_destroy(&fs->wb_lock);
+	pthread_mutex_destroy(&fs->io_lock);
+}
+
+// every block read and write of a mounted disk goes through dev_read and dev_write. with write-back on,
+// writes only go as far as the dirty blocks in memory, and reads take blocks from there first
+static int dev_read(int start_address, int nblocks, void *buffer) {
+	if (!fs->wb_enabled) {
+		return disk_read(fs->disk, start_address, nblocks, buffer);
+	}
+	pthread_mutex_lock(&fs->io_lock);
+	pthread_mutex_lock(&fs->wb_lock);
+	int cached = 0;
+	for (int i = 0; i < nblocks; i++) {
+		cached += wb_find(start_address + i) != NULL;
+	}
+	int res = nblocks;
+	if (cached < nblocks) {
+		res = disk_read(fs->disk, start_address, nblocks, buffer);
+	}
+	for (int i = 0; i < nblocks && cached > 0 && res >= 0; i++) {
+		struct wb_block *b = wb_find(start_address + i);
+		if (b != NULL) {
+			memcpy((char *) buffer + i*DISK_BLOCK_SIZE, b->data, DISK_BLOCK_SIZE);
+		}
+	}
+	pthread_mutex_unlock(&fs->wb_lock);
+	pthread_mutex_unlock(&fs->io_lock);
+	return res;
+}
+
+static int dev_write(int start_address, int nblocks, void *buffer) {
+	// writes past the end of the disk go to it, to fail there
+	if (!fs->wb_enabled || start_address < 0 || start_address + nblocks > fs->num_blocks) {
+		return disk_write(fs->disk, start_address, nblocks, buffer);
+	}
+	pthread_mutex_lock(&fs->wb_lock);
+	for (int i = 0; i < nblocks; i++) {
+		struct wb_block *b = wb_find(start_address + i);
+		if (b == NULL) {
+			b = malloc(sizeof(struct wb_block) + DISK_BLOCK_SIZE);
+			b->block_num = start_address + i;
+			b->dirtied = now();
+			b->hash_next = fs->wb_table[b->block_num % WB_HASH_SIZE];
+			fs->wb_table[b->block_num % WB_HASH_SIZE] = b;
+			b->next = NULL;
+			if (fs->wb_newest != NULL) {
+				fs->wb_newest->next = b;
+			}
+			else fs->wb_oldest = b;
+			fs->wb_newest = b;
+			fs->wb_dirty++;
+		}
+		memcpy(b->data, (char *) buffer + i*DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+	}
+	bool throttle = fs->wb_dirty >= wb_limit(WB_DIRTY_RATIO);
+	if (fs->wb_dirty > wb_limit(WB_BACKGROUND_RATIO)) {
+		pthread_cond_signal(&fs->wb_wake);
+	}
+	pthread_mutex_unlock(&fs->wb_lock);
+	if (throttle) {
+		wb_flush(true);
+	}
+	return nblocks;
+}
+
+// check a batch of blocks that were just read against their checksums. returns the number of bad blocks
+static int verify_blocks(int start_address, int nblocks, const char *buffer) {
+	int bad = 0;
+	for (int i = 0; i < nblocks; i++) {
+		if (crc32c(0, buffer + i*DISK_BLOCK_SIZE, DISK_BLOCK_SIZE) != fs->block_crc[start_address + i]) {
+			printf("sfs: checksum error in block %d\n", start_address + i);
+			bad++;
+		}
+	}
+	fs->checksum_errors += bad;
+	return bad;
+}
+
+static void set_checksums(int start_address, int nblocks, const char *buffer) {
+	if (fs->checksums_enabled) {
+		for (int i = 0; i < nblocks; i++) {
+			fs->block_crc[start_address + i] = crc32c(0, buffer + i*DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+			fs->crc_dirty[(start_address + i)/256] = true;
+		}
+	}
+}
+
+// log mode: is block_num at the head of the log, buffered but not written yet?
+static bool in_log_buffer(int block_num) {
+	return fs->log_mode && block_num >= fs->seg_start + fs->seg_flushed && block_num < fs->seg_start + fs->seg_used;
+}
+
+// log mode: write the buffered blocks of the current segment, after a summary of them, with one write
+static void log_flush() {
+	if (!fs->log_mode || fs->seg_used == fs->seg_flushed) {
+		return;
+	}
+	char *chunk = fs->seg_buf + fs->seg_flushed*DISK_BLOCK_SIZE;
+	struct log_summary *summary = (struct log_summary *) chunk;
+	memset(summary, 0, DISK_BLOCK_SIZE);
+	summary->magic = LOG_MAGIC;
+	summary->seq = fs->log_seq++;
+	summary->nblocks = fs->seg_used - fs->seg_flushed - 1;
+	memcpy(summary->meta, fs->seg_meta + fs->seg_flushed + 1, summary->nblocks*sizeof(int));
+	count_meta(1);
+
+	set_checksums(fs->seg_start + fs->seg_flushed, fs->seg_used - fs->seg_flushed, chunk);
+	dev_write(fs->seg_start + fs->seg_flushed, fs->seg_used - fs->seg_flushed, chunk);
+	fs->seg_flushed = fs->seg_used;
+}
+
+static void write_checkpoint() {
+	struct log_checkpoint *ckpt = calloc(fs->ckpt_blocks, DISK_BLOCK_SIZE);
+	ckpt->magic = LOG_MAGIC;
+	ckpt->seq = fs->log_seq;
+	ckpt->seg_start = fs->seg_start;
+	ckpt->head = fs->seg_flushed;
+	memcpy(ckpt->meta_map, fs->meta_map, fs->meta_blocks*sizeof(int));
+	dev_write(fs->ckpt_block, fs->ckpt_blocks, ckpt);
+	count_meta(fs->ckpt_blocks);
+	free(ckpt);
+}
+
+static int num_segments() {
+	return fs->num_data_blocks/SEGMENT_BLOCKS;
+}
+
+// number of data blocks of segment s in use
+static int segment_live(int s) {
+	int live = 0;
+	for (int i = s*SEGMENT_BLOCKS; i < (s + 1)*SEGMENT_BLOCKS; i++) {
+		live += fs->free_bit_map[i] == '0';
+	}
+	return live;
+}
+
+static int free_segments() {
+	int n = 0;
+	for (int s = 0; s < num_segments(); s++) {
+		n += s*SEGMENT_BLOCKS + fs->data_block != fs->seg_start && segment_live(s) == 0;
+	}
+	return n;
+}
+
+// move the log to the next free segment and save a checkpoint. returns -1 if no segment is free
+static int next_segment() {
+	log_flush();
+	int n = num_segments();
+	int cur = (fs->seg_start - fs->data_block)/SEGMENT_BLOCKS;
+	for (int i = 1; i <= n; i++) {
+		int s = (cur + i) % n;
+		if (s != cur && segment_live(s) == 0) {
+			fs->seg_start = s*SEGMENT_BLOCKS + fs->data_block;
+			fs->seg_used = 0;
+			fs->seg_flushed = 0;
+			write_checkpoint();
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// log mode: the next block at the head of the log, or -1 if the disk is full
+static int log_alloc() {
+	// a new run of blocks starts with its summary block
+	int needed = fs->seg_used == fs->seg_flushed ? 2 : 1;
+	if (fs->seg_used + needed > SEGMENT_BLOCKS) {
+		if (next_segment() < 0) {
+			return -1;
+		}
+		needed = 2;
+	}
+	if (needed == 2) {
+		fs->seg_meta[fs->seg_used++] = -1;
+	}
+	int block_num = fs->seg_start + fs->seg_used;
+	fs->seg_meta[fs->seg_used] = -1;
+	memset(fs->seg_buf + fs->seg_used*DISK_BLOCK_SIZE, 0, DISK_BLOCK_SIZE);
+	fs->seg_used++;
+
+	set_used(data_index(block_num));
+	fs->block_refs[data_index(block_num)] = 0;
+	return block_num;
+}
+
+// all block I/O except the superblock and the checksum table goes through read_disk and write_disk.
+// returns -1 if the read failed or a block didn't match its checksum
+static int read_disk(int start_address, int nblocks, void *buffer) {
+	// blocks still in the log buffer are written out first
+	if (fs->log_mode && start_address < fs->seg_start + fs->seg_used && start_address + nblocks > fs->seg_start + fs->seg_flushed) {
+		log_flush();
+	}
+	int res = dev_read(start_address, nblocks, buffer);
+	if (res < 0 || !fs->checksums_enabled) {
+		return res;
+	}
+	return verify_blocks(start_address, nblocks, buffer) == 0 ? res : -1;
+}
+
+static int write_disk(int start_address, int nblocks, void *buffer) {
+	if (fs->log_mode && start_address < fs->seg_start + fs->seg_used && start_address + nblocks > fs->seg_start + fs->seg_flushed) {
+		// blocks at the head of the log are only copied into the log buffer
+		for (int i = 0; i < nblocks; i++) {
+			char *block = (char *) buffer + i*DISK_BLOCK_SIZE;
+			if (in_log_buffer(start_address + i)) {
+				memcpy(fs->seg_buf + (start_address + i - fs->seg_start)*DISK_BLOCK_SIZE, block, DISK_BLOCK_SIZE);
+			}
+			else {
+				set_checksums(start_address + i, 1, block);
+				dev_write(start_address + i, 1, block);
+			}
+		}
+		return nblocks;
+	}
+	set_checksums(start_address, nblocks, buffer);
+	return dev_write(start_address, nblocks, buffer);
+}
+
+// directory name index: a counting Bloom filter over the names in the directory, so looking up a name that
+// isn't there (before creating a file, or a program probing for files) mostly needs no lookup at all. each
+// name adds 1 to NAME_HASHES of its counters, and a name is only looked up if none of them is 0. a counter
+// that reaches 255 stays there. the entries are also chained in hash buckets, so a name that is there is
+// found without scanning the directory
+static unsigned long long name_hash(const char *name) {
+	unsigned long long h = 0xcbf29ce484222325ULL; // FNV-1a
+	for (; *name != '\0'; name++) {
+		h = (h ^ (unsigned char) *name)*0x100000001b3ULL;
+	}
+	return h;
+}
+
+// counter k of a name with hash h
+static unsigned char *name_counter(unsigned long long h, int k) {
+	unsigned int step = (unsigned int) (h >> 32) | 1;
+	return &fs->name_filter[((unsigned int) h + k*step) & fs->name_filter_mask];
+}
+
+static int *name_bucket(unsigned long long h) {
+	return &fs->name_bucket[(unsigned int) (h >> 16) & fs->name_bucket_mask];
+}
+
+// add directory entry i (which has to be occupied) to the index
+static void name_index_add(int i) {
+	unsigned long long h = name_hash(fs->directory[i].filename);
+	for (int k = 0; k < NAME_HASHES; k++) {
+		unsigned char *c = name_counter(h, k);
+		if (*c < 255) {
+			(*c)++;
+		}
+	}
+	fs->name_next[i] = *name_bucket(h);
+	*name_bucket(h) = i;
+}
+
+static void name_index_remove(int i) {
+	unsigned long long h = name_hash(fs->directory[i].filename);
+	for (int k = 0; k < NAME_HASHES; k++) {
+		unsigned char *c = name_counter(h, k);
+		if (*c > 0 && *c < 255) {
+			(*c)--;
+		}
+	}
+	int *link = name_bucket(h);
+	while (*link != -1 && *link != i) {
+		link = &fs->name_next[*link];
+	}
+	if (*link == i) {
+		*link = fs->name_next[i];
+	}
+}
+
+// returns the directory entry index of file fname, or -1 if it doesn't exist
+static int find_file(const char *fname) {
+	unsigned long long h = name_hash(fname);
+	for (int k = 0; k < NAME_HASHES; k++) {
+		if (*name_counter(h, k) == 0) {
+			return -1;
+		}
+	}
+	for (int i = *name_bucket(h); i != -1; i = fs->name_next[i]) {
+		if (strcmp(fs->directory[i].filename, fname) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static bool fd_is_open(int fileID) {
+	return fileID >= 0 && fileID < fs->fdt_size && fs->fdt[fileID].open;
+}
+
+static struct op_timer op_begin(int op, int fd) {
+	struct op_timer t = { fs, NULL, -1, 0 };
+	// only the outermost call counts the bytes, a nested sfs_fwrite (moving an inline file to a block, say)
+	// moves bytes the caller didn't ask for, and sfs_pread, sfs_pwrite and sfs_import count their own
+	if (cur_op == NULL) {
+		if (fd_is_open(fd)) {
+			t.fd = fd;
+			t.fp = fs->fdt[fd].fp;
+		}
+		t.stats = cur_op = &fs->stats[op];
+		clock_gettime(CLOCK_MONOTONIC, &t.start);
+	}
+	return t;
+}
+
+static void op_end(struct op_timer *t) {
+	if (t->fd >= 0 && t->fs->fdt[t->fd].open && t->fs->fdt[t->fd].fp > t->fp) {
+		count_bytes(t->fs->fdt[t->fd].fp - t->fp);
+	}
+	if (t->stats != NULL) {
+		count_call(t->stats, &t->start);
+		cur_op = NULL;
+	}
+}
+
+// time the rest of the function as a call of op (fd = the file sfs_fread or sfs_fwrite moves through)
+#define COUNT_OP(op, fd) struct op_timer op_timer __attribute__((cleanup(op_end))) = op_begin(op, fd)
+
+// returns a free slot in the fdt, doubling the table if every slot is in use
+static int alloc_fd() {
+	for (int i = 0; i < fs->fdt_size; i++) {
+		if (!fs->fdt[i].open) {
+			return i;
+		}
+	}
+	int fd = fs->fdt_size;
+	fs->fdt_size *= 2;
+	fs->fdt = realloc(fs->fdt, fs->fdt_size*sizeof(struct opened_file));
+	memset(fs->fdt + fd, 0, (fs->fdt_size - fd)*sizeof(struct opened_file));
+	return fd;
+}
+
+// drop the allocation window of a file (when it's being closed, or moves to a new one)
+static void release_window(int fd) {
+	struct opened_file *f = &fs->fdt[fd];
+	for (int i = f->resv_start; i < f->resv_start + f->resv_len; i++) {
+		if (fs->resv_map[i] == fd + 1) {
+			fs->resv_map[i] = 0;
+		}
+	}
+	f->resv_len = 0;
+}
+
+// search fbm for a free data block at or after block number goal and mark it used.
+// blocks in another open file's window are only taken once the rest of the disk is full.
+// if fd is an open file, the free blocks following the new block are reserved for it.
+// returns the block number, or -1 if the disk is full
+static int alloc_block(int goal, int fd) {
+	if (fs->log_mode) {
+		int block_num = log_alloc();
+		count_blocks(block_num != -1);
+		return block_num;
+	}
+	int owner = fd + 1;
+	int start = data_index(goal);
+	int found = -1;
+
+	if (start < 0 || start >= fs->num_data_blocks) {
+		start = 0;
+	}
+	// 1. first free block from the goal onwards that isn't reserved for another file. chunks without
+	// a free block are skipped whole
+	for (int n = 0; n < fs->num_data_blocks; n++) {
+		int i = (start + n) % fs->num_data_blocks;
+		if (fs->free_count[i/FREE_CHUNK] == 0) {
+			int end = (i/FREE_CHUNK + 1)*FREE_CHUNK;
+			n += (end < fs->num_data_blocks ? end : fs->num_data_blocks) - i - 1;
+			continue;
+		}
+		if (fs->free_bit_map[i] == '1' && (fs->resv_map[i] == 0 || fs->resv_map[i] == owner)) {
+			found = i;
+			break;
+		}
+	}
+	// 2. disk is almost full, so take any free block
+	for (int c = 0; found == -1 && c*FREE_CHUNK < fs->num_data_blocks; c++) {
+		for (int i = c*FREE_CHUNK; fs->free_count[c] > 0 && i < (c + 1)*FREE_CHUNK && i < fs->num_data_blocks; i++) {
+			if (fs->free_bit_map[i] == '1') {
+				found = i;
+				break;
+			}
+		}
+	}
+	if (found == -1) {
+		return -1;
+	}
+	set_used(found);
+	fs->block_refs[found] = 0;
+	fs->resv_map[found] = 0;
+	count_blocks(1);
+
+	// 3. slide the file's window forward past the new block
+	if (fd >= 0) {
+		release_window(fd);
+		int i = found + 1;
+		while (i < found + RESV_WINDOW && i < fs->num_data_blocks) {
+			if (fs->free_bit_map[i] != '1' || (fs->resv_map[i] != 0 && fs->resv_map[i] != owner)) {
+				break;
+			}
+			fs->resv_map[i++] = owner;
+		}
+		fs->fdt[fd].resv_start = found + 1;
+		fs->fdt[fd].resv_len = i - (found + 1);
+	}
+	return data_block_num(found);
+}
+
+// fast 64 bit hash of a data block's contents (never 0)
+static unsigned long long hash_block(const char *buf) {
+	unsigned long long h = 0x9e3779b97f4a7c15ULL;
+	for (int i = 0; i < DISK_BLOCK_SIZE; i += 8) {
+		unsigned long long v;
+		memcpy(&v, buf + i, 8);
+		h = (h ^ v) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	return h | 1;
+}
+
+// rebuild the hash buckets from block_hash after loading it
+static void build_hash_buckets() {
+	for (int i = 0; i < fs->num_data_blocks; i++) {
+		fs->hash_bucket[i] = -1;
+	}
+	for (int i = 0; i < fs->num_data_blocks; i++) {
+		if (fs->block_hash[i] != 0) {
+			fs->hash_next[i] = fs->hash_bucket[fs->block_hash[i] % fs->num_data_blocks];
+			fs->hash_bucket[fs->block_hash[i] % fs->num_data_blocks] = i;
+		}
+	}
+}
+
+// read the fingerprint table the first time it's used. a disk that never had a block
+// fingerprinted has an all-0 table, so it isn't read at all
+static void load_hashes() {
+	if (fs->hashes_loaded) {
+		return;
+	}
+	if (fs->hashes_used) {
+		read_disk(fs->hash_block, fs->hash_blocks, fs->block_hash);
+	}
+	else memset(fs->block_hash, 0, fs->hash_blocks*DISK_BLOCK_SIZE);
+	build_hash_buckets();
+	fs->hashes_loaded = true;
+}
+
+// remove data block i (fbm index) from the fingerprint table
+static void forget_hash(int i) {
+	load_hashes();
+	if (fs->block_hash[i] == 0) {
+		return;
+	}
+	int *link = &fs->hash_bucket[fs->block_hash[i] % fs->num_data_blocks];
+	while (*link != -1 && *link != i) {
+		link = &fs->hash_next[*link];
+	}
+	if (*link == i) {
+		*link = fs->hash_next[i];
+	}
+	fs->block_hash[i] = 0;
+	fs->hash_dirty[i/128] = true;
+}
+
+// record the fingerprint of data block i (fbm index)
+static void set_hash(int i, unsigned long long hash) {
+	forget_hash(i); // loads the table
+	fs->block_hash[i] = hash;
+	fs->hash_next[i] = fs->hash_bucket[hash % fs->num_data_blocks];
+	fs->hash_bucket[hash % fs->num_data_blocks] = i;
+	fs->hash_dirty[i/128] = true;
+}
+
+// find another data block that holds exactly buf. candidates with the same fingerprint are read
+// and compared, so a hash collision can't share the wrong data. returns the block number or -1
+static int find_duplicate(unsigned long long hash, const char *buf, int block_num) {
+	char *candidate = NULL;
+	int found = -1;
+
+	load_hashes();
+	for (int i = fs->hash_bucket[hash % fs->num_data_blocks]; i != -1; i = fs->hash_next[i]) {
+		if (fs->block_hash[i] != hash || data_block_num(i) == block_num || fs->block_refs[i] == 255) {
+			continue;
+		}
+		if (candidate == NULL) {
+			candidate = malloc(DISK_BLOCK_SIZE);
+		}
+		if (read_disk(data_block_num(i), 1, candidate) >= 0 && memcmp(candidate, buf, DISK_BLOCK_SIZE) == 0) {
+			found = data_block_num(i);
+			break;
+		}
+	}
+	free(candidate);
+	return found;
+}
+
+// drop one file's reference to a data block. the block only goes back to the fbm once no other file shares it
+static void release_block(int block_num) {
+	if (fs->block_refs[data_index(block_num)] > 0) {
+		fs->block_refs[data_index(block_num)]--;
+		fs->refs_dirty = true;
+	}
+	else {
+		set_free(data_index(block_num));
+		forget_hash(data_index(block_num));
+	}
+}
+
+// data block number of file block fblock (index_block must be cached if fblock > 11)
+static int get_block_ptr(int inode, int fblock, int *index_block) {
+	if (fblock < 12) {
+		return fs->inode_table[inode].direct_ptr[fblock] & ~COMPRESSED_PTR;
+	}
+	return index_block[fblock - 12] & ~COMPRESSED_PTR;
+}
+
+static bool is_compressed_cluster(int inode, int cluster, int *index_block) {
+	int fblock = cluster*CLUSTER_BLOCKS;
+	if (fblock < 12) {
+		return fs->inode_table[inode].direct_ptr[fblock] & COMPRESSED_PTR;
+	}
+	return index_block[fblock - 12] & COMPRESSED_PTR;
+}
+
+static void set_block_ptr(int inode, int fblock, int *index_block, int block_num) {
+	if (fblock < 12) {
+		fs->inode_table[inode].direct_ptr[fblock] = block_num;
+	}
+	else {
+		index_block[fblock - 12] = block_num;
+	}
+}
+
+// index block of a file, read from disk the first time it's needed and cached until the file is removed.
+// a file without an index block gets an all-0 one. returns NULL if the block can't be read
+static int *get_index_block(int inode) {
+	if (fs->index_cache[inode] == NULL) {
+		int *index_block = calloc(1, DISK_BLOCK_SIZE);
+		if (fs->inode_table[inode].indirect_ptr != 0 && read_disk(fs->inode_table[inode].indirect_ptr, 1, index_block) < 0) {
+			printf("sfs: can't read index block %d\n", fs->inode_table[inode].indirect_ptr);
+			free(index_block);
+			return NULL;
+		}
+		fs->index_cache[inode] = index_block;
+	}
+	return fs->index_cache[inode];
+}
+
+static void forget_index_block(int inode) {
+	free(fs->index_cache[inode]);
+	fs->index_cache[inode] = NULL;
+}
+
+// write a file's index block. in log mode it moves to the head of the log, unless it's already there,
+// so the inode has to be flushed after it
+static void write_index_block(int inode, int *index_block) {
+	if (fs->log_mode && !in_log_buffer(fs->inode_table[inode].indirect_ptr)) {
+		int block_num = log_alloc();
+		if (block_num != -1) {
+			set_free(data_index(fs->inode_table[inode].indirect_ptr));
+			fs->inode_table[inode].indirect_ptr = block_num;
+		}
+	}
+	write_disk(fs->inode_table[inode].indirect_ptr, 1, index_block);
+	count_meta(1);
+}
+
+// the fbm is only written in place, and with block groups only the group slices that changed are
+// written. a log-structured disk works it out from the inodes when it's mounted
+static void flush_fbm() {
+	if (fs->log_mode) {
+		return;
+	}
+	if (!fs->groups) {
+		write_disk(fs->fbm_block, fs->map_blocks, fs->free_bit_map);
+		count_meta(fs->map_blocks);
+		return;
+	}
+	for (int g = 0; g < fs->num_groups; g++) {
+		char *slice = fs->free_bit_map + g*DISK_BLOCK_SIZE;
+		if (memcmp(slice, fs->fbm_written + g*DISK_BLOCK_SIZE, DISK_BLOCK_SIZE) != 0) {
+			write_disk(group_start(g), 1, slice);
+			count_meta(1);
+			memcpy(fs->fbm_written + g*DISK_BLOCK_SIZE, slice, DISK_BLOCK_SIZE);
+		}
+	}
+}
+
+static void write_superblock() {
+	struct super_block *superblock = (struct super_block *) calloc(1, DISK_BLOCK_SIZE);
+	superblock->magic = SFS_MAGIC;
+	superblock->version = SFS_VERSION;
+	superblock->block_size = 1024;
+	superblock->sfs_size = fs->num_blocks;
+	superblock->inode_table_length = fs->inode_blocks;
+	superblock->root_inode = 0; // directory is the first i-node in i-node table
+	superblock->num_inodes = fs->num_inodes;
+	superblock->num_data_blocks = fs->num_data_blocks;
+	superblock->flags = (fs->compress_new_files ? SB_COMPRESS : 0) | (fs->dedup_enabled ? SB_DEDUP : 0)
+		| (fs->checksums_enabled ? SB_CHECKSUM : 0) | (fs->hashes_used ? SB_HASHED : 0) | (fs->log_mode ? SB_LOG : 0)
+		| (fs->groups ? SB_GROUPS : 0);
+	dev_write(0, 1, superblock);
+	count_meta(1);
+	free(superblock);
+}
+
+static void pack_inode(int i) {
+	fs->disk_inodes[i].flags = (fs->inode_table[i].occupied ? DI_OCCUPIED : 0) | (fs->inode_table[i].compressed ? DI_COMPRESSED : 0)
+		| (fs->inode_table[i].inlined ? DI_INLINE : 0) | (fs->inode_table[i].dir ? DI_DIR : 0);
+	fs->disk_inodes[i].filesize = fs->inode_table[i].filesize;
+	memcpy(fs->disk_inodes[i].direct_ptr, fs->inode_table[i].direct_ptr, sizeof(fs->disk_inodes[i].direct_ptr));
+	fs->disk_inodes[i].indirect_ptr = fs->inode_table[i].indirect_ptr;
+	if (fs->inode_table[i].inlined) {
+		memcpy(fs->disk_inodes[i].direct_ptr, fs->inode_table[i].inline_data, INLINE_BYTES);
+	}
+}
+
+static void pack_dir_entry(int i) {
+	strncpy(fs->disk_dir[i].filename, fs->directory[i].filename, sizeof(fs->disk_dir[i].filename));
+	fs->disk_dir[i].inode = fs->directory[i].occupied ? fs->directory[i].inode : -1;
+}
+
+// write the blocks of a packed table that hold bytes start to end - 1. table_block is the number of the
+// table's first block among the inode table and directory blocks (0 or inode_blocks). in log mode they're
+// appended to the log at the end of the operation, so a block changed several times is only written once
+static void write_table_bytes(int table_block, void *table, long long start, long long end) {
+	int first = start/DISK_BLOCK_SIZE;
+	int last = (end - 1)/DISK_BLOCK_SIZE;
+	if (fs->log_mode) {
+		for (int i = first; i <= last; i++) {
+			fs->meta_dirty[table_block + i] = true;
+		}
+		return;
+	}
+	// blocks that are next to each other on disk (all of them, without block groups) are written together
+	for (int i = first; i <= last; ) {
+		int block_num = table_block_num(table_block + i);
+		int n = 1;
+		while (i + n <= last && table_block_num(table_block + i + n) == block_num + n) {
+			n++;
+		}
+		write_disk(block_num, n, (char *) table + i*DISK_BLOCK_SIZE);
+		count_meta(n);
+		i += n;
+	}
+}
+
+// a single inode or directory entry is written by rewriting only the (one or two) blocks it's stored in
+static void flush_inode(int i) {
+	pack_inode(i);
+	write_table_bytes(0, fs->disk_inodes, (long long) i*sizeof(struct disk_inode),
+			(long long) (i + 1)*sizeof(struct disk_inode));
+}
+
+static void flush_dir_entry(int i) {
+	pack_dir_entry(i);
+	write_table_bytes(fs->inode_blocks, fs->disk_dir, (long long) i*sizeof(struct disk_dirent),
+			(long long) (i + 1)*sizeof(struct disk_dirent));
+}
+
+static void flush_inode_table() {
+	for (int i = 0; i < fs->num_inodes; i++) {
+		pack_inode(i);
+	}
+	write_table_bytes(0, fs->disk_inodes, 0, (long long) fs->inode_blocks*DISK_BLOCK_SIZE);
+}
+
+static void flush_directory() {
+	for (int i = 0; i < fs->num_files; i++) {
+		pack_dir_entry(i);
+	}
+	write_table_bytes(fs->inode_blocks, fs->disk_dir, 0, (long long) fs->dir_blocks*DISK_BLOCK_SIZE);
+}
+
+// log mode: append the inode table and directory blocks changed by this operation to the log
+static void log_meta() {
+	for (int k = 0; k < fs->meta_blocks; k++) {
+		if (!fs->meta_dirty[k]) {
+			continue;
+		}
+		char *block = k < fs->inode_blocks ? (char *) fs->disk_inodes + k*DISK_BLOCK_SIZE
+			: (char *) fs->disk_dir + (k - fs->inode_blocks)*DISK_BLOCK_SIZE;
+		int block_num = log_alloc();
+		if (block_num == -1) {
+			// the log is full, so overwrite the block where it is
+			write_disk(fs->meta_map[k] != 0 ? fs->meta_map[k] : table_block_num(k), 1, block);
+		}
+		else {
+			write_disk(block_num, 1, block);
+			fs->seg_meta[block_num - fs->seg_start] = k;
+			if (fs->meta_map[k] != 0) {
+				set_free(data_index(fs->meta_map[k]));
+			}
+			fs->meta_map[k] = block_num;
+		}
+		count_meta(1);
+		fs->meta_dirty[k] = false;
+	}
+}
+
+// log mode: move the live blocks of the segment with the fewest of them to the head of the log, so the
+// segment is free again. returns 1 if a segment was cleaned, 0 if none could be
+static int clean_segment() {
+	// 1. pick the segment with the fewest live blocks. it has to have enough dead blocks to be worth it,
+	// and there has to be room in the log for its live blocks and the index and inode blocks they change
+	int victim = -1;
+	int victim_live = SEGMENT_BLOCKS - 2;
+	for (int s = 0; s < num_segments(); s++) {
+		int live = segment_live(s);
+		if (s*SEGMENT_BLOCKS + fs->data_block != fs->seg_start && live > 0 && live < victim_live) {
+			victim = s;
+			victim_live = live;
+		}
+	}
+	int room = SEGMENT_BLOCKS - fs->seg_used + free_segments()*(SEGMENT_BLOCKS - 1);
+	if (victim == -1 || 2*victim_live + fs->meta_blocks + 2*(room/SEGMENT_BLOCKS + 2) > room) {
+		return 0;
+	}
+	int first = victim*SEGMENT_BLOCKS + fs->data_block;
+
+	// 2. read the whole segment with one read, and every index block, before anything is changed.
+	// a segment with a corrupt live block is left alone (sfs_scrub reports it)
+	char *seg = malloc(SEGMENT_BLOCKS*DISK_BLOCK_SIZE);
+	bool ok = dev_read(first, SEGMENT_BLOCKS, seg) >= 0;
+	for (int b = 0; b < SEGMENT_BLOCKS && ok && fs->checksums_enabled; b++) {
+		if (fs->free_bit_map[data_index(first) + b] == '0'
+				&& crc32c(0, seg + b*DISK_BLOCK_SIZE, DISK_BLOCK_SIZE) != fs->block_crc[first + b]) {
+			ok = false;
+		}
+	}
+	for (int i = 0; i < fs->num_inodes && ok; i++) {
+		if (fs->inode_table[i].occupied && fs->inode_table[i].indirect_ptr != 0 && get_index_block(i) == NULL) {
+			ok = false;
+		}
+	}
+	if (!ok) {
+		free(seg);
+		return 0;
+	}
+
+	// 3. copy each live block to the head of the log and point every file that uses it at the copy
+	// (a block shared by several files is copied once)
+	int moved[SEGMENT_BLOCKS] = { 0 }; // new block number of each block of the segment
+	fs->cleaning = true;
+	for (int k = 0; k < fs->meta_blocks; k++) {
+		if (fs->meta_map[k] >= first && fs->meta_map[k] < first + SEGMENT_BLOCKS) {
+			fs->meta_dirty[k] = true; // appended again from the copy in memory by log_meta
+		}
+	}
+	for (int i = 0; i < fs->num_inodes; i++) {
+		if (!fs->inode_table[i].occupied) {
+			continue;
+		}
+		int numPtrs = (int) ceil((double) fs->inode_table[i].filesize/DISK_BLOCK_SIZE);
+		int *index_block = fs->inode_table[i].indirect_ptr != 0 ? get_index_block(i) : NULL;
+		bool changed = false;
+		for (int j = 0; j < numPtrs; j++) {
+			int block_num = get_block_ptr(i, j, index_block);
+			if (block_num < first || block_num >= first + SEGMENT_BLOCKS) {
+				continue;
+			}
+			int *copy = &moved[block_num - first];
+			if (*copy == 0) {
+				*copy = log_alloc();
+				write_disk(*copy, 1, seg + (block_num - first)*DISK_BLOCK_SIZE);
+			}
+			int flags = (j < 12 ? fs->inode_table[i].direct_ptr[j] : index_block[j - 12]) & COMPRESSED_PTR;
+			set_block_ptr(i, j, index_block, *copy | flags);
+			changed = true;
+		}
+		int indirect_ptr = fs->inode_table[i].indirect_ptr;
+		if ((changed && numPtrs > 12) || (indirect_ptr >= first && indirect_ptr < first + SEGMENT_BLOCKS)) {
+			write_index_block(i, index_block);
+			changed = true;
+		}
+		if (changed) {
+			flush_inode(i);
+		}
+	}
+	free(seg);
+
+	// 4. the old copies are free now (inode table and directory blocks are freed when log_meta moves them)
+	load_hashes();
+	for (int b = 0; b < SEGMENT_BLOCKS; b++) {
+		int old_block = data_index(first) + b;
+		if (moved[b] == 0) {
+			continue;
+		}
+		fs->block_refs[data_index(moved[b])] = fs->block_refs[old_block];
+		if (fs->block_hash[old_block] != 0) {
+			set_hash(data_index(moved[b]), fs->block_hash[old_block]);
+			forget_hash(old_block);
+		}
+		set_free(old_block);
+		fs->block_refs[old_block] = 0;
+	}
+	fs->cleaning = false;
+	return 1;
+}
+
+// log mode: work out the fbm and the reference counts from the inodes, since they aren't written to disk.
+// returns -1 if an index block can't be read
+static int rebuild_maps() {
+	memset(fs->free_bit_map, '1', fs->num_data_blocks);
+	memset(fs->block_refs, 0, fs->num_data_blocks);
+	count_free();
+	for (int k = 0; k < fs->meta_blocks; k++) {
+		if (fs->meta_map[k] != 0) {
+			set_used(data_index(fs->meta_map[k]));
+		}
+	}
+	for (int i = 0; i < fs->num_inodes; i++) {
+		if (!fs->inode_table[i].occupied) {
+			continue;
+		}
+		int numPtrs = (int) ceil((double) fs->inode_table[i].filesize/DISK_BLOCK_SIZE);
+		int *index_block = NULL;
+		if (fs->inode_table[i].indirect_ptr != 0) {
+			if ((index_block = get_index_block(i)) == NULL) {
+				return -1;
+			}
+			set_used(data_index(fs->inode_table[i].indirect_ptr));
+		}
+		for (int j = 0; j < numPtrs; j++) {
+			int block_num = get_block_ptr(i, j, index_block);
+			if (block_num == 0) {
+				continue;
+			}
+			// every file after the first one using a block is counted as sharing it
+			if (fs->free_bit_map[data_index(block_num)] == '0') {
+				fs->block_refs[data_index(block_num)]++;
+			}
+			set_used(data_index(block_num));
+		}
+	}
+	return 0;
+}
+
+// log mode: read the checkpoint and bring meta_map up to date from the summaries written since, then
+// read the newest copies of the inode table and directory blocks over meta.
+// returns -1 if the checkpoint is corrupt
+static int load_log(char *meta) {
+	struct log_checkpoint *ckpt = malloc(fs->ckpt_blocks*DISK_BLOCK_SIZE);
+	dev_read(fs->ckpt_block, fs->ckpt_blocks, ckpt);
+	if (ckpt->magic != LOG_MAGIC || ckpt->seg_start < fs->data_block || ckpt->head < 0 || ckpt->head > SEGMENT_BLOCKS) {
+		printf("mksfs error: %s has a corrupt log checkpoint\n", fs->disk_file);
+		free(ckpt);
+		return -1;
+	}
+	memcpy(fs->meta_map, ckpt->meta_map, fs->meta_blocks*sizeof(int));
+	fs->log_seq = ckpt->seq;
+	fs->seg_start = ckpt->seg_start;
+	fs->seg_used = ckpt->head;
+	free(ckpt);
+
+	// 1. roll forward: each run of blocks written since starts with a summary with the next number
+	struct log_summary *summary = malloc(DISK_BLOCK_SIZE);
+	while (fs->seg_used < SEGMENT_BLOCKS) {
+		dev_read(fs->seg_start + fs->seg_used, 1, summary);
+		if (summary->magic != LOG_MAGIC || summary->seq != fs->log_seq
+				|| summary->nblocks < 1 || fs->seg_used + 1 + summary->nblocks > SEGMENT_BLOCKS) {
+			break;
+		}
+		for (int j = 0; j < summary->nblocks; j++) {
+			if (summary->meta[j] >= 0 && summary->meta[j] < fs->meta_blocks) {
+				fs->meta_map[summary->meta[j]] = fs->seg_start + fs->seg_used + 1 + j;
+			}
+		}
+		fs->seg_used += 1 + summary->nblocks;
+		fs->log_seq++;
+	}
+	free(summary);
+	fs->seg_flushed = fs->seg_used;
+
+	// 2. read the blocks that have moved
+	for (int k = 0; k < fs->meta_blocks; k++) {
+		if (fs->meta_map[k] != 0) {
+			read_disk(fs->meta_map[k], 1, meta + k*DISK_BLOCK_SIZE);
+		}
+	}
+	return 0;
+}
+
+// unpack the inode table and directory from the blocks they were read into (inode table first)
+static void load_tables(const char *meta_blocks) {
+	memcpy(fs->disk_inodes, meta_blocks, fs->inode_blocks*DISK_BLOCK_SIZE);
+	memcpy(fs->disk_dir, meta_blocks + fs->inode_blocks*DISK_BLOCK_SIZE, fs->dir_blocks*DISK_BLOCK_SIZE);
+
+	for (int i = 0; i < fs->num_inodes; i++) {
+		fs->inode_table[i].occupied = fs->disk_inodes[i].flags & DI_OCCUPIED;
+		fs->inode_table[i].compressed = fs->disk_inodes[i].flags & DI_COMPRESSED;
+		fs->inode_table[i].inlined = fs->disk_inodes[i].flags & DI_INLINE;
+		fs->inode_table[i].dir = fs->disk_inodes[i].flags & DI_DIR;
+		fs->inode_table[i].filesize = fs->disk_inodes[i].filesize;
+		if (fs->inode_table[i].inlined) {
+			memcpy(fs->inode_table[i].inline_data, fs->disk_inodes[i].direct_ptr, INLINE_BYTES);
+			memset(fs->inode_table[i].direct_ptr, 0, sizeof(fs->inode_table[i].direct_ptr));
+			fs->inode_table[i].indirect_ptr = 0;
+			continue;
+		}
+		memset(fs->inode_table[i].inline_data, 0, INLINE_BYTES);
+		memcpy(fs->inode_table[i].direct_ptr, fs->disk_inodes[i].direct_ptr, sizeof(fs->disk_inodes[i].direct_ptr));
+		fs->inode_table[i].indirect_ptr = fs->disk_inodes[i].indirect_ptr;
+	}
+	for (int i = 0; i < fs->num_files; i++) {
+		memcpy(fs->directory[i].filename, fs->disk_dir[i].filename, sizeof(fs->disk_dir[i].filename));
+		fs->directory[i].filename[16] = '\0';
+		fs->directory[i].inode = fs->disk_dir[i].inode;
+		fs->directory[i].occupied = fs->disk_dir[i].inode != -1;
+		if (fs->directory[i].occupied) {
+			name_index_add(i);
+		}
+	}
+}
+
+// write the reference count table, changed fingerprint blocks and changed checksum blocks to disk.
+// in log mode, append the changed inode table and directory blocks to the log and write it out first
+static void flush_tables() {
+	if (fs->log_mode) {
+		log_meta();
+		// keep enough segments free for the largest write. the cleaner only runs here, at the end of an
+		// operation, since it moves blocks an operation may still be working on
+		for (int i = 0; i < LOG_MIN_FREE && !fs->cleaning && free_segments() < LOG_MIN_FREE && clean_segment(); i++) {
+			log_meta();
+		}
+		log_flush();
+	}
+	if (fs->refs_dirty) {
+		if (!fs->log_mode) {
+			write_disk(fs->ref_block, fs->map_blocks, fs->block_refs);
+			count_meta(fs->map_blocks);
+		}
+		fs->refs_dirty = false;
+	}
+	// the first fingerprints written are recorded in the superblock, so a mount knows to read them
+	if (!fs->hashes_used && memchr(fs->hash_dirty, true, fs->hash_blocks) != NULL) {
+		fs->hashes_used = true;
+		write_superblock();
+	}
+	for (int i = 0; i < fs->hash_blocks; i++) {
+		if (fs->hash_dirty[i]) {
+			write_disk(fs->hash_block + i, 1, (char *) fs->block_hash + i*DISK_BLOCK_SIZE);
+			count_meta(1);
+			fs->hash_dirty[i] = false;
+		}
+	}
+	// last, since the writes above change checksums
+	for (int i = 0; i < fs->crc_blocks; i++) {
+		if (fs->crc_dirty[i]) {
+			dev_write(fs->crc_block + i, 1, (char *) fs->block_crc + i*DISK_BLOCK_SIZE);
+			count_meta(1);
+			fs->crc_dirty[i] = false;
+		}
+	}
+}
+
+static int blocks_for(long long bytes) {
+	return (bytes + DISK_BLOCK_SIZE - 1)/DISK_BLOCK_SIZE;
+}
+
+// work out where each region of the disk starts from the number of inodes and data blocks
+static void set_layout(int num_inodes, int num_data_blocks) {
+	fs->num_inodes = num_inodes;
+	fs->num_files = num_inodes - 1;
+	fs->num_data_blocks = num_data_blocks;
+	fs->inode_blocks = blocks_for((long long) fs->num_inodes*sizeof(struct disk_inode));
+	fs->dir_blocks = blocks_for((long long) fs->num_files*sizeof(struct disk_dirent));
+	fs->map_blocks = blocks_for(fs->num_data_blocks);
+	if (fs->groups) {
+		// the directory comes first, then the groups, each with an equal slice of the inode table
+		fs->num_groups = (fs->num_data_blocks + GROUP_DATA_BLOCKS - 1)/GROUP_DATA_BLOCKS;
+		fs->group_inode_blocks = blocks_for(((long long) fs->num_inodes + fs->num_groups - 1)/fs->num_groups
+				*sizeof(struct disk_inode));
+		fs->inode_blocks = fs->num_groups*fs->group_inode_blocks;
+		fs->group_size = 1 + fs->group_inode_blocks + GROUP_DATA_BLOCKS;
+		fs->dir_block = INODE_BLOCK;
+		fs->data_block = fs->dir_block + fs->dir_blocks;
+		fs->fbm_block = fs->data_block;
+		fs->ref_block = fs->data_block + fs->num_groups*(1 + fs->group_inode_blocks) + fs->num_data_blocks;
+	}
+	else {
+		fs->dir_block = INODE_BLOCK + fs->inode_blocks;
+		fs->data_block = fs->dir_block + fs->dir_blocks;
+		fs->fbm_block = fs->data_block + fs->num_data_blocks;
+		fs->ref_block = fs->fbm_block + fs->map_blocks;
+	}
+	fs->hash_block = fs->ref_block + fs->map_blocks;
+	fs->hash_blocks = blocks_for((long long) fs->num_data_blocks*sizeof(unsigned long long));
+	fs->crc_block = fs->hash_block + fs->hash_blocks;
+	fs->crc_blocks = blocks_for((long long) fs->crc_block*sizeof(unsigned int));
+	// a log-structured disk has its checkpoint at the end
+	fs->meta_blocks = fs->inode_blocks + fs->dir_blocks;
+	fs->ckpt_block = fs->crc_block + fs->crc_blocks;
+	fs->ckpt_blocks = fs->log_mode ? blocks_for(sizeof(struct log_checkpoint) + (long long) fs->meta_blocks*sizeof(int)) : 0;
+	fs->num_blocks = fs->ckpt_block + fs->ckpt_blocks;
+}
+
+static void free_tables() {
+	if (fs->index_cache != NULL) {
+		for (int i = 0; i < fs->num_inodes; i++) {
+			forget_index_block(i);
+		}
+	}
+	free(fs->free_bit_map);
+	fs->free_bit_map = NULL;
+	free(fs->free_count);
+	fs->free_count = NULL;
+	free(fs->fbm_written);
+	fs->fbm_written = NULL;
+	free(fs->block_refs);
+	fs->block_refs = NULL;
+	free(fs->block_hash);
+	fs->block_hash = NULL;
+	free(fs->hash_bucket);
+	fs->hash_bucket = NULL;
+	free(fs->hash_next);
+	fs->hash_next = NULL;
+	free(fs->hash_dirty);
+	fs->hash_dirty = NULL;
+	free(fs->block_crc);
+	fs->block_crc = NULL;
+	free(fs->crc_dirty);
+	fs->crc_dirty = NULL;
+	free(fs->resv_map);
+	fs->resv_map = NULL;
+	free(fs->directory);
+	fs->directory = NULL;
+	free(fs->name_filter);
+	fs->name_filter = NULL;
+	free(fs->name_bucket);
+	fs->name_bucket = NULL;
+	free(fs->name_next);
+	fs->name_next = NULL;
+	free(fs->fdt);
+	fs->fdt = NULL;
+	free(fs->inode_table);
+	fs->inode_table = NULL;
+	free(fs->index_cache);
+	fs->index_cache = NULL;
+	free(fs->disk_inodes);
+	fs->disk_inodes = NULL;
+	free(fs->disk_dir);
+	fs->disk_dir = NULL;
+	free(fs->meta_map);
+	fs->meta_map = NULL;
+	free(fs->meta_dirty);
+	fs->meta_dirty = NULL;
+	free(fs->seg_buf);
+	fs->seg_buf = NULL;
+	free(fs->seg_meta);
+	fs->seg_meta = NULL;
+}
+
+// allocate empty tables for the current geometry
+static void alloc_tables() {
+	fs->free_bit_map = calloc(fs->map_blocks, DISK_BLOCK_SIZE);
+	fs->free_count = calloc((fs->num_data_blocks + FREE_CHUNK - 1)/FREE_CHUNK, sizeof(int));
+	if (fs->groups) {
+		fs->fbm_written = calloc(fs->map_blocks, DISK_BLOCK_SIZE);
+	}
+	fs->block_refs = calloc(fs->map_blocks, DISK_BLOCK_SIZE);
+	fs->block_hash = calloc(fs->hash_blocks, DISK_BLOCK_SIZE);
+	fs->hash_bucket = malloc(fs->num_data_blocks*sizeof(int));
+	fs->hash_next = malloc(fs->num_data_blocks*sizeof(int));
+	fs->hash_dirty = calloc(fs->hash_blocks, sizeof(bool));
+	fs->block_crc = calloc(fs->crc_blocks, DISK_BLOCK_SIZE);
+	fs->crc_dirty = calloc(fs->crc_blocks, sizeof(bool));
+	fs->resv_map = calloc(fs->num_data_blocks, sizeof(int));
+	fs->directory = calloc(fs->num_files, sizeof(struct dir_entry));
+	fs->name_filter_mask = NAME_FILTER_MIN - 1;
+	while (fs->name_filter_mask + 1 < NAME_FILTER_COUNTERS*fs->num_files) {
+		fs->name_filter_mask = fs->name_filter_mask*2 + 1;
+	}
+	fs->name_filter = calloc(fs->name_filter_mask + 1, 1);
+	fs->name_bucket_mask = 0;
+	while (fs->name_bucket_mask + 1 < fs->num_files) {
+		fs->name_bucket_mask = fs->name_bucket_mask*2 + 1;
+	}
+	fs->name_bucket = malloc((fs->name_bucket_mask + 1)*sizeof(int));
+	memset(fs->name_bucket, -1, (fs->name_bucket_mask + 1)*sizeof(int));
+	fs->name_next = malloc(fs->num_files*sizeof(int));
+	fs->inode_hint = ROOT_INODE + 1;
+	fs->entry_hint = 0;
+	fs->inode_table = calloc(fs->num_inodes, sizeof(struct inode));
+	fs->index_cache = calloc(fs->num_inodes, sizeof(int *));
+	fs->disk_inodes = calloc(fs->inode_blocks, DISK_BLOCK_SIZE);
+	fs->disk_dir = calloc(fs->dir_blocks, DISK_BLOCK_SIZE);
+	fs->fdt_size = FDT_START_SIZE;
+	fs->fdt = calloc(fs->fdt_size, sizeof(struct opened_file));
+	fs->refs_dirty = false;
+	fs->hashes_loaded = false;
+	if (fs->log_mode) {
+		fs->meta_map = calloc(fs->meta_blocks, sizeof(int));
+		fs->meta_dirty = calloc(fs->meta_blocks, sizeof(bool));
+		fs->seg_buf = malloc(SEGMENT_BLOCKS*DISK_BLOCK_SIZE);
+		fs->seg_meta = malloc(SEGMENT_BLOCKS*sizeof(int));
+	}
+}
+
+// mount fs's disk, or make a new one if fresh is set. returns -1 if the disk can't be used
+static int mount_disk(bool fresh) {
+	// drop the tables of the previous disk, once everything is written to it
+	if (fs->wb_enabled) {
+		wb_flush(true);
+	}
+	disk_close(fs->disk);
+	free_tables();
+
+	if (!fresh) {
+		// 1. read the disk's geometry from its superblock - if unsuccessful, exit
+		struct super_block *superblock = malloc(DISK_BLOCK_SIZE);
+		if (disk_init(fs->disk, fs->disk_file, DISK_BLOCK_SIZE, 1) != 0) {
+			perror("init_disk error");
+			free(superblock);
+			return -1;
+		}
+		disk_read(fs->disk, 0, 1, superblock);
+		disk_close(fs->disk);
+		if (superblock->magic != SFS_MAGIC || superblock->version != SFS_VERSION) {
+			printf("mksfs error: %s has an unsupported format (version %d)\n", fs->disk_file, superblock->version);
+			free(superblock);
+			return -1;
+		}
+		if (superblock->block_size != DISK_BLOCK_SIZE || superblock->num_inodes < 2 || superblock->num_inodes > MAX_GEOMETRY + 1
+				|| superblock->num_data_blocks < 1 || superblock->num_data_blocks > MAX_GEOMETRY) {
+			printf("mksfs error: %s has a corrupt superblock\n", fs->disk_file);
+			free(superblock);
+			return -1;
+		}
+		fs->log_mode = superblock->flags & SB_LOG;
+		fs->groups = superblock->flags & SB_GROUPS;
+		set_layout(superblock->num_inodes, superblock->num_data_blocks);
+		fs->compress_new_files = superblock->flags & SB_COMPRESS;
+		fs->dedup_enabled = superblock->flags & SB_DEDUP;
+		fs->checksums_enabled = superblock->flags & SB_CHECKSUM;
+		fs->hashes_used = superblock->flags & SB_HASHED;
+		free(superblock);
+
+		// 2. open the whole disk and allocate tables for it
+		if (disk_init(fs->disk, fs->disk_file, DISK_BLOCK_SIZE, fs->num_blocks) != 0) {
+			perror("init_disk error");
+			return -1;
+		}
+		alloc_tables();
+
+		// 3. read the inode table and directory. they're next to each other, so it's one read (one per
+		// group with block groups)
+		char *meta_blocks = malloc(fs->meta_blocks*DISK_BLOCK_SIZE);
+		if (fs->checksums_enabled) {
+			dev_read(fs->crc_block, fs->crc_blocks, fs->block_crc);
+		}
+		for (int k = 0; k < fs->meta_blocks; ) {
+			int block_num = table_block_num(k);
+			int n = 1;
+			while (k + n < fs->meta_blocks && table_block_num(k + n) == block_num + n) {
+				n++;
+			}
+			dev_read(block_num, n, meta_blocks + k*DISK_BLOCK_SIZE);
+			if (fs->checksums_enabled) {
+				verify_blocks(block_num, n, meta_blocks + k*DISK_BLOCK_SIZE);
+			}
+			k += n;
+		}
+		// in log mode, the newest copies of some of those blocks are in the log
+		if (fs->log_mode && load_log(meta_blocks) < 0) {
+			free(meta_blocks);
+			return -1;
+		}
+		load_tables(meta_blocks);
+		free(meta_blocks);
+
+		// 4. cache free bit map and reference counts (worked out from the inodes in log mode).
+		// the fingerprint table is read when it's first used
+		if (fs->log_mode) {
+			if (rebuild_maps() < 0) {
+				return -1;
+			}
+		}
+		else if (fs->groups) {
+			for (int g = 0; g < fs->num_groups; g++) {
+				read_disk(group_start(g), 1, fs->free_bit_map + g*DISK_BLOCK_SIZE);
+			}
+			memcpy(fs->fbm_written, fs->free_bit_map, fs->map_blocks*DISK_BLOCK_SIZE);
+			read_disk(fs->ref_block, fs->map_blocks, fs->block_refs);
+		}
+		else {
+			read_disk(fs->fbm_block, fs->map_blocks, fs->free_bit_map);
+			read_disk(fs->ref_block, fs->map_blocks, fs->block_refs);
+		}
+		if (!fs->log_mode) {
+			count_free();
+		}
+	}
+	else {
+		// 1. initialize disk with the requested geometry - if unsuccessful, exit
+		fs->log_mode = fs->new_log_mode;
+		fs->groups = fs->new_groups;
+		if (fs->log_mode && fs->new_num_data_blocks/SEGMENT_BLOCKS < LOG_MIN_SEGMENTS) {
+			printf("mksfs error: a log-structured disk needs at least %d data blocks\n", LOG_MIN_SEGMENTS*SEGMENT_BLOCKS);
+			return -1;
+		}
+		// the log puts every block at its head, so it has no use for groups
+		if (fs->log_mode && fs->groups) {
+			printf("mksfs error: a log-structured disk can't have block groups\n");
+			return -1;
+		}
+		set_layout(fs->new_num_files + 1, fs->new_num_data_blocks);
+		if (disk_init_fresh(fs->disk, fs->disk_file, DISK_BLOCK_SIZE, fs->num_blocks) != 0) {
+			perror("init_fresh_disk error");
+			return -1;
+		}
+		alloc_tables();
+
+		// 2. set up free bit map (cached in memory)
+		memset(fs->free_bit_map, '1', fs->num_data_blocks);
+		count_free();
+		flush_fbm();
+
+		// no data blocks are shared yet
+		if (!fs->log_mode) {
+			write_disk(fs->ref_block, fs->map_blocks, fs->block_refs);
+		}
+		fs->hashes_used = false; // the fingerprint table on the fresh disk is all 0
+
+		// the log starts at the first segment
+		if (fs->log_mode) {
+			fs->seg_start = fs->data_block;
+			fs->seg_used = 0;
+			fs->seg_flushed = 0;
+			fs->log_seq = 1;
+			write_checkpoint();
+		}
+
+		// 3. set up empty root directory on disk
+		flush_directory();
+		
+		// 4. create i node table + root dir i node (the directory has its own blocks after the
+		// inode table, so the root i node has no data blocks)
+		fs->inode_table[0].occupied = true;
+		flush_inode_table();
+		flush_tables();
+		
+		// 5. set up super block on disk
+		fs->compress_new_files = false;
+		fs->dedup_enabled = false;
+		fs->checksums_enabled = false;
+		write_superblock();
+	}
+	return 0;
+}
+
+static void stop_trace(void) {
+	sfs_trace(NULL);
+}
+
+// a program run with SFS_TRACE=file is traced from the first file system it uses until it exits
+static void trace_from_env(void) {
+	char *path = getenv("SFS_TRACE");
+	if (path != NULL && sfs_trace(path) == 0) {
+		atexit(stop_trace);
+	}
+}
+
+// a new file system on disk_file, using disk (or its own disk if NULL). nothing is mounted yet
+static struct sfs *new_sfs(const char *disk_file, struct disk *disk) {
+	pthread_once(&trace_env_once, trace_from_env);
+	struct sfs *sfs = calloc(1, sizeof(struct sfs));
+	sfs->disk_file = strdup(disk_file);
+	sfs->disk = disk != NULL ? disk : &sfs->own_disk;
+	sfs->new_num_files = DEFAULT_FILES;
+	sfs->new_num_data_blocks = DEFAULT_DATA_BLOCKS;
+	return sfs;
+}
+
+// the file system used by the functions without an sfs_t argument, made the first time it's needed.
+// it uses the default disk, so read_blocks and write_blocks see the same disk
+static struct sfs *get_default_fs() {
+	if (default_fs == NULL) {
+		default_fs = new_sfs("sfs_disk", default_disk());
+	}
+	return default_fs;
+}
+
+sfs_t *sfs_mount(const char *path, const struct sfs_opts *opts) {
+	int max_files = opts != NULL && opts->max_files > 0 ? opts->max_files : DEFAULT_FILES;
+	int data_blocks = opts != NULL && opts->data_blocks > 0 ? opts->data_blocks : DEFAULT_DATA_BLOCKS;
+
+	// block numbers have to stay below COMPRESSED_PTR
+	if (max_files > MAX_GEOMETRY || data_blocks > MAX_GEOMETRY) {
+		printf("sfs_mount error: can't make a disk with %d files and %d data blocks\n", max_files, data_blocks);
+		return NULL;
+	}
+	fs = new_sfs(path, NULL);
+	fs->new_num_files = max_files;
+	fs->new_num_data_blocks = data_blocks;
+	fs->new_log_mode = opts != NULL && opts->log_structured;
+	fs->new_groups = opts != NULL && opts->block_groups;
+	trace(TRACE_MOUNT, path, (opts != NULL && opts->fresh ? TRACE_FRESH : 0) | (fs->new_log_mode ? TRACE_LOG : 0) |
+			(fs->new_groups ? TRACE_GROUPS : 0), max_files, data_blocks, 0);
+	struct op_timer t = op_begin(SFS_OP_MOUNT, -1);
+	if (mount_disk(opts != NULL && opts->fresh) < 0) {
+		cur_op = NULL;
+		disk_close(fs->disk);
+		disk_release(fs->disk);
+		free_tables();
+		free(fs->disk_file);
+		free(fs);
+		return NULL;
+	}
+	op_end(&t);
+	return fs;
+}
+
+void sfs_unmount(sfs_t *sfs) {
+	fs = sfs;
+	trace(TRACE_UNMOUNT, NULL, 0, 0, 0, 0);
+	// everything is written by the end of each operation. a checkpoint saves the next mount rolling forward
+	if (fs->log_mode) {
+		write_checkpoint();
+	}
+	if (fs->wb_enabled) {
+		wb_shutdown();
+	}
+	disk_close(fs->disk);
+	disk_release(fs->disk);
+	free_tables();
+	free(fs->disk_file);
+	free(fs);
+}
+
+void mksfs(int fresh) {
+	fs = get_default_fs();
+	trace(TRACE_MKSFS, NULL, fresh, 0, 0, 0);
+	COUNT_OP(SFS_OP_MOUNT, -1);
+	if (mount_disk(fresh) < 0) {
+		exit(1);
+	}
+}
+
+int sfs_geometry(int max_files, int data_blocks) {
+	// block numbers have to stay below COMPRESSED_PTR
+	if (max_files < 1 || max_files > MAX_GEOMETRY || data_blocks < 1 || data_blocks > MAX_GEOMETRY) {
+		printf("sfs_geometry error: can't make a disk with %d files and %d data blocks\n", max_files, data_blocks);
+		return -1;
+	}
+	fs = get_default_fs();
+	trace(TRACE_GEOMETRY, NULL, max_files, data_blocks, 0, 0);
+	fs->new_num_files = max_files;
+	fs->new_num_data_blocks = data_blocks;
+	return 0;
+}
+
+void sfs_logmode(int enable) {
+	fs = get_default_fs();
+	trace(TRACE_LOGMODE, NULL, enable, 0, 0, 0);
+	fs->new_log_mode = enable;
+}
+
+void sfs_blockgroups(int enable) {
+	fs = get_default_fs();
+	trace(TRACE_BLOCKGROUPS, NULL, enable, 0, 0, 0);
+	fs->new_groups = enable;
+}
+
+int sfs_trace(const char *path) {
+	int res = 0;
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file != NULL) {
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+	if (path != NULL) {
+		FILE *f = fopen(path, "wb");
+		int version = TRACE_VERSION;
+		if (f == NULL || fwrite(TRACE_MAGIC, 1, 8, f) != 8 || fwrite(&version, sizeof(int), 1, f) != 1) {
+			printf("sfs_trace error: could not create %s.\n", path);
+			if (f != NULL) {
+				fclose(f);
+			}
+			res = -1;
+		}
+		else {
+			clock_gettime(CLOCK_MONOTONIC, &trace_start);
+			trace_gen++;
+			trace_fs_count = 0;
+			trace_file = f;
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+	return res;
+}
+
+
+// first inode (directory entry) that isn't in use, or -1 if there is none. the hints skip the ones
+// below that are known to be in use, so creating files one after another doesn't scan the whole table
+static int next_free_inode() {
+	for (int i = fs->inode_hint; i < fs->num_inodes; i++) {
+		if (!fs->inode_table[i].occupied) {
+			fs->inode_hint = i;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int next_free_entry() {
+	for (int i = fs->entry_hint; i < fs->num_files; i++) {
+		if (!fs->directory[i].occupied) {
+			fs->entry_hint = i;
+			return i;
+		}
+	}
+	return -1;
+}
+
+// give back an inode that is no longer used (its blocks are freed by the caller)
+static void release_inode(int inode) {
+	fs->inode_table[inode].occupied = false;
+	forget_index_block(inode);
+	if (inode < fs->inode_hint) {
+		fs->inode_hint = inode;
+	}
+}
+
+// free the data blocks and the index block of a file or subdirectory that's being removed. returns -1
+// if its index block can't be read
+static int free_file_blocks(int inode) {
+	int numPtrs = (int) ceil((double) fs->inode_table[inode].filesize/DISK_BLOCK_SIZE); // get number of blocks the file uses
+	int *index_block = NULL;
+
+	// if file used index block to point to data blocks, load index block
+	if (numPtrs > 12 && (index_block = get_index_block(inode)) == NULL) {
+		return -1;
+	}
+
+	// blocks still shared with a clone are only dereferenced
+	for (int j = 0; j < numPtrs; j++) {
+		if (get_block_ptr(inode, j, index_block) != 0) { // compressed clusters leave pointers unused
+			release_block(get_block_ptr(inode, j, index_block));
+		}
+	}
+	// index block is never shared, so free it directly
+	if (fs->inode_table[inode].indirect_ptr != 0) {
+		set_free(data_index(fs->inode_table[inode].indirect_ptr));
+	}
+	return 0;
+}
+
+// number of slots of subdirectory dir (its size is always a whole number of blocks)
+static int dir_slots(int dir) {
+	return fs->inode_table[dir].filesize/DISK_BLOCK_SIZE*DIR_SLOTS;
+}
+
+// slot the search for a name starts from
+static int dir_home(const char *name, int slots) {
+	return 1 + name_hash(name) % (slots - 1);
+}
+
+// slot s of a directory's blocks, which are in memory one after another from blocks
+static struct disk_dirent *dir_slot(void *blocks, int s) {
+	return (struct disk_dirent *) ((char *) blocks + s/DIR_SLOTS*DISK_BLOCK_SIZE) + s%DIR_SLOTS;
+}
+
+// copy the name in slot e (not null terminated if it's 16 characters long) to name
+static void dir_name(const struct disk_dirent *e, char *name) {
+	memcpy(name, e->filename, MAXFILENAME);
+	name[MAXFILENAME] = '\0';
+}
+
+// read block b of subdirectory dir. returns -1 if it can't be read
+static int dir_read_block(int dir, int b, struct disk_dirent *buf) {
+	int *index_block = NULL;
+	if (b >= 12 && (index_block = get_index_block(dir)) == NULL) {
+		return -1;
+	}
+	int block_num = get_block_ptr(dir, b, index_block);
+	if (block_num == 0) {
+		return -1;
+	}
+	return read_disk(block_num, 1, buf);
+}
+
+// write block b of subdirectory dir in place, except in log mode, where the block moves to the head of
+// the log. a directory's blocks are never shared or deduplicated. returns 1 if the inode has to be
+// written again (dir_flush), 0 if not, or -1 if the block can't be written
+static int dir_write_block(int dir, int b, struct disk_dirent *buf) {
+	int *index_block = b >= 12 ? get_index_block(dir) : NULL;
+	int block_num = get_block_ptr(dir, b, index_block);
+	int moved = 0;
+	if (fs->log_mode && !in_log_buffer(block_num)) {
+		int new_block = log_alloc();
+		if (new_block != -1) {
+			set_free(data_index(block_num));
+			set_block_ptr(dir, b, index_block, new_block);
+			block_num = new_block;
+			moved = 1;
+		}
+	}
+	count_meta(1);
+	if (write_disk(block_num, 1, buf) < 0) {
+		printf("sfs: can't write directory inode %d\n", dir);
+		return -1;
+	}
+	return moved;
+}
+
+// write the inode of subdirectory dir, and its index block, after its blocks were moved
+static void dir_flush(int dir) {
+	if (fs->inode_table[dir].indirect_ptr != 0) {
+		write_index_block(dir, get_index_block(dir));
+	}
+	flush_inode(dir);
+}
+
+// replace the contents of subdirectory dir (or a new one, without blocks yet) with table, nblocks blocks.
+// the table is written to newly allocated blocks, the inode is only pointed at them once they're all on
+// disk, and the old blocks are freed after that, so a failed write or a crash leaves the old table whole.
+// returns -1 if the disk is full or a block can't be written
+static int dir_write_table(int dir, void *table, int nblocks) {
+	struct inode *node = &fs->inode_table[dir];
+	int old_blocks = node->filesize/DISK_BLOCK_SIZE;
+	int *old_index = NULL;
+	if (old_blocks > DIR_MAX_BLOCKS || (old_blocks > 12 && (old_index = get_index_block(dir)) == NULL)) {
+		return -1;
+	}
+	int old[DIR_MAX_BLOCKS + 1]; // the blocks to free afterwards, with the index block
+	int nold = 0;
+	for (int b = 0; b < old_blocks; b++) {
+		old[nold++] = get_block_ptr(dir, b, old_index);
+	}
+	if (node->indirect_ptr != 0) {
+		old[nold++] = node->indirect_ptr;
+	}
+
+	// 1. allocate the new blocks (the index block last)
+	int *index_block = nblocks > 12 ? calloc(1, DISK_BLOCK_SIZE) : NULL;
+	int blocks[DIR_MAX_BLOCKS + 1];
+	int nnew = nblocks + (index_block != NULL);
+	int goal = first_goal(dir);
+	int n = 0;
+	int res = 0;
+	for (; n < nnew; n++) {
+		if ((blocks[n] = alloc_block(goal, -1)) == -1) {
+			res = -1;
+			break;
+		}
+		goal = blocks[n] + 1;
+	}
+	// 2. write the table, each run of consecutive blocks at once, then the index block
+	for (int b = 0; b < nblocks && res == 0; ) {
+		int len = 1;
+		while (b + len < nblocks && blocks[b + len] == blocks[b] + len) {
+			len++;
+		}
+		count_meta(len);
+		res = write_disk(blocks[b], len, (char *) table + b*DISK_BLOCK_SIZE) < 0 ? -1 : 0;
+		b += len;
+	}
+	if (res == 0 && index_block != NULL) {
+		memcpy(index_block, blocks + 12, (nblocks - 12)*sizeof(int));
+		count_meta(1);
+		res = write_disk(blocks[nblocks], 1, index_block) < 0 ? -1 : 0;
+	}
+	if (res < 0) {
+		printf("sfs: can't write directory inode %d\n", dir);
+		for (int i = 0; i < n; i++) {
+			set_free(data_index(blocks[i]));
+		}
+		free(index_block);
+		return -1;
+	}
+
+	// 3. the fbm shows the new blocks in use before the inode points at them (a crash leaks the old ones
+	// at worst), then the old blocks are freed
+	flush_fbm();
+	memset(node->direct_ptr, 0, sizeof(node->direct_ptr));
+	memcpy(node->direct_ptr, blocks, (nblocks < 12 ? nblocks : 12)*sizeof(int));
+	node->indirect_ptr = index_block != NULL ? blocks[nblocks] : 0;
+	node->filesize = nblocks*DISK_BLOCK_SIZE;
+	forget_index_block(dir);
+	fs->index_cache[dir] = index_block;
+	flush_inode(dir);
+	for (int i = 0; i < nold; i++) {
+		set_free(data_index(old[i]));
+	}
+	flush_fbm();
+	return 0;
+}
+
+// read all of subdirectory dir into a malloc'ed buffer. returns NULL if it can't be read
+static struct disk_dirent *dir_read_table(int dir) {
+	int nblocks = fs->inode_table[dir].filesize/DISK_BLOCK_SIZE;
+	struct disk_dirent *table = malloc(nblocks*DISK_BLOCK_SIZE);
+	for (int b = 0; b < nblocks; b++) {
+		if (dir_read_block(dir, b, dir_slot(table, b*DIR_SLOTS)) < 0) {
+			free(table);
+			return NULL;
+		}
+	}
+	return table;
+}
+
+// put the name in e in its place in table (of slots slots), and count it in the table's header
+static void dir_place(void *table, int slots, const struct disk_dirent *e) {
+	struct dir_header *header = table;
+	char name[MAXFILENAME + 1];
+	dir_name(e, name);
+	int s = dir_home(name, slots);
+	while (dir_slot(table, s)->inode != DIR_FREE) {
+		s = s + 1 < slots ? s + 1 : 1;
+	}
+	*dir_slot(table, s) = *e;
+	header->entries++;
+	header->used++;
+}
+
+// rebuild subdirectory dir as a table of nblocks blocks, without its removed slots. returns -1 if the
+// directory can't be read or written, or the disk is full (the directory is left as it was)
+static int dir_rebuild(int dir, int nblocks) {
+	int old_slots = dir_slots(dir);
+	struct disk_dirent *old = dir_read_table(dir);
+	if (old == NULL) {
+		return -1;
+	}
+	struct disk_dirent *table = calloc(nblocks, DISK_BLOCK_SIZE);
+	struct dir_header *header = (struct dir_header *) table;
+
+	// put every name in its place in the new table (a shard stays part of its directory)
+	header->magic = DIR_MAGIC;
+	header->depth = ((struct dir_header *) old)->depth;
+	header->parent = ((struct dir_header *) old)->parent;
+	for (int k = 1; k < old_slots; k++) {
+		if (dir_slot(old, k)->inode > DIR_FREE) {
+			dir_place(table, nblocks*DIR_SLOTS, dir_slot(old, k));
+		}
+	}
+	int res = dir_write_table(dir, table, nblocks);
+	free(old);
+	free(table);
+	return res;
+}
+
+// hash bits that pick the shard of a name
+static unsigned int shard_hash(const char *name) {
+	return name_hash(name) >> 32;
+}
+
+// read the header of subdirectory dir. returns -1 if it can't be read
+static int dir_read_header(int dir, struct dir_header *header) {
+	struct disk_dirent *head = malloc(DISK_BLOCK_SIZE);
+	int res = dir_read_block(dir, 0, head);
+	memcpy(header, head, sizeof(*header));
+	free(head);
+	return res < 0 ? -1 : 0;
+}
+
+// read the 2^header->depth shard pointers of sharded subdirectory dir into a malloc'ed buffer (whole blocks).
+// returns NULL if they can't be read
+static int *dir_read_pointers(int dir, const struct dir_header *header) {
+	if (header->depth < 0 || header->depth > DIR_MAX_DEPTH) {
+		return NULL;
+	}
+	int nblocks = ((1 << header->depth) + DIR_PTRS - 1)/DIR_PTRS;
+	if (1 + nblocks > dir_slots(dir)/DIR_SLOTS) {
+		return NULL;
+	}
+	int *ptrs = malloc(nblocks*DISK_BLOCK_SIZE);
+	for (int b = 0; b < nblocks; b++) {
+		if (dir_read_block(dir, 1 + b, (struct disk_dirent *) (ptrs + b*DIR_PTRS)) < 0) {
+			free(ptrs);
+			return NULL;
+		}
+	}
+	return ptrs;
+}
+
+// whether pointer k is the first one to its shard. a shard of depth d is pointed at by every 2^d'th
+// pointer from the first, so its first pointer is the only one that doesn't repeat one of its lower bits
+static bool dir_first_pointer(const int *ptrs, int k) {
+	for (int j = 0; (1 << j) <= k; j++) {
+		if (ptrs[k & ((1 << j) - 1)] == ptrs[k]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// the table name is in (or goes in) in directory dir: dir itself, or the shard of the name if dir is
+// sharded. returns -1 if the directory can't be read
+static int dir_pick(int dir, const char *name) {
+	struct dir_header header;
+	if (dir == ROOT_INODE) {
+		return dir;
+	}
+	if (dir_read_header(dir, &header) < 0) {
+		return -1;
+	}
+	if (header.magic != DIR_SHARDS_MAGIC) {
+		return dir;
+	}
+	if (header.depth < 0 || header.depth > DIR_MAX_DEPTH) {
+		printf("sfs: bad shard pointers in directory inode %d\n", dir);
+		return -1;
+	}
+	int k = shard_hash(name) & ((1u << header.depth) - 1);
+	int *buf = malloc(DISK_BLOCK_SIZE);
+	int shard = dir_read_block(dir, 1 + k/DIR_PTRS, (struct disk_dirent *) buf) < 0 ? -1 : buf[k%DIR_PTRS];
+	free(buf);
+	if (shard != -1 && (shard <= ROOT_INODE || shard >= fs->num_inodes || !fs->inode_table[shard].occupied
+			|| !fs->inode_table[shard].dir)) {
+		printf("sfs: bad shard pointer in directory inode %d\n", dir);
+		shard = -1;
+	}
+	return shard;
+}
+
+// blocks a table of entries names starts out with: the fewest (a power of two) it's at most half full in
+static int dir_table_blocks(int entries) {
+	int nblocks = 1;
+	while (2*nblocks <= DIR_MAX_BLOCKS && entries + 1 > DIR_LOAD*nblocks*DIR_SLOTS/2) {
+		nblocks *= 2;
+	}
+	return nblocks;
+}
+
+// move the names of subdirectory dir, which has a full table, to a new shard, and make dir a sharded
+// directory with a single pointer to it. returns the shard, or -1 if there's no inode or space for it
+// (dir is left as it was)
+static int dir_make_sharded(int dir) {
+	int nblocks = dir_slots(dir)/DIR_SLOTS;
+	struct disk_dirent *table = dir_read_table(dir);
+	int shard = table == NULL ? -1 : next_free_inode();
+	if (shard == -1) {
+		free(table);
+		return -1;
+	}
+	memset(&fs->inode_table[shard], 0, sizeof(struct inode));
+	fs->inode_table[shard].occupied = true;
+	fs->inode_table[shard].dir = true;
+
+	// 1. copy the names to the shard (a crash now leaves it without a directory, for fsck to free)
+	((struct dir_header *) table)->depth = 0;
+	((struct dir_header *) table)->parent = dir;
+	if (dir_write_table(shard, table, nblocks) < 0) {
+		release_inode(shard);
+		free(table);
+		return -1;
+	}
+	// 2. then point dir at it instead
+	struct disk_dirent *pointers = calloc(2, DISK_BLOCK_SIZE);
+	((struct dir_header *) pointers)->magic = DIR_SHARDS_MAGIC;
+	((int *) dir_slot(pointers, DIR_SLOTS))[0] = shard;
+	if (dir_write_table(dir, pointers, 2) < 0) {
+		free_file_blocks(shard);
+		release_inode(shard);
+		flush_inode(shard);
+		flush_fbm();
+		shard = -1;
+	}
+	free(pointers);
+	free(table);
+	return shard;
+}
+
+// move the names of table shard (old, of old_slots slots) of sharded subdirectory top whose hash has bit depth
+// set to a new shard, and point the pointers with that bit set (ptrs, 2^bits of them) at it. the new shard
+// is written first, then the pointers a block at a time, and then the old shard without the names that
+// moved, so every step leaves the names where a lookup finds them (a crash in between leaves copies in the
+// old shard, which fsck removes). returns -1 if there's no inode or space for the new shard
+static int dir_split_names(int top, int shard, struct disk_dirent *old, int old_slots, int *ptrs, int bits, int depth) {
+	int new_shard = next_free_inode();
+	if (new_shard == -1) {
+		printf("sfs: no inode to split directory inode %d\n", top);
+		return -1;
+	}
+	memset(&fs->inode_table[new_shard], 0, sizeof(struct inode));
+	fs->inode_table[new_shard].occupied = true;
+	fs->inode_table[new_shard].dir = true;
+
+	// 1. a new table for each half, sized for the names it gets
+	int moving = 0;
+	for (int k = 1; k < old_slots; k++) {
+		char name[MAXFILENAME + 1];
+		if (dir_slot(old, k)->inode > DIR_FREE) {
+			dir_name(dir_slot(old, k), name);
+			moving += shard_hash(name) >> depth & 1;
+		}
+	}
+	int high_blocks = dir_table_blocks(moving);
+	int low_blocks = dir_table_blocks(((struct dir_header *) old)->entries - moving);
+	struct disk_dirent *high = calloc(high_blocks, DISK_BLOCK_SIZE);
+	struct disk_dirent *low = calloc(low_blocks, DISK_BLOCK_SIZE);
+	struct dir_header header = { DIR_MAGIC, 0, 0, depth + 1, top };
+	memcpy(high, &header, sizeof(header));
+	memcpy(low, &header, sizeof(header));
+	for (int k = 1; k < old_slots; k++) {
+		char name[MAXFILENAME + 1];
+		if (dir_slot(old, k)->inode > DIR_FREE) {
+			dir_name(dir_slot(old, k), name);
+			if (shard_hash(name) >> depth & 1) {
+				dir_place(high, high_blocks*DIR_SLOTS, dir_slot(old, k));
+			}
+			else dir_place(low, low_blocks*DIR_SLOTS, dir_slot(old, k));
+		}
+	}
+
+	// 2. write the new shard, point its pointers at it, then drop its names from the old one
+	int res = dir_write_table(new_shard, high, high_blocks);
+	if (res < 0) {
+		release_inode(new_shard);
+	}
+	bool moved = false;
+	for (int b = 0; b*DIR_PTRS < (1 << bits) && res == 0; b++) {
+		bool changed = false;
+		for (int k = b*DIR_PTRS; k < (b + 1)*DIR_PTRS && k < (1 << bits); k++) {
+			if (ptrs[k] == shard && (k >> depth & 1)) {
+				ptrs[k] = new_shard;
+				changed = true;
+			}
+		}
+		int m = changed ? dir_write_block(top, 1 + b, (struct disk_dirent *) (ptrs + b*DIR_PTRS)) : 0;
+		res = m < 0 ? -1 : 0;
+		moved |= m > 0;
+	}
+	if (moved) {
+		dir_flush(top);
+	}
+	if (res == 0) {
+		res = dir_write_table(shard, low, low_blocks);
+	}
+	free(high);
+	free(low);
+	return res;
+}
+
+// split full table shard of subdirectory top in two (sharding top first if shard is top itself), doubling
+// top's pointers if the shard has as many bits of the hash as they do. returns -1 if the directory has
+// 2^DIR_MAX_DEPTH shards already, or there's no inode or space for another
+static int dir_split(int top, int shard) {
+	if (top == shard && (shard = dir_make_sharded(top)) == -1) {
+		return -1;
+	}
+	struct dir_header header;
+	int *ptrs = dir_read_header(top, &header) < 0 ? NULL : dir_read_pointers(top, &header);
+	struct disk_dirent *old = dir_read_table(shard);
+	int res = ptrs == NULL || old == NULL ? -1 : 0;
+
+	// the shard's depth is the number of bits its pointers share
+	int bits = header.depth;
+	int count = 0;
+	for (int k = 0; res == 0 && k < (1 << bits); k++) {
+		count += ptrs[k] == shard;
+	}
+	int depth = bits;
+	while (depth > 0 && (1 << (bits - depth)) < count) {
+		depth--;
+	}
+	if (res == 0 && depth == bits && bits == DIR_MAX_DEPTH) {
+		printf("sfs: directory inode %d has as many shards as it can\n", top);
+		res = -1;
+	}
+	else if (res == 0 && depth == bits) {
+		int nblocks = 1 + ((2 << bits) + DIR_PTRS - 1)/DIR_PTRS;
+		struct disk_dirent *table = calloc(nblocks, DISK_BLOCK_SIZE);
+		int *doubled = (int *) dir_slot(table, DIR_SLOTS);
+		header.depth = ++bits;
+		memcpy(table, &header, sizeof(header));
+		memcpy(doubled, ptrs, (1 << depth)*sizeof(int));
+		memcpy(doubled + (1 << depth), ptrs, (1 << depth)*sizeof(int));
+		res = dir_write_table(top, table, nblocks);
+		free(ptrs);
+		ptrs = malloc((nblocks - 1)*DISK_BLOCK_SIZE);
+		memcpy(ptrs, doubled, (nblocks - 1)*DISK_BLOCK_SIZE);
+		free(table);
+	}
+	if (res == 0) {
+		res = dir_split_names(top, shard, old, dir_slots(shard), ptrs, bits, depth);
+	}
+	free(ptrs);
+	free(old);
+	return res;
+}
+
+// look name up in subdirectory dir. returns its inode, or -1 if it isn't there. *slot is set to the slot
+// it's in, or else to the slot it would be added in (-1 if the directory can't be read)
+static int dir_find(int dir, const char *name, int *slot) {
+	struct disk_dirent *buf = malloc(DISK_BLOCK_SIZE);
+	int slots = dir_slots(dir);
+	int s = dir_home(name, slots);
+	int loaded = -1;
+	int inode = -1;
+
+	*slot = -1;
+	for (int n = 1; n < slots; n++, s = s + 1 < slots ? s + 1 : 1) {
+		if (s/DIR_SLOTS != loaded) {
+			loaded = s/DIR_SLOTS;
+			if (dir_read_block(dir, loaded, buf) < 0) {
+				printf("sfs: can't read directory inode %d\n", dir);
+				*slot = -1;
+				break;
+			}
+		}
+		struct disk_dirent *e = &buf[s%DIR_SLOTS];
+		if (e->inode == DIR_FREE || e->inode == DIR_REMOVED) {
+			// a name is added in the first slot it can go in, but it has to be searched for up to a free one
+			if (*slot == -1) {
+				*slot = s;
+			}
+			if (e->inode == DIR_FREE) {
+				break;
+			}
+		}
+		else if (strncmp(e->filename, name, sizeof(e->filename)) == 0 && e->inode < fs->num_inodes) {
+			*slot = s;
+			inode = e->inode;
+			break;
+		}
+	}
+	free(buf);
+	return inode;
+}
+
+// add name to table dir (a subdirectory or a shard of one) for inode, in the slot dir_find picked for it.
+// the table is rebuilt first if it's getting full, or split if it can't grow. returns the slot it went in
+// (in whichever table the name ends up in), or -1 if the directory is full or can't be read
+static int dir_add(int dir, const char *name, int inode, int slot) {
+	struct disk_dirent *head = malloc(DISK_BLOCK_SIZE);
+	struct dir_header *header = (struct dir_header *) head;
+	if (slot == -1 || dir_read_block(dir, 0, head) < 0) {
+		free(head);
+		return -1;
+	}
+	// 1. make it twice the size if DIR_LOAD of it would be in use, or only drop the removed names if
+	// that leaves it less than half as full. if it's as large as it gets, split it and add the name to
+	// whichever half it belongs in
+	int nblocks = dir_slots(dir)/DIR_SLOTS;
+	if (header->used + 1 > DIR_LOAD*nblocks*DIR_SLOTS) {
+		if (header->entries + 1 > DIR_LOAD*nblocks*DIR_SLOTS/2) {
+			nblocks = 2*nblocks < DIR_MAX_BLOCKS ? 2*nblocks : DIR_MAX_BLOCKS;
+		}
+		if (header->entries + 1 > DIR_LOAD*nblocks*DIR_SLOTS) {
+			int top = header->parent != 0 ? header->parent : dir;
+			int shard = -1;
+			free(head);
+			if (dir_split(top, dir) < 0 || (shard = dir_pick(top, name)) == -1 || dir_find(shard, name, &slot) != -1) {
+				return -1;
+			}
+			return dir_add(shard, name, inode, slot);
+		}
+		if (dir_rebuild(dir, nblocks) < 0
+				|| dir_find(dir, name, &slot) != -1 || slot == -1 || dir_read_block(dir, 0, head) < 0) {
+			free(head);
+			return -1;
+		}
+	}
+
+	// 2. fill in the slot and count it in the header (written together if they're in the same block)
+	struct disk_dirent *buf = slot < DIR_SLOTS ? head : malloc(DISK_BLOCK_SIZE);
+	if (buf != head && dir_read_block(dir, slot/DIR_SLOTS, buf) < 0) {
+		free(buf);
+		free(head);
+		return -1;
+	}
+	struct disk_dirent *e = &buf[slot%DIR_SLOTS];
+	header->used += e->inode == DIR_FREE;
+	header->entries++;
+	strncpy(e->filename, name, sizeof(e->filename));
+	e->inode = inode;
+	int moved = dir_write_block(dir, slot/DIR_SLOTS, buf);
+	int head_moved = buf != head && moved >= 0 ? dir_write_block(dir, 0, head) : 0;
+	if (buf != head) {
+		free(buf);
+	}
+	if (moved > 0 || head_moved > 0) {
+		dir_flush(dir);
+	}
+	free(head);
+	return moved < 0 ? -1 : slot;
+}
+
+// remove the name in slot of subdirectory dir. the slot is only marked DIR_REMOVED if a search could go on
+// past it (the next slot is in use). returns -1 if the directory can't be read
+static int dir_remove(int dir, int slot) {
+	struct disk_dirent *head = malloc(DISK_BLOCK_SIZE);
+	struct dir_header *header = (struct dir_header *) head;
+	struct disk_dirent *buf = slot < DIR_SLOTS ? head : malloc(DISK_BLOCK_SIZE);
+	if (dir_read_block(dir, 0, head) < 0 || (buf != head && dir_read_block(dir, slot/DIR_SLOTS, buf) < 0)) {
+		if (buf != head) {
+			free(buf);
+		}
+		free(head);
+		return -1;
+	}
+	struct disk_dirent *e = &buf[slot%DIR_SLOTS];
+	int next = slot + 1 < dir_slots(dir) ? slot + 1 : 1;
+	memset(e->filename, 0, sizeof(e->filename));
+	if (next/DIR_SLOTS == slot/DIR_SLOTS && buf[next%DIR_SLOTS].inode == DIR_FREE) {
+		e->inode = DIR_FREE;
+		header->used--;
+	}
+	else e->inode = DIR_REMOVED;
+	header->entries--;
+	int moved = dir_write_block(dir, slot/DIR_SLOTS, buf);
+	int head_moved = buf != head && moved >= 0 ? dir_write_block(dir, 0, head) : 0;
+	if (buf != head) {
+		free(buf);
+	}
+	if (moved > 0 || head_moved > 0) {
+		dir_flush(dir);
+	}
+	free(head);
+	return moved < 0 ? -1 : 0;
+}
+
+// number of names in subdirectory dir (in all its shards), or -1 if it can't be read
+static int dir_entries(int dir) {
+	struct dir_header header;
+	if (dir_read_header(dir, &header) < 0) {
+		return -1;
+	}
+	if (header.magic != DIR_SHARDS_MAGIC) {
+		return header.entries;
+	}
+	int *ptrs = dir_read_pointers(dir, &header);
+	int entries = ptrs == NULL ? -1 : 0;
+	for (int k = 0; entries >= 0 && k < (1 << header.depth); k++) {
+		struct dir_header shard;
+		if (dir_first_pointer(ptrs, k)) {
+			entries = dir_read_header(ptrs[k], &shard) < 0 ? -1 : entries + shard.entries;
+		}
+	}
+	free(ptrs);
+	return entries;
+}
+
+// free the shards of sharded subdirectory dir, which is being removed (they're empty). returns -1 if its
+// pointers can't be read
+static int dir_free_shards(int dir) {
+	struct dir_header header;
+	if (dir_read_header(dir, &header) < 0) {
+		return -1;
+	}
+	if (header.magic != DIR_SHARDS_MAGIC) {
+		return 0;
+	}
+	int *ptrs = dir_read_pointers(dir, &header);
+	if (ptrs == NULL) {
+		return -1;
+	}
+	for (int k = 0; k < (1 << header.depth); k++) {
+		int shard = ptrs[k];
+		if (dir_first_pointer(ptrs, k) && shard > ROOT_INODE && shard < fs->num_inodes && fs->inode_table[shard].dir) {
+			free_file_blocks(shard);
+			release_inode(shard);
+			flush_inode(shard);
+		}
+	}
+	free(ptrs);
+	return 0;
+}
+
+// fill entries with up to max names of subdirectory dir from *pos onwards, and move *pos past them: the
+// slot of a table, or of a sharded directory pointer*DIR_SHARD_POS + the slot of its shard. returns the number
+// of entries filled (0 = end of the directory, -1 = it can't be read)
+static int dir_list(int dir, int *pos, struct sfs_dirent *entries, int max) {
+	struct dir_header header;
+	if (dir_read_header(dir, &header) < 0) {
+		return -1;
+	}
+	if (header.magic == DIR_SHARDS_MAGIC) {
+		// each shard is listed at its first pointer
+		int *ptrs = dir_read_pointers(dir, &header);
+		int n = ptrs == NULL ? -1 : 0;
+		while (n >= 0 && n < max && *pos/DIR_SHARD_POS < (1 << header.depth)) {
+			int k = *pos/DIR_SHARD_POS;
+			int slot = *pos%DIR_SHARD_POS;
+			int filled = dir_first_pointer(ptrs, k) ? dir_list(ptrs[k], &slot, entries + n, max - n) : 0;
+			if (filled < 0) {
+				n = -1;
+				break;
+			}
+			*pos = filled < max - n ? (k + 1)*DIR_SHARD_POS : k*DIR_SHARD_POS + slot;
+			n += filled;
+		}
+		free(ptrs);
+		return n;
+	}
+
+	struct disk_dirent *buf = malloc(DISK_BLOCK_SIZE);
+	int slots = dir_slots(dir);
+	int loaded = -1;
+	int n = 0;
+
+	if (*pos < 1) {
+		*pos = 1;
+	}
+	for (; *pos < slots && n < max; (*pos)++) {
+		if (*pos/DIR_SLOTS != loaded) {
+			loaded = *pos/DIR_SLOTS;
+			if (dir_read_block(dir, loaded, buf) < 0) {
+				n = -1;
+				break;
+			}
+		}
+		struct disk_dirent *e = &buf[*pos%DIR_SLOTS];
+		if (e->inode <= DIR_FREE || e->inode >= fs->num_inodes) {
+			continue;
+		}
+		dir_name(e, entries[n].name);
+		entries[n].inode = e->inode;
+		entries[n].size = fs->inode_table[e->inode].filesize;
+		entries[n].dir = fs->inode_table[e->inode].dir;
+		n++;
+	}
+	free(buf);
+	return n;
+}
+
+// look name up in directory dir (the root directory or a subdirectory). returns its inode, or -1 if it
+// isn't there, and sets *where to its directory entry or slot (in a subdirectory, also to the slot it
+// would be added in if it isn't there)
+static int lookup(int dir, const char *name, int *where) {
+	if (dir != ROOT_INODE) {
+		return dir_find(dir, name, where);
+	}
+	*where = find_file(name);
+	return *where == -1 ? -1 : fs->directory[*where].inode;
+}
+
+// find the directory path is in, and the last name in it. a path is the names of the directories on the
+// way and then the file's, separated by '/'. a leading '/' is ignored (so FUSE's paths can be used as they
+// are), and a path of only a name is in the root directory. returns the directory's inode (the shard the
+// name goes in, if it's sharded) and copies the last name to name ("" if the path is the root directory),
+// or returns -1 if a directory on the way doesn't exist, or -2 if a name is too long
+static int resolve(const char *path, char *name) {
+	int dir = ROOT_INODE;
+	int where;
+	name[0] = '\0';
+	while (*path != '\0') {
+		int len = strcspn(path, "/");
+		if (len > MAXFILENAME) {
+			return -2;
+		}
+		if (len > 0) {
+			if (name[0] != '\0') {
+				dir = dir_pick(dir, name);
+				dir = dir == -1 ? -1 : lookup(dir, name, &where);
+				if (dir == -1 || !fs->inode_table[dir].dir) {
+					return -1;
+				}
+			}
+			memcpy(name, path, len);
+			name[len] = '\0';
+		}
+		path += len;
+		if (*path == '/') {
+			path++;
+		}
+	}
+	return name[0] != '\0' ? dir_pick(dir, name) : dir;
+}
+
+// add name to directory dir for inode. where is what lookup set it to when it didn't find the name. the
+// entry is written to disk. returns the directory entry or slot it went in, or -1 if the directory is full
+static int add_name(int dir, const char *name, int inode, int where) {
+	if (dir != ROOT_INODE) {
+		return dir_add(dir, name, inode, where);
+	}
+	int entry = next_free_entry();
+	if (entry == -1) {
+		return -1;
+	}
+	strcpy(fs->directory[entry].filename, name);
+	fs->directory[entry].inode = inode;
+	fs->directory[entry].occupied = true;
+	name_index_add(entry);
+	flush_dir_entry(entry);
+	return entry;
+}
+
+// remove the name lookup found in directory dir at where, and write the directory entry to disk
+static void remove_name(int dir, int where) {
+	if (dir != ROOT_INODE) {
+		dir_remove(dir, where);
+		return;
+	}
+	fs->directory[where].occupied = false;
+	name_index_remove(where);
+	if (where < fs->entry_hint) {
+		fs->entry_hint = where;
+	}
+	flush_dir_entry(where);
+}
+
+int sfs_fopen_r(sfs_t *sfs, char *fname) {
+	fs = sfs;
+	COUNT_OP(SFS_OP_FOPEN, -1);
+	char name[MAXFILENAME + 1];
+	int where;
+
+	// first find the directory the file is in, and check if file name is too long
+	int dir = resolve(fname, name);
+	if (dir == -2) {
+		printf("sfs_fopen error: file name %s is too long\n", fname);
+		return -1;
+	}
+	if (dir == -1 || name[0] == '\0') {
+		printf("sfs_fopen error: no directory for file %s\n", fname);
+		return -1;
+	}
+	// 1. search directory for file
+	int f_inode = lookup(dir, name, &where);
+	int fd = -1;
+	if (f_inode != -1 && fs->inode_table[f_inode].dir) {
+		printf("sfs_fopen error: %s is a directory\n", fname);
+		return -1;
+	}
+
+	// 2. if file is found, check if file is already opened (if it is, return its fd)
+	if (f_inode != -1) {
+		for (int j = 0; j < fs->fdt_size; j++) {
+			if (fs->fdt[j].inode == f_inode && fs->fdt[j].open) {
+				fd = j;
+				break;
+			}
+		}
+		// if file is not opened, find next empty slot in fdt and add file to it
+		if (fd == -1) {
+			fd = alloc_fd();
+			fs->fdt[fd].inode = f_inode;
+			fs->fdt[fd].fp = fs->inode_table[f_inode].filesize;
+			fs->fdt[fd].open = true;
+		}
+	}
+
+	// 3. if file is not found, create a new file and add it to fdt
+	if (f_inode == -1) {
+		// find next available slot in inode table and create inode for new file
+		f_inode = next_free_inode();
+		// if no available slot was found in inode table, print error
+		if (f_inode == -1) {
+			printf("sfs_fopen error: failed to create file %s, inode table is full.\n", fname);
+			return -1;
+		}
+		memset(&fs->inode_table[f_inode], 0, sizeof(struct inode)); // clear pointers left over from a removed file
+		fs->inode_table[f_inode].occupied = true;
+		fs->inode_table[f_inode].compressed = fs->compress_new_files;
+		fs->inode_table[f_inode].inlined = true;
+		fs->inode_table[f_inode].filesize = 0;
+
+		// create directory entry (written to disk). if there's no room in the directory, print error
+		if (add_name(dir, name, f_inode, where) == -1) {
+			release_inode(f_inode);
+			printf("sfs_fopen error: failed to create file %s, directory table is full.\n", fname);
+			return -1;
+		}
+
+		// add file to fdt
+		fd = alloc_fd();
+		fs->fdt[fd].inode = f_inode;
+		fs->fdt[fd].fp = 0;
+		fs->fdt[fd].open = true;
+
+		// update disk (inode)
+		flush_inode(f_inode); // write inode to disk
+		flush_tables();
+	}
+	// recorded once the fd is known, so a replay can tell which file the fd of later calls is
+	trace(TRACE_FOPEN, fname, fd, 0, 0, 0);
+	return fd;
+}
+
+int sfs_fclose_r(sfs_t *sfs, int fileID) {
+	fs = sfs;
+	trace(TRACE_FCLOSE, NULL, fileID, 0, 0, 0);
+	COUNT_OP(SFS_OP_FCLOSE, -1);
+	if (!fd_is_open(fileID)) {
+		printf("sfs_fclose: file id %d is not open\n", fileID);
+		return -1;
+	}
+	fs->fdt[fileID].open = false;
+	release_window(fileID);
+	return 0;
+}
+
+int sfs_remove_r(sfs_t *sfs, char* fname) {
+	fs = sfs;
+	trace(TRACE_REMOVE, fname, 0, 0, 0, 0);
+	COUNT_OP(SFS_OP_REMOVE, -1);
+	char name[MAXFILENAME + 1];
+	int where;
+	
+	// 1. search for file in its directory
+	int dir = resolve(fname, name);
+	int inode = dir < 0 || name[0] == '\0' ? -1 : lookup(dir, name, &where);
+	if (inode == -1) {
+		printf("sfs_remove error: file %s not found.\n", fname);
+		return -1;
+	}
+	if (fs->inode_table[inode].dir) {
+		printf("sfs_remove error: %s is a directory.\n", fname);
+		return -1;
+	}
+	// if file is found in dir then make sure it is closed before removing it
+	for (int j = 0; j < fs->fdt_size; j++) {
+		if (fs->fdt[j].inode == inode && fs->fdt[j].open) {
+			printf("sfs_remove error: file %s is still open.\n", fname);
+			return -1;
+		}
+	}
+
+	// 2. free the data blocks associated to file in fbm
+	if (free_file_blocks(inode) < 0) {
+		return -1;
+	}
+
+	// 3. remove the directory entry (so that entry slot can be reused) and the inode
+	remove_name(dir, where);
+	release_inode(inode);
+
+	// update disk (fbm + inode)
+	flush_fbm(); // write fbm to disk
+	flush_inode(inode); // write inode to disk
+	flush_tables();
+	return 0;
+}
+
+// write length zeros to open file fd at offset. returns -1 if they can't all be written
+static int write_zeros(int fd, int offset, int length) {
+	if (length <= 0) {
+		return 0;
+	}
+	char *zeros = calloc(1, length);
+	int res = sfs_pwrite_r(fs, fd, zeros, length, offset) == length ? 0 : -1;
+	free(zeros);
+	return res;
+}
+
+int sfs_truncate_r(sfs_t *sfs, char *fname, int size) {
+	fs = sfs;
+	trace(TRACE_TRUNCATE, fname, size, 0, 0, 0);
+	COUNT_OP(SFS_OP_FWRITE, -1);
+	char name[MAXFILENAME + 1];
+	int where;
+	int res = 0;
+
+	// 1. search for file in its directory
+	int dir = resolve(fname, name);
+	int inode = dir < 0 || name[0] == '\0' ? -1 : lookup(dir, name, &where);
+	if (inode == -1 || fs->inode_table[inode].dir) {
+		printf("sfs_truncate error: file %s not found.\n", fname);
+		return -1;
+	}
+	if (size < 0 || size > 268*DISK_BLOCK_SIZE) {
+		printf("sfs_truncate error: can't make file %s %d bytes long.\n", fname, size);
+		return -1;
+	}
+	struct inode *node = &fs->inode_table[inode];
+
+	// 2. an inline file only needs the bytes after the end cleared, so growing it again reads zeros
+	if (node->inlined && size <= INLINE_BYTES) {
+		if (size < node->filesize) {
+			memset(node->inline_data + size, 0, INLINE_BYTES - size);
+		}
+		node->filesize = size;
+	}
+	else {
+		// 3. any other file is written through one of its fds (a new one if it isn't open), so clones,
+		// deduplicated, compressed and log-structured blocks are copied on write as they are for sfs_fwrite
+		int fd = -1;
+		for (int j = 0; j < fs->fdt_size && fd == -1; j++) {
+			if (fs->fdt[j].inode == inode && fs->fdt[j].open) {
+				fd = j;
+			}
+		}
+		bool opened = fd == -1;
+		if (opened) {
+			fd = alloc_fd();
+			memset(&fs->fdt[fd], 0, sizeof(struct opened_file));
+			fs->fdt[fd].inode = inode;
+			fs->fdt[fd].open = true;
+		}
+		int fp = fs->fdt[fd].fp;
+		trace_nested++;
+		if (size > node->filesize) {
+			res = write_zeros(fd, node->filesize, size - node->filesize);
+		}
+		else {
+			// zero the rest of the last block (or cluster) that's kept, then free the ones after it
+			int unit = node->compressed ? CLUSTER_SIZE : DISK_BLOCK_SIZE;
+			int end = (size + unit - 1)/unit*unit < node->filesize ? (size + unit - 1)/unit*unit : node->filesize;
+			int numPtrs = blocks_for(node->filesize);
+			int keep = blocks_for(end);
+			int *index_block = NULL;
+			res = write_zeros(fd, size, end - size);
+			if (res == 0 && numPtrs > 12 && (index_block = get_index_block(inode)) == NULL) {
+				res = -1;
+			}
+			for (int j = keep; j < numPtrs && res == 0; j++) {
+				if (get_block_ptr(inode, j, index_block) != 0) { // compressed clusters leave pointers unused
+					release_block(get_block_ptr(inode, j, index_block));
+				}
+				set_block_ptr(inode, j, index_block, 0);
+			}
+			if (res == 0 && keep <= 12 && node->indirect_ptr != 0) {
+				set_free(data_index(node->indirect_ptr));
+				node->indirect_ptr = 0;
+				forget_index_block(inode);
+			}
+			else if (res == 0 && numPtrs > 12) {
+				write_index_block(inode, index_block);
+			}
+			if (res == 0) {
+				node->filesize = size;
+			}
+		}
+		trace_nested--;
+		fs->fdt[fd].fp = fp;
+		if (opened) {
+			fs->fdt[fd].open = false;
+			release_window(fd);
+		}
+	}
+
+	// 4. an fd past the end is moved back to it, so a write there doesn't leave unwritten blocks before it
+	for (int j = 0; j < fs->fdt_size; j++) {
+		if (fs->fdt[j].inode == inode && fs->fdt[j].open && fs->fdt[j].fp > node->filesize) {
+			fs->fdt[j].fp = node->filesize;
+		}
+	}
+
+	// update disk (fbm + inode)
+	flush_fbm();
+	flush_inode(inode);
+	flush_tables();
+	return res;
+}
+
+int sfs_mkdir_r(sfs_t *sfs, char *path) {
+	fs = sfs;
+	trace(TRACE_MKDIR, path, 0, 0, 0, 0);
+	COUNT_OP(SFS_OP_MKDIR, -1);
+	char name[MAXFILENAME + 1];
+	int where;
+
+	// 1. find the directory it goes in, and make sure the name isn't taken
+	int dir = resolve(path, name);
+	if (dir < 0 || name[0] == '\0') {
+		printf("sfs_mkdir error: no directory for %s, or its name is too long.\n", path);
+		return -1;
+	}
+	if (lookup(dir, name, &where) != -1) {
+		printf("sfs_mkdir error: %s already exists.\n", path);
+		return -1;
+	}
+
+	// 2. make an empty table of one block for it
+	int inode = next_free_inode();
+	if (inode == -1) {
+		printf("sfs_mkdir error: failed to create %s, inode table is full.\n", path);
+		return -1;
+	}
+	memset(&fs->inode_table[inode], 0, sizeof(struct inode));
+	fs->inode_table[inode].occupied = true;
+	fs->inode_table[inode].dir = true;
+	struct disk_dirent *block = calloc(1, DISK_BLOCK_SIZE);
+	((struct dir_header *) block)->magic = DIR_MAGIC;
+	if (dir_write_table(inode, block, 1) < 0) {
+		printf("sfs_mkdir error: no space for %s.\n", path);
+		release_inode(inode);
+		free(block);
+		return -1;
+	}
+	free(block);
+
+	// 3. add it to its directory
+	if (add_name(dir, name, inode, where) == -1) {
+		printf("sfs_mkdir error: failed to create %s, directory table is full.\n", path);
+		free_file_blocks(inode);
+		release_inode(inode);
+		return -1;
+	}
+
+	// update disk (fbm + inode)
+	flush_fbm();
+	flush_inode(inode);
+	flush_tables();
+	return 0;
+}
+
+int sfs_rmdir_r(sfs_t *sfs, char *path) {
+	fs = sfs;
+	trace(TRACE_RMDIR, path, 0, 0, 0, 0);
+	COUNT_OP(SFS_OP_MKDIR, -1);
+	char name[MAXFILENAME + 1];
+	int where;
+
+	// 1. find the directory, which has to be empty
+	int dir = resolve(path, name);
+	int inode = dir < 0 || name[0] == '\0' ? -1 : lookup(dir, name, &where);
+	if (inode == -1 || !fs->inode_table[inode].dir) {
+		printf("sfs_rmdir error: directory %s not found.\n", path);
+		return -1;
+	}
+	if (dir_entries(inode) != 0) {
+		printf("sfs_rmdir error: directory %s is not empty.\n", path);
+		return -1;
+	}
+
+	// 2. free its blocks (and shards), its entry and its inode
+	if (dir_free_shards(inode) < 0 || free_file_blocks(inode) < 0) {
+		return -1;
+	}
+	remove_name(dir, where);
+	release_inode(inode);
+
+	// update disk (fbm + inode)
+	flush_fbm();
+	flush_inode(inode);
+	flush_tables();
+	return 0;
+}
+
+int sfs_clone_r(sfs_t *sfs, char *src, char *dst) {
+	fs = sfs;
+	if (trace_file != NULL) {
+		int len = strlen(src) + 1 + strlen(dst);
+		char *names = malloc(len + 1);
+		sprintf(names, "%s%c%s", src, 0, dst);
+		trace_names(TRACE_CLONE, names, len, 0, 0, 0, 0);
+		free(names);
+	}
+	COUNT_OP(SFS_OP_CLONE, -1);
+	char src_name[MAXFILENAME + 1];
+	char name[MAXFILENAME + 1];
+	int where;
+
+	// first find the directory of the clone, and check if file name is too long
+	int dst_dir = resolve(dst, name);
+	if (dst_dir == -2) {
+		printf("sfs_clone error: file name %s is too long\n", dst);
+		return -1;
+	}
+	// 1. find source file and make sure the clone's name isn't taken
+	int src_dir = resolve(src, src_name);
+	int src_inode = src_dir < 0 || src_name[0] == '\0' ? -1 : lookup(src_dir, src_name, &where);
+	if (src_inode == -1 || fs->inode_table[src_inode].dir) {
+		printf("sfs_clone error: file %s not found.\n", src);
+		return -1;
+	}
+	if (dst_dir == -1 || name[0] == '\0' || lookup(dst_dir, name, &where) != -1) {
+		printf("sfs_clone error: file %s already exists.\n", dst);
+		return -1;
+	}
+	int numPtrs = (int) ceil((double) fs->inode_table[src_inode].filesize/DISK_BLOCK_SIZE); // get number of blocks the file uses
+	int *index_block = NULL;
+
+	if (numPtrs > 12 && (index_block = get_index_block(src_inode)) == NULL) {
+		return -1;
+	}
+	// a block can only be shared by 256 files
+	for (int i = 0; i < numPtrs; i++) {
+		int block_num = get_block_ptr(src_inode, i, index_block);
+		if (block_num != 0 && fs->block_refs[data_index(block_num)] == 255) {
+			printf("sfs_clone error: too many clones of file %s.\n", src);
+			return -1;
+		}
+	}
+
+	// 2. the clone gets its own index block, since that block's pointers change on copy-on-write. it's
+	// allocated before the clone is added to its directory, which may split it, so nothing has to be undone
+	int clone_index = 0;
+	if (fs->inode_table[src_inode].indirect_ptr != 0) {
+		clone_index = alloc_block(fs->inode_table[src_inode].indirect_ptr, -1);
+		if (clone_index == -1) {
+			printf("sfs_clone error: no space to allocate to index block\n");
+			return -1;
+		}
+	}
+
+	// 3. find a free slot in inode table and add the clone to its directory
+	int f_inode = next_free_inode();
+	int entry = -1;
+	if (f_inode != -1) {
+		fs->inode_table[f_inode].occupied = true; // so a split doesn't take the inode for a shard
+		entry = add_name(dst_dir, name, f_inode, where);
+	}
+	if (f_inode == -1 || entry == -1) {
+		printf("sfs_clone error: failed to create file %s, file system is full.\n", dst);
+		if (f_inode != -1) {
+			release_inode(f_inode);
+		}
+		if (clone_index != 0) {
+			set_free(data_index(clone_index));
+		}
+		return -1;
+	}
+	if (clone_index != 0) {
+		forget_index_block(f_inode);
+		fs->index_cache[f_inode] = calloc(1, DISK_BLOCK_SIZE);
+		if (numPtrs > 12) {
+			memcpy(fs->index_cache[f_inode], index_block, DISK_BLOCK_SIZE);
+		}
+		write_disk(clone_index, 1, fs->index_cache[f_inode]);
+	}
+
+	// 4. copy the inode and share every data block with the source
+	fs->inode_table[f_inode] = fs->inode_table[src_inode];
+	fs->inode_table[f_inode].indirect_ptr = clone_index;
+	for (int i = 0; i < numPtrs; i++) {
+		int block_num = get_block_ptr(src_inode, i, index_block);
+		if (block_num != 0) {
+			fs->block_refs[data_index(block_num)]++;
+			fs->refs_dirty = true;
+		}
+	}
+
+	// update disk (fbm + refs + inode), no data blocks are copied. the directory entry is written already
+	flush_fbm();
+	flush_inode(f_inode);
+	flush_tables();
+	return 0;
+}
+
+// find n free data blocks in a row that aren't reserved for an open file, searching from fbm index start
+// to the end of the disk and then from the beginning. with block groups, a run can't go past the end of a
+// group's data blocks. returns the fbm index of the first block, or -1 if there's no such run
+static int find_free_run(int start, int n) {
+	int run_len = 0;
+	for (int k = 0; k < fs->num_data_blocks; k++) {
+		int i = (start + k) % fs->num_data_blocks;
+		if (i == 0 || (fs->groups && i % GROUP_DATA_BLOCKS == 0)) {
+			run_len = 0;
+		}
+		if (fs->free_bit_map[i] == '1' && fs->resv_map[i] == 0) {
+			if (++run_len == n) {
+				return i - n + 1;
+			}
+		}
+		else run_len = 0;
+	}
+	return -1;
+}
+
+// move a file's data blocks into one contiguous run of free blocks. returns the number of blocks moved
+static int defrag_file(int inode) {
+	int numPtrs = (int) ceil((double) fs->inode_table[inode].filesize/DISK_BLOCK_SIZE); // get number of blocks the file uses
+	int *index_block = NULL;
+	bool contiguous = true;
+
+	// compressed clusters are already written into contiguous blocks
+	if (numPtrs < 2 || fs->inode_table[inode].compressed) {
+		return 0;
+	}
+	if (numPtrs > 12 && (index_block = get_index_block(inode)) == NULL) {
+		return 0;
+	}
+
+	// 1. check if the file is fragmented. files sharing blocks with a clone are left alone,
+	// since moving a shared block would un-share it
+	for (int i = 0; i < numPtrs; i++) {
+		int block_num = get_block_ptr(inode, i, index_block);
+		if (fs->block_refs[data_index(block_num)] > 0) {
+			return 0;
+		}
+		if (i > 0 && block_num != get_block_ptr(inode, i - 1, index_block) + 1) {
+			contiguous = false;
+		}
+	}
+	if (contiguous) {
+		return 0;
+	}
+
+	// 2. find the first free run that holds the whole file from the file's goal onwards (in its inode's
+	// block group, if the disk has them)
+	int run_start = find_free_run(data_index(first_goal(inode)), numPtrs);
+	if (run_start == -1) {
+		return 0;
+	}
+
+	// 3. read the file a run of blocks at a time and write it back out with a single write. a block that
+	// can't be read (or fails its checksum) leaves the file where it is, so a bad block isn't copied with
+	// a good checksum and the original freed (sfs_scrub would no longer find it)
+	char *file_buf = malloc(numPtrs*DISK_BLOCK_SIZE);
+	bool ok = file_buf != NULL;
+	for (int i = 0; i < numPtrs && ok; ) {
+		int first = get_block_ptr(inode, i, index_block);
+		int n = 1;
+		while (i + n < numPtrs && get_block_ptr(inode, i + n, index_block) == first + n) {
+			n++;
+		}
+		ok = read_disk(first, n, file_buf + i*DISK_BLOCK_SIZE) >= 0;
+		i += n;
+	}
+	ok = ok && write_disk(data_block_num(run_start), numPtrs, file_buf) >= 0;
+	free(file_buf);
+	if (!ok) {
+		printf("sfs_defrag error: can't move inode %d, it's left where it is.\n", inode);
+		return 0;
+	}
+
+	// 4. point the inode at the new run and free the old blocks
+	load_hashes();
+	for (int i = 0; i < numPtrs; i++) {
+		int old_block = data_index(get_block_ptr(inode, i, index_block));
+		if (fs->block_hash[old_block] != 0) {
+			set_hash(run_start + i, fs->block_hash[old_block]);
+			forget_hash(old_block);
+		}
+		set_free(old_block);
+		set_used(run_start + i);
+		set_block_ptr(inode, i, index_block, data_block_num(run_start + i));
+	}
+	if (numPtrs > 12) {
+		write_disk(fs->inode_table[inode].indirect_ptr, 1, index_block);
+	}
+	return numPtrs;
+}
+
+int sfs_defrag_r(sfs_t *sfs, char *fname) {
+	fs = sfs;
+	trace(TRACE_DEFRAG, fname, 0, 0, 0, 0);
+	COUNT_OP(SFS_OP_DEFRAG, -1);
+	int moved = 0;
+
+	// a log-structured disk only moves blocks with the cleaner
+	if (fs->log_mode) {
+		return 0;
+	}
+
+	// defragment the named file, or every file (and subdirectory) if no name is given
+	if (fname != NULL) {
+		char name[MAXFILENAME + 1];
+		int where;
+		int dir = resolve(fname, name);
+		int inode = dir < 0 || name[0] == '\0' ? -1 : lookup(dir, name, &where);
+		if (inode == -1) {
+			printf("sfs_defrag error: file %s not found.\n", fname);
+			return -1;
+		}
+		moved = defrag_file(inode);
+	}
+	else {
+		for (int i = ROOT_INODE + 1; i < fs->num_inodes; i++) {
+			if (fs->inode_table[i].occupied) {
+				moved += defrag_file(i);
+			}
+		}
+	}
+
+	// update disk (inode + fbm)
+	if (moved > 0) {
+		flush_inode_table();
+		flush_fbm();
+		flush_tables();
+	}
+	return moved;
+}
+
+// write the contents of a new, empty file for sfs_import. its data blocks are one run of free blocks if
+// there is one (starting where sfs_fwrite would put the file), so the data goes out with one write plus one
+// for a partial last block. the inode is left for the caller to write. returns -1 if the disk is full
+static int import_file(int inode, const char *data, int size) {
+	struct inode *node = &fs->inode_table[inode];
+	if (size <= INLINE_BYTES) {
+		memcpy(node->inline_data, data, size);
+		node->filesize = size;
+		count_bytes(size);
+		return 0;
+	}
+	int numPtrs = blocks_for(size);
+	int *index_block = numPtrs > 12 ? get_index_block(inode) : NULL;
+	int run_start = find_free_run(data_index(first_goal(inode)), numPtrs);
+	int goal = first_goal(inode);
+
+	// 1. allocate the blocks: the run, or else one at a time like sfs_fwrite. the index block goes after them
+	node->inlined = false;
+	for (int i = 0; i <= numPtrs && (i < numPtrs || numPtrs > 12); i++) {
+		int block_num;
+		if (run_start != -1 && i < numPtrs) {
+			block_num = data_block_num(run_start + i);
+			set_used(run_start + i);
+			fs->block_refs[run_start + i] = 0;
+			count_blocks(1);
+		}
+		else block_num = alloc_block(goal, -1);
+		if (block_num == -1) {
+			// give back what was allocated
+			for (int j = 0; j < i && j < numPtrs; j++) {
+				set_free(data_index(get_block_ptr(inode, j, index_block)));
+				set_block_ptr(inode, j, index_block, 0);
+			}
+			node->inlined = true;
+			return -1;
+		}
+		if (i < numPtrs) {
+			set_block_ptr(inode, i, index_block, block_num);
+		}
+		else node->indirect_ptr = block_num;
+		goal = block_num + 1;
+	}
+
+	// 2. write the whole blocks, a run of consecutive blocks at a time, then the partial last block
+	int whole = size/DISK_BLOCK_SIZE;
+	for (int i = 0; i < whole; ) {
+		int first = get_block_ptr(inode, i, index_block);
+		int n = 1;
+		while (i + n < whole && get_block_ptr(inode, i + n, index_block) == first + n) {
+			n++;
+		}
+		write_disk(first, n, (char *) data + i*DISK_BLOCK_SIZE);
+		i += n;
+	}
+	if (whole < numPtrs) {
+		char *last = calloc(1, DISK_BLOCK_SIZE);
+		memcpy(last, data + whole*DISK_BLOCK_SIZE, size - whole*DISK_BLOCK_SIZE);
+		write_disk(get_block_ptr(inode, whole, index_block), 1, last);
+		free(last);
+	}
+	if (numPtrs > 12) {
+		write_disk(node->indirect_ptr, 1, index_block);
+		count_meta(1);
+	}
+	node->filesize = size;
+	count_bytes(size);
+	return 0;
+}
+
+// create new files with the given contents. the inode table and directory blocks of the whole batch, the
+// fbm and the other tables are written once at the end, after the data
+int sfs_import_r(sfs_t *sfs, const struct sfs_import *files, int n) {
+	fs = sfs;
+	trace(TRACE_IMPORT, NULL, n, 0, 0, 0);
+	for (int f = 0; f < n; f++) {
+		trace(TRACE_IMPORT_FILE, files[f].name, files[f].size, 0, 0, 0);
+	}
+	COUNT_OP(SFS_OP_IMPORT, -1);
+	int imported = 0;
+	int first_inode = fs->num_inodes, last_inode = -1;
+	int first_entry = fs->num_files, last_entry = -1;
+
+	for (int f = 0; f < n; f++) {
+		char name[MAXFILENAME + 1];
+		int where;
+		int dir = resolve(files[f].name, name);
+		if (dir < 0 || name[0] == '\0' || lookup(dir, name, &where) != -1 || files[f].size < 0
+				|| files[f].size > 268*DISK_BLOCK_SIZE) {
+			printf("sfs_import error: can't import %s, it exists already or its name or size is too large.\n", files[f].name);
+			continue;
+		}
+		// modes that change how blocks are written go through sfs_fwrite, which writes the metadata itself,
+		// and so do files in subdirectories, whose entries sfs_fopen adds
+		if (fs->log_mode || fs->dedup_enabled || fs->compress_new_files || dir != ROOT_INODE) {
+			trace_nested++;
+			int fd = sfs_fopen_r(sfs, (char *) files[f].name);
+			if (fd >= 0 && (files[f].size == 0 || sfs_fwrite_r(sfs, fd, files[f].data, files[f].size) == files[f].size)) {
+				count_bytes(files[f].size);
+				imported++;
+			}
+			if (fd >= 0) {
+				sfs_fclose_r(sfs, fd);
+			}
+			trace_nested--;
+			continue;
+		}
+
+		// 1. take a free inode and directory entry
+		int inode = next_free_inode();
+		int entry = next_free_entry();
+		if (inode == -1 || entry == -1) {
+			printf("sfs_import error: failed to create file %s, the disk has no room for more files.\n", name);
+			break;
+		}
+		memset(&fs->inode_table[inode], 0, sizeof(struct inode));
+		fs->inode_table[inode].occupied = true;
+		fs->inode_table[inode].inlined = true;
+
+		// 2. write its data
+		if (import_file(inode, files[f].data, files[f].size) < 0) {
+			printf("sfs_import error: no space for %s.\n", name);
+			release_inode(inode);
+			continue;
+		}
+		strcpy(fs->directory[entry].filename, name);
+		fs->directory[entry].inode = inode;
+		fs->directory[entry].occupied = true;
+		name_index_add(entry);
+		first_inode = inode < first_inode ? inode : first_inode;
+		last_inode = inode > last_inode ? inode : last_inode;
+		first_entry = entry < first_entry ? entry : first_entry;
+		last_entry = entry > last_entry ? entry : last_entry;
+		imported++;
+	}
+
+	// 3. write the metadata of the batch
+	if (last_inode >= 0) {
+		for (int i = first_inode; i <= last_inode; i++) {
+			pack_inode(i);
+		}
+		write_table_bytes(0, fs->disk_inodes, (long long) first_inode*sizeof(struct disk_inode),
+				(long long) (last_inode + 1)*sizeof(struct disk_inode));
+		for (int i = first_entry; i <= last_entry; i++) {
+			pack_dir_entry(i);
+		}
+		write_table_bytes(fs->inode_blocks, fs->disk_dir, (long long) first_entry*sizeof(struct disk_dirent),
+				(long long) (last_entry + 1)*sizeof(struct disk_dirent));
+		flush_fbm();
+		fs->refs_dirty = true;
+		flush_tables();
+	}
+	return imported;
+}
+
+// read cluster c of a compressed file into buf (CLUSTER_SIZE bytes, zero past the stored data).
+// returns -1 if the cluster is corrupt
+static int read_cluster(int inode, int c, int *index_block, char *buf) {
+	char *disk_buf = malloc(CLUSTER_SIZE);
+	int nblocks = 0;
+	int res = 0;
+
+	// a cluster's blocks are allocated together, so read runs of them at once
+	for (int i = 0; i < CLUSTER_BLOCKS; ) {
+		int first = get_block_ptr(inode, c*CLUSTER_BLOCKS + i, index_block);
+		int n = 1;
+		if (first == 0) {
+			break;
+		}
+		while (i + n < CLUSTER_BLOCKS && get_block_ptr(inode, c*CLUSTER_BLOCKS + i + n, index_block) == first + n) {
+			n++;
+		}
+		if (read_disk(first, n, disk_buf + i*DISK_BLOCK_SIZE) < 0) {
+			res = -1;
+		}
+		i += n;
+		nblocks = i;
+	}
+
+	memset(buf, 0, CLUSTER_SIZE);
+	if (is_compressed_cluster(inode, c, index_block)) {
+		unsigned short clen;
+		memcpy(&clen, disk_buf, 2);
+		if (clen + 2 > nblocks*DISK_BLOCK_SIZE || lz_decompress(disk_buf + 2, clen, buf, CLUSTER_SIZE) < 0) {
+			printf("sfs_fread: corrupt compressed block %d\n", get_block_ptr(inode, c*CLUSTER_BLOCKS, index_block));
+			res = -1;
+		}
+	}
+	else {
+		memcpy(buf, disk_buf, nblocks*DISK_BLOCK_SIZE);
+	}
+	free(disk_buf);
+	return res;
+}
+
+// compress the first len bytes of buf and store them as cluster c, replacing the cluster's old blocks.
+// returns -1 (and leaves the old cluster in place) if there is no space for the new blocks
+static int write_cluster(int inode, int c, int *index_block, char *buf, int len, int fd, int *goal) {
+	char *disk_buf = malloc(CLUSTER_SIZE);
+	int new_blocks[CLUSTER_BLOCKS];
+	int nblocks = (int) ceil((double) len/DISK_BLOCK_SIZE);
+	bool compressed = false;
+
+	// 1. only keep the compressed data if it saves at least one block
+	int clen = lz_compress(buf, len, disk_buf + 2, (nblocks - 1)*DISK_BLOCK_SIZE - 2);
+	if (clen >= 0) {
+		unsigned short header = clen;
+		memcpy(disk_buf, &header, 2);
+		nblocks = (int) ceil((double) (clen + 2)/DISK_BLOCK_SIZE);
+		compressed = true;
+	}
+	else {
+		memcpy(disk_buf, buf, len);
+	}
+
+	// 2. allocate the new blocks before giving up the old ones
+	for (int i = 0; i < nblocks; i++) {
+		new_blocks[i] = alloc_block(*goal, fd);
+		if (new_blocks[i] == -1) {
+			for (int j = 0; j < i; j++) {
+				set_free(data_index(new_blocks[j]));
+			}
+			free(disk_buf);
+			return -1;
+		}
+		*goal = new_blocks[i] + 1;
+	}
+
+	// 3. write the cluster, one write per run of blocks
+	for (int i = 0; i < nblocks; ) {
+		int n = 1;
+		while (i + n < nblocks && new_blocks[i + n] == new_blocks[i] + n) {
+			n++;
+		}
+		write_disk(new_blocks[i], n, disk_buf + i*DISK_BLOCK_SIZE);
+		i += n;
+	}
+	free(disk_buf);
+
+	// 4. swap the cluster's pointers over to the new blocks
+	for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+		int fblock = c*CLUSTER_BLOCKS + i;
+		int old_block = get_block_ptr(inode, fblock, index_block);
+		if (old_block != 0) {
+			release_block(old_block);
+		}
+		set_block_ptr(inode, fblock, index_block, i < nblocks ? new_blocks[i] : 0);
+	}
+	if (compressed) {
+		set_block_ptr(inode, c*CLUSTER_BLOCKS, index_block, new_blocks[0] | COMPRESSED_PTR);
+	}
+	return 0;
+}
+
+// sfs_fwrite for compressed files: every cluster the write touches is decompressed, updated and
+// compressed again into newly allocated blocks
+static int compressed_fwrite(int fileID, const char *buffer, int length) {
+	int inode = fs->fdt[fileID].inode;
+	int start_byte = fs->fdt[fileID].fp;
+	int *index_block = NULL;
+	int bytes_written = 0;
+
+	// check if file is full, and reduce write size to the max file size (268 blocks) if necessary
+	if (start_byte >= 268*DISK_BLOCK_SIZE) {
+		puts("sfs_fwrite: file is full");
+		return 0;
+	}
+	if (start_byte + length > 268*DISK_BLOCK_SIZE) {
+		length = 268*DISK_BLOCK_SIZE - start_byte;
+	}
+	int first_cluster = start_byte/CLUSTER_SIZE;
+	int last_cluster = (start_byte + length - 1)/CLUSTER_SIZE;
+	int goal = first_goal(inode);
+
+	// the index block holds the pointers of clusters 3 and up
+	if (last_cluster*CLUSTER_BLOCKS + CLUSTER_BLOCKS - 1 > 11) {
+		if ((index_block = get_index_block(inode)) == NULL) {
+			return -1;
+		}
+		if (fs->inode_table[inode].indirect_ptr == 0) {
+			int block_num = alloc_block(goal, fileID);
+			if (block_num == -1) {
+				printf("sfs_fwrite: no space to allocate to index block\n");
+				return -1;
+			}
+			fs->inode_table[inode].indirect_ptr = block_num;
+		}
+	}
+	if (first_cluster > 0) {
+		// continue after the previous cluster's blocks
+		for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+			int block_num = get_block_ptr(inode, first_cluster*CLUSTER_BLOCKS - 1 - i, index_block);
+			if (block_num != 0) {
+				goal = block_num + 1;
+				break;
+			}
+		}
+	}
+
+	char *cluster = malloc(CLUSTER_SIZE);
+	for (int c = first_cluster; c <= last_cluster; c++) {
+		int offset = (c == first_cluster) ? start_byte % CLUSTER_SIZE : 0; // write position in cluster
+		int bytes_to_write = CLUSTER_SIZE - offset;
+		if (bytes_to_write > length - bytes_written) {
+			bytes_to_write = length - bytes_written;
+		}
+		int old_len = fs->inode_table[inode].filesize - c*CLUSTER_SIZE; // bytes of file data already in cluster
+		if (old_len > CLUSTER_SIZE) {
+			old_len = CLUSTER_SIZE;
+		}
+
+		// keep the existing data the write doesn't cover
+		if (old_len > 0 && (offset > 0 || bytes_to_write < old_len)) {
+			if (read_cluster(inode, c, index_block, cluster) < 0) {
+				printf("sfs_fwrite: can't read cluster %d\n", c);
+				break;
+			}
+		}
+		else memset(cluster, 0, CLUSTER_SIZE);
+		memcpy(cluster + offset, buffer + bytes_written, bytes_to_write);
+
+		int new_len = offset + bytes_to_write > old_len ? offset + bytes_to_write : old_len;
+		if (write_cluster(inode, c, index_block, cluster, new_len, fileID, &goal) == -1) {
+			printf("sfs_fwrite: no space to write cluster %d\n", c);
+			break;
+		}
+		bytes_written += bytes_to_write;
+		fs->fdt[fileID].fp += bytes_to_write;
+	}
+	free(cluster);
+
+	// update file size 
+	if (fs->inode_table[inode].filesize < fs->fdt[fileID].fp) {
+		fs->inode_table[inode].filesize = fs->fdt[fileID].fp;
+	}
+
+	// update disk (index block + inode + fbm)
+	if (fs->inode_table[inode].indirect_ptr != 0 && last_cluster*CLUSTER_BLOCKS + CLUSTER_BLOCKS - 1 > 11) {
+		write_index_block(inode, index_block);
+	}
+	flush_inode(inode);
+	flush_fbm();
+	flush_tables();
+
+	return bytes_written;
+}
+
+// sfs_fread for compressed files (length is already limited to the end of the file)
+static int compressed_fread(int fileID, char *buffer, int length) {
+	int inode = fs->fdt[fileID].inode;
+	int start_byte = fs->fdt[fileID].fp;
+	int *index_block = NULL;
+	int bytes_read = 0;
+	int first_cluster = start_byte/CLUSTER_SIZE;
+	int last_cluster = (start_byte + length - 1)/CLUSTER_SIZE;
+
+	if (last_cluster*CLUSTER_BLOCKS + CLUSTER_BLOCKS - 1 > 11 && (index_block = get_index_block(inode)) == NULL) {
+		return -1;
+	}
+
+	char *cluster = malloc(CLUSTER_SIZE);
+	bool failed = false;
+	for (int c = first_cluster; c <= last_cluster; c++) {
+		int offset = (c == first_cluster) ? start_byte % CLUSTER_SIZE : 0;
+		int bytes_to_read = CLUSTER_SIZE - offset;
+		if (bytes_to_read > length - bytes_read) {
+			bytes_to_read = length - bytes_read;
+		}
+		if (read_cluster(inode, c, index_block, cluster) < 0) {
+			failed = true;
+		}
+		memcpy(buffer + bytes_read, cluster + offset, bytes_to_read);
+		bytes_read += bytes_to_read;
+	}
+	free(cluster);
+	if (failed) {
+		return -1;
+	}
+	fs->fdt[fileID].fp += length;
+	return length;
+}
+
+// write to an inline file. a write that still fits is copied into the inode. otherwise the file's data
+// is moved out to a data block, and -1 is returned so the write goes on as for any other file
+static int inline_fwrite(int fileID, const char *buffer, int length) {
+	int inode = fs->fdt[fileID].inode;
+	int fp = fs->fdt[fileID].fp;
+	struct inode *node = &fs->inode_table[inode];
+
+	if (fp >= 0 && length >= 0 && fp + length <= INLINE_BYTES) {
+		memcpy(node->inline_data + fp, buffer, length);
+		fs->fdt[fileID].fp += length;
+		if (node->filesize < fs->fdt[fileID].fp) {
+			node->filesize = fs->fdt[fileID].fp;
+		}
+		flush_inode(inode);
+		flush_tables();
+		return length;
+	}
+
+	// the file becomes an ordinary empty file, and its old bytes are written back to it
+	char old[INLINE_BYTES];
+	int size = node->filesize;
+	memcpy(old, node->inline_data, size);
+	node->inlined = false;
+	memset(node->inline_data, 0, INLINE_BYTES);
+	node->filesize = 0;
+	if (size > 0) {
+		fs->fdt[fileID].fp = 0;
+		trace_nested++;
+		int res = sfs_fwrite_r(fs, fileID, old, size);
+		trace_nested--;
+		fs->fdt[fileID].fp = fp;
+		// no space for the data block (the old bytes only need one), so the file stays inline
+		if (res != size) {
+			node->inlined = true;
+			memcpy(node->inline_data, old, size);
+			node->filesize = size;
+			flush_inode(inode);
+			flush_tables();
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int sfs_fwrite_r(sfs_t *sfs, int fileID, const char* buffer, int length) {
+	fs = sfs;
+	trace(TRACE_FWRITE, NULL, fileID, length, 0, 0);
+	COUNT_OP(SFS_OP_FWRITE, fileID);
+	// check if file is open. if not, return 0
+	if (!fd_is_open(fileID)) {
+		printf("sfs_fwrite: file not open\n");
+		return 0;
+	}
+	if (fs->inode_table[fs->fdt[fileID].inode].inlined) {
+		int res = inline_fwrite(fileID, buffer, length);
+		if (res >= 0) {
+			return res;
+		}
+	}
+	if (fs->inode_table[fs->fdt[fileID].inode].compressed) {
+		return compressed_fwrite(fileID, buffer, length);
+	}
+
+	// define variables needed to determine number of blocks to allocate on disk and which data blocks to write to
+	int inode = fs->fdt[fileID].inode;
+	int start_byte = fs->fdt[fileID].fp;
+	int end_byte = start_byte + length - 1;
+	// printf("start byte: %d\n", start_byte);
+	// printf("end byte: %d\n", end_byte);
+
+	// check if file is full
+	if (start_byte >= 268*DISK_BLOCK_SIZE) {
+		puts("sfs_fwrite: file is full");
+		return 0;
+	}
+	// check if write exceeds max number of data blocks a file can have (268) and reduce write size if necessary
+	if (end_byte >= 268*DISK_BLOCK_SIZE) {
+		end_byte = 268*DISK_BLOCK_SIZE - 1;
+		length = end_byte - start_byte + 1;
+	}
+
+	int last_block = (int) ceil((double) fs->inode_table[inode].filesize/DISK_BLOCK_SIZE) - 1; // the last file block allocated for this file before the write
+	int startw_block = (int) floor((double) start_byte/DISK_BLOCK_SIZE); // file block that our write starts in
+	int endw_block = (int) floor((double) end_byte/DISK_BLOCK_SIZE); // file block that our write ends in
+	int num_new_blocks = endw_block - last_block; //number of new data blocks to allocate for this write
+	int new_block_num = -1; // data block number obtained from fbm for each new block for this file
+	int *index_block = NULL; // the file's cached index block, if its pointers are needed
+
+	// allocation goal: the block right after the file's last block, so the file stays contiguous.
+	// a new file starts in its own region of the disk so files written at the same time are spread out
+	int goal = first_goal(inode);
+	if (last_block >= 0 && last_block < 12) {
+		goal = fs->inode_table[inode].direct_ptr[last_block] + 1;
+	}
+	
+	// load index block if pointers will be needed beyond the 12 direct ptrs
+	if (endw_block > 11) {
+		if ((index_block = get_index_block(inode)) == NULL) {
+			return -1;
+		}
+		// if indirect ptr hasn't been used yet, find a free block for index block in fbm
+		if (fs->inode_table[inode].indirect_ptr == 0) {
+			new_block_num = alloc_block(goal, fileID);
+			if (new_block_num == -1) {
+				printf("sfs_fwrite: no space to allocate to index block\n");
+				return -1;
+			}
+			fs->inode_table[inode].indirect_ptr = new_block_num;
+			goal = new_block_num + 1;
+		}
+		if (last_block > 11) {
+			goal = index_block[last_block - 12] + 1;
+		}
+	}
+
+	// allocate new blocks needed for write and assign an inode pointer to each block
+	for (int i = 1; i <= num_new_blocks; i++) {
+		// search fbm for a free data block to allocate
+		new_block_num = alloc_block(goal, fileID);
+
+		// check if a free block was found
+		if (new_block_num == -1) {
+			endw_block = last_block + i - 1;
+			end_byte = (endw_block + 1)*DISK_BLOCK_SIZE - 1;
+
+			if (endw_block < startw_block) {
+				printf("sfs_fwrite: not enough space to write any bytes\n");
+				return 0;
+			}
+			break;
+		}
+
+		// if free block was found, add it to file's inode 
+		set_block_ptr(inode, last_block + i, index_block, new_block_num);
+		goal = new_block_num + 1;
+	}
+
+	// all necessary data blocks for write are allocated, so begin writing:
+	int bytes_written = 0;
+	int start_position = start_byte % DISK_BLOCK_SIZE; // writing start position in block to write in
+	int bytes_to_write; // number of bytes to write in a specific block
+	int block_num; // number of data block to write in
+	char* temp_buf = (char *) malloc(DISK_BLOCK_SIZE*(sizeof(char)));
+
+	for (int i = startw_block; i <= endw_block && bytes_written < length; i++) {
+		// calc num bytes to write in block i 
+		if (DISK_BLOCK_SIZE - start_position < length - bytes_written) {
+			bytes_to_write = DISK_BLOCK_SIZE - start_position;
+		}
+		else bytes_to_write = length - bytes_written;
+
+		block_num = get_block_ptr(inode, i, index_block);
+
+		// if only part of the block is written, keep the rest of its contents
+		if (bytes_to_write < DISK_BLOCK_SIZE) {
+			if (i > last_block) {
+				memset(temp_buf, 0, DISK_BLOCK_SIZE);
+			}
+			else if (read_disk(block_num, 1, temp_buf) < 0) {
+				printf("sfs_fwrite: can't read block %d\n", block_num);
+				break;
+			}
+		}
+
+		memcpy(temp_buf + start_position, buffer + bytes_written, bytes_to_write);
+
+		// dedup: if another block already holds this data, share it instead of writing
+		unsigned long long hash = 0;
+		int dup_block = -1;
+		if (fs->dedup_enabled) {
+			hash = hash_block(temp_buf);
+			dup_block = find_duplicate(hash, temp_buf, block_num);
+		}
+		if (dup_block != -1) {
+			release_block(block_num);
+			fs->block_refs[data_index(dup_block)]++;
+			fs->refs_dirty = true;
+			set_block_ptr(inode, i, index_block, dup_block);
+		}
+		else {
+			// copy-on-write: a shared block gets a private copy before it is modified. in log mode,
+			// every block is written at the head of the log (unless it's already there)
+			if (i <= last_block && (fs->block_refs[data_index(block_num)] > 0 || (fs->log_mode && !in_log_buffer(block_num)))) {
+				new_block_num = alloc_block(block_num, fileID);
+				if (new_block_num == -1) {
+					printf("sfs_fwrite: no space to copy shared block\n");
+					break;
+				}
+				release_block(block_num);
+				block_num = new_block_num;
+				set_block_ptr(inode, i, index_block, block_num);
+			}
+			write_disk(block_num, 1, temp_buf);
+
+			if (fs->dedup_enabled) {
+				set_hash(data_index(block_num), hash);
+			}
+			else forget_hash(data_index(block_num)); // contents changed
+		}
+
+		bytes_written += bytes_to_write;
+		fs->fdt[fileID].fp += bytes_to_write;
+		start_position = 0;
+	}
+	free(temp_buf);
+
+	// update file size 
+	if (fs->inode_table[inode].filesize < fs->fdt[fileID].fp) {
+		fs->inode_table[inode].filesize = fs->fdt[fileID].fp;
+	}
+
+	// update index block in disk (first, since it moves in log mode)
+	if (endw_block > 11) {
+		write_index_block(inode, index_block);
+	}
+
+	// update inode in disk
+	flush_inode(inode);
+
+	// update fbm in disk
+	flush_fbm();
+	flush_tables();
+
+	return bytes_written;
+}
+
+int sfs_fread_r(sfs_t *sfs, int fileID, char* buffer, int length) {
+	fs = sfs;
+	trace(TRACE_FREAD, NULL, fileID, length, 0, 0);
+	COUNT_OP(SFS_OP_FREAD, fileID);
+	// check if file is open. if not, return 0
+	if (!fd_is_open(fileID)) {
+		printf("sfs_fread: file not open\n");
+		return 0;
+	}
+	int inode = fs->fdt[fileID].inode;
+
+	// check if fp is out of bounds
+	if (fs->inode_table[inode].filesize <= fs->fdt[fileID].fp) {
+		printf("sfs_fread: read is out of file bounds\n");
+		return 0;
+	}
+
+	// check if read goes out of bounds. if it does, edit the length to be in bounds
+	if (fs->fdt[fileID].fp + length > fs->inode_table[inode].filesize) {
+		length = fs->inode_table[inode].filesize - fs->fdt[fileID].fp; // num bytes to read is everything from fp to end of file
+	}
+	if (fs->inode_table[inode].inlined) {
+		memcpy(buffer, fs->inode_table[inode].inline_data + fs->fdt[fileID].fp, length);
+		fs->fdt[fileID].fp += length;
+		return length;
+	}
+	if (fs->inode_table[inode].compressed) {
+		return compressed_fread(fileID, buffer, length);
+	}
+
+	// determine data block numbers to read from disk
+	char* temp_buf = (char *) malloc(DISK_BLOCK_SIZE*(sizeof(char))); // buffer to read a partial data block into
+	int bytes_read = 0;
+	int start_position = fs->fdt[fileID].fp % DISK_BLOCK_SIZE; // reading start position in the first block
+	int start_block = (int) floor((double) fs->fdt[fileID].fp/DISK_BLOCK_SIZE); // calculate which file block the fp is in
+	int end_block = (int) floor((double) (fs->fdt[fileID].fp + length - 1)/DISK_BLOCK_SIZE); // calculate which file block the read ends in
+	bool failed = false;
+
+	int *index_block = NULL;
+	if (end_block > 11 && (index_block = get_index_block(inode)) == NULL) {
+		free(temp_buf);
+		return -1;
+	}
+
+	for (int i = start_block; i <= end_block; ) {
+		int block_num = get_block_ptr(inode, i, index_block);
+		int bytes_to_read = DISK_BLOCK_SIZE - start_position;
+		if (bytes_to_read > length - bytes_read) {
+			bytes_to_read = length - bytes_read;
+		}
+
+		// a block that is only partly read goes through temp_buf
+		if (bytes_to_read < DISK_BLOCK_SIZE) {
+			if (read_disk(block_num, 1, temp_buf) < 0) {
+				failed = true;
+			}
+			memcpy(buffer + bytes_read, temp_buf + start_position, bytes_to_read);
+			bytes_read += bytes_to_read;
+			start_position = 0;
+			i++;
+			continue;
+		}
+
+		// whole blocks that are consecutive on disk are read straight into the caller's buffer with one read,
+		// and their checksums are verified together
+		int n = 1;
+		while (i + n <= end_block && get_block_ptr(inode, i + n, index_block) == block_num + n
+				&& length - bytes_read >= (n + 1)*DISK_BLOCK_SIZE) {
+			n++;
+		}
+		if (read_disk(block_num, n, buffer + bytes_read) < 0) {
+			failed = true;
+		}
+		bytes_read += n*DISK_BLOCK_SIZE;
+		i += n;
+	}
+	free(temp_buf);
+	if (failed) {
+		printf("sfs_fread: file with id %d has corrupt blocks\n", fileID);
+		return -1;
+	}
+	fs->fdt[fileID].fp += length;
+	return length;
+}
+
+// positional I/O: read or write length bytes at offset, leaving the file pointer where it was
+int sfs_pread_r(sfs_t *sfs, int fileID, char *buffer, int length, int offset) {
+	fs = sfs;
+	trace(TRACE_PREAD, NULL, fileID, length, offset, 0);
+	COUNT_OP(SFS_OP_PREAD, -1);
+	if (!fd_is_open(fileID)) {
+		printf("sfs_pread: file not open\n");
+		return 0;
+	}
+	// reading at the end of the file isn't an error here, there's just nothing to read
+	if (length <= 0 || offset >= fs->inode_table[fs->fdt[fileID].inode].filesize) {
+		return 0;
+	}
+	int fp = fs->fdt[fileID].fp;
+	fs->fdt[fileID].fp = offset;
+	trace_nested++;
+	int res = sfs_fread_r(sfs, fileID, buffer, length);
+	trace_nested--;
+	fs->fdt[fileID].fp = fp;
+	count_bytes(res > 0 ? res : 0);
+	return res;
+}
+
+int sfs_pwrite_r(sfs_t *sfs, int fileID, const char *buffer, int length, int offset) {
+	fs = sfs;
+	trace(TRACE_PWRITE, NULL, fileID, length, offset, 0);
+	COUNT_OP(SFS_OP_PWRITE, -1);
+	if (!fd_is_open(fileID)) {
+		printf("sfs_pwrite: file not open\n");
+		return 0;
+	}
+	int fp = fs->fdt[fileID].fp;
+	fs->fdt[fileID].fp = offset;
+	trace_nested++;
+	int res = sfs_fwrite_r(sfs, fileID, buffer, length);
+	trace_nested--;
+	fs->fdt[fileID].fp = fp;
+	count_bytes(res > 0 ? res : 0);
+	return res;
+}
+
+// map length bytes of an open file at offset to where they're stored in the disk image, so they can be
+// read from sfs_disk_fd without copying them through sfs_fread. returns the number of extents filled
+// (0 = offset is at the end of the file). an extent with pos -1 can't be read from the image as it is
+// (compressed, its checksums need checking, or the disk is striped over several files) and has to be
+// read with sfs_pread
+int sfs_fmap_r(sfs_t *sfs, int fileID, int offset, int length, struct sfs_extent *extents, int max) {
+	fs = sfs;
+	trace(TRACE_FMAP, NULL, fileID, offset, length, max);
+	COUNT_OP(SFS_OP_FMAP, -1);
+	if (!fd_is_open(fileID)) {
+		printf("sfs_fmap: file not open\n");
+		return -1;
+	}
+	int inode = fs->fdt[fileID].inode;
+	int filesize = fs->inode_table[inode].filesize;
+	if (length <= 0 || offset >= filesize) {
+		return 0;
+	}
+	if (offset + length > filesize) {
+		length = filesize - offset;
+	}
+	bool direct = !fs->inode_table[inode].compressed && !fs->checksums_enabled && disk_fd(fs->disk) >= 0;
+	int end = offset + length;
+
+	int *index_block = NULL;
+	if (direct && (end - 1)/DISK_BLOCK_SIZE > 11 && (index_block = get_index_block(inode)) == NULL) {
+		return -1;
+	}
+
+	// one piece per file block, merged with the previous extent when it follows it in the image
+	int n = 0;
+	while (offset < end) {
+		int chunk = DISK_BLOCK_SIZE - offset % DISK_BLOCK_SIZE;
+		if (chunk > end - offset) {
+			chunk = end - offset;
+		}
+		long long pos = -1;
+		int block_num = direct ? get_block_ptr(inode, offset/DISK_BLOCK_SIZE, index_block) : 0;
+		// a block only written to memory so far (write-back, or the log's segment buffer) isn't in the image yet
+		if (block_num != 0 && !wb_cached(block_num) && !in_log_buffer(block_num)) {
+			pos = (long long) block_num*DISK_BLOCK_SIZE + offset % DISK_BLOCK_SIZE;
+		}
+
+		long long last_end = n > 0 && extents[n - 1].pos != -1 ? extents[n - 1].pos + extents[n - 1].length : -1;
+		if (n > 0 && (pos == -1 ? extents[n - 1].pos == -1 : last_end == pos)) {
+			extents[n - 1].length += chunk;
+		} else if (n < max) {
+			extents[n].offset = offset;
+			extents[n].length = chunk;
+			extents[n].pos = pos;
+			n++;
+		} else {
 			break;
 		}
+		offset += chunk;
+	}
+	return n;
+}
+
+int sfs_disk_fd_r(sfs_t *sfs) {
+	return disk_fd(sfs->disk);
+}
+
+int sfs_fseek_r(sfs_t *sfs, int fileID, int location) {
+	fs = sfs;
+	trace(TRACE_FSEEK, NULL, fileID, location, 0, 0);
+	COUNT_OP(SFS_OP_FSEEK, -1);
+	 if (!fd_is_open(fileID)) {
+	 	printf("sfs_fseek error: file with id %d is not open.\n", fileID);
+	 	return -1;
+	 }
+	 fs->fdt[fileID].fp = location;
+	 return 0;
+}
+
+int sfs_fcompress_r(sfs_t *sfs, int fileID, int enable) {
+	fs = sfs;
+	trace(TRACE_FCOMPRESS, NULL, fileID, enable, 0, 0);
+	COUNT_OP(SFS_OP_ADMIN, -1);
+	if (!fd_is_open(fileID)) {
+		printf("sfs_fcompress error: file with id %d is not open.\n", fileID);
+		return -1;
+	}
+	// the storage format can only be changed before any data is written
+	int inode = fs->fdt[fileID].inode;
+	if (fs->inode_table[inode].filesize != 0) {
+		printf("sfs_fcompress error: file with id %d is not empty.\n", fileID);
+		return -1;
+	}
+	fs->inode_table[inode].compressed = enable;
+	flush_inode(inode);
+	flush_tables();
+	return 0;
+}
+
+void sfs_compress_r(sfs_t *sfs, int enable) {
+	fs = sfs;
+	trace(TRACE_COMPRESS, NULL, enable, 0, 0, 0);
+	COUNT_OP(SFS_OP_ADMIN, -1);
+	fs->compress_new_files = enable;
+	write_superblock();
+}
+
+void sfs_dedup_r(sfs_t *sfs, int enable) {
+	fs = sfs;
+	trace(TRACE_DEDUP, NULL, enable, 0, 0, 0);
+	COUNT_OP(SFS_OP_ADMIN, -1);
+	fs->dedup_enabled = enable;
+	write_superblock();
+}
+
+int sfs_checksum_r(sfs_t *sfs, int enable) {
+	fs = sfs;
+	trace(TRACE_CHECKSUM, NULL, enable, 0, 0, 0);
+	COUNT_OP(SFS_OP_ADMIN, -1);
+	fs->checksums_enabled = false;
+	if (enable) {
+		// checksum every block, reading the disk in large sequential chunks
+		char *buf = malloc(SCRUB_CHUNK*DISK_BLOCK_SIZE);
+		for (int start = 1; start < fs->crc_block; start += SCRUB_CHUNK) {
+			int n = fs->crc_block - start < SCRUB_CHUNK ? fs->crc_block - start : SCRUB_CHUNK;
+			if (dev_read(start, n, buf) < 0) {
+				free(buf);
+				return -1;
+			}
+			for (int i = 0; i < n; i++) {
+				fs->block_crc[start + i] = crc32c(0, buf + i*DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+			}
+		}
+		free(buf);
+		dev_write(fs->crc_block, fs->crc_blocks, fs->block_crc);
+		count_meta(fs->crc_blocks);
+	}
+	fs->checksums_enabled = enable;
+	write_superblock();
+	return 0;
+}
+
+void sfs_writeback_r(sfs_t *sfs, int enable) {
+	fs = sfs;
+	trace(TRACE_WRITEBACK, NULL, enable, 0, 0, 0);
+	COUNT_OP(SFS_OP_ADMIN, -1);
+	if (enable && !fs->wb_enabled) {
+		wb_start();
+	}
+	else if (!enable && fs->wb_enabled) {
+		wb_shutdown();
+	}
+}
+
+// everything is on disk once the dirty blocks are written (without write-back, it already is)
+int sfs_sync_r(sfs_t *sfs) {
+	fs = sfs;
+	trace(TRACE_SYNC, NULL, 0, 0, 0, 0);
+	COUNT_OP(SFS_OP_SYNC, -1);
+	if (fs->wb_enabled) {
+		wb_flush(true);
+	}
+	return 0;
+}
+
+// the file's blocks can't be told apart from the metadata they depend on, so the whole disk is synced
+int sfs_fsync_r(sfs_t *sfs, int fileID) {
+	fs = sfs;
+	trace(TRACE_FSYNC, NULL, fileID, 0, 0, 0);
+	COUNT_OP(SFS_OP_SYNC, -1);
+	if (!fd_is_open(fileID)) {
+		printf("sfs_fsync error: file with id %d is not open.\n", fileID);
+		return -1;
+	}
+	trace_nested++;
+	int res = sfs_sync_r(sfs);
+	trace_nested--;
+	return res;
+}
+
+// save a RAM disk to an image file, with everything written to it first
+int sfs_snapshot_r(sfs_t *sfs, char *path) {
+	fs = sfs;
+	trace(TRACE_SNAPSHOT, path, 0, 0, 0, 0);
+	COUNT_OP(SFS_OP_SYNC, -1);
+	if (fs->log_mode) {
+		write_checkpoint();
+	}
+	trace_nested++;
+	sfs_sync_r(sfs);
+	trace_nested--;
+	if (disk_snapshot(fs->disk, path) < 0) {
+		printf("sfs_snapshot error: could not save the disk to %s.\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+int sfs_clean_r(sfs_t *sfs, int segments) {
+	fs = sfs;
+	trace(TRACE_CLEAN, NULL, segments, 0, 0, 0);
+	COUNT_OP(SFS_OP_ADMIN, -1);
+	if (!fs->log_mode) {
+		printf("sfs_clean error: the file system is not log-structured.\n");
+		return -1;
+	}
+	int cleaned = 0;
+	while (cleaned < segments && clean_segment()) {
+		log_meta();
+		cleaned++;
+	}
+	flush_tables();
+	return cleaned;
+}
+
+int sfs_scrub_r(sfs_t *sfs) {
+	fs = sfs;
+	trace(TRACE_SCRUB, NULL, 0, 0, 0, 0);
+	COUNT_OP(SFS_OP_ADMIN, -1);
+	if (!fs->checksums_enabled) {
+		printf("sfs_scrub error: checksums are not enabled.\n");
+		return -1;
+	}
+	// verify the whole disk with large sequential reads
+	int bad = 0;
+	char *buf = malloc(SCRUB_CHUNK*DISK_BLOCK_SIZE);
+	for (int start = 1; start < fs->crc_block; start += SCRUB_CHUNK) {
+		int n = fs->crc_block - start < SCRUB_CHUNK ? fs->crc_block - start : SCRUB_CHUNK;
+		if (dev_read(start, n, buf) < 0) {
+			bad += n;
+			continue;
+		}
+		bad += verify_blocks(start, n, buf);
+	}
+	free(buf);
+	return bad;
+}
+
+// whether block_num is a data block (not a table block, or an fbm or inode table slice of a group)
+static bool is_data_block(int block_num) {
+	if (block_num < fs->data_block) {
+		return false;
+	}
+	int i = data_index(block_num);
+	return i >= 0 && i < fs->num_data_blocks && data_block_num(i) == block_num;
+}
+
+static int compare_index_ptrs(const void *a, const void *b) {
+	return fs->inode_table[*(const int *) a].indirect_ptr - fs->inode_table[*(const int *) b].indirect_ptr;
+}
+
+// cache the index blocks of the n inodes in list, in block order, with one read for each run of blocks
+// less than FSCK_SPAN apart. a run that can't be read (a checksum error) is read one block at a time
+static void read_index_blocks(int *list, int n) {
+	char *buf = malloc(FSCK_SPAN*DISK_BLOCK_SIZE);
+	qsort(list, n, sizeof(int), compare_index_ptrs);
+	for (int k = 0; k < n; ) {
+		int first = fs->inode_table[list[k]].indirect_ptr;
+		int end = k + 1;
+		while (end < n && fs->inode_table[list[end]].indirect_ptr < first + FSCK_SPAN) {
+			end++;
+		}
+		bool ok = read_disk(first, fs->inode_table[list[end - 1]].indirect_ptr - first + 1, buf) >= 0;
+		for (; k < end; k++) {
+			if (!ok) {
+				get_index_block(list[k]);
+				continue;
+			}
+			fs->index_cache[list[k]] = malloc(DISK_BLOCK_SIZE);
+			memcpy(fs->index_cache[list[k]], buf + (fs->inode_table[list[k]].indirect_ptr - first)*DISK_BLOCK_SIZE,
+					DISK_BLOCK_SIZE);
+		}
+	}
+	free(buf);
+}
+
+// count the block pointers of a job's inodes. a file with a bad size, a pointer outside the data blocks
+// or an index block that can't be read is cut short before it (at a cluster boundary if it's compressed)
+static void *fsck_scan(void *arg) {
+	struct fsck_job *job = arg;
+	fs = job->sfs;
+	for (int i = job->first; i < job->last; i++) {
+		struct inode *node = &fs->inode_table[i];
+		if (!job->live[i]) {
+			continue;
+		}
+		int max_size = node->inlined ? INLINE_BYTES : 268*DISK_BLOCK_SIZE;
+		int size = node->filesize < 0 ? 0 : node->filesize > max_size ? max_size : node->filesize;
+		bool bad = size != node->filesize;
+		int numPtrs = node->inlined ? 0 : blocks_for(size);
+		int keep = numPtrs;
+		int *index_block = fs->index_cache[i];
+		bool index_ok = node->indirect_ptr != 0 && is_data_block(node->indirect_ptr) && (numPtrs <= 12 || index_block != NULL);
+
+		if ((node->indirect_ptr != 0 || numPtrs > 12) && !index_ok) {
+			bad = true;
+			keep = keep < 12 ? keep : 12;
+		}
+		for (int j = 0; j < keep; j++) {
+			int block_num = get_block_ptr(i, j, index_block);
+			if (block_num != 0 && !is_data_block(block_num)) {
+				bad = true;
+				keep = j;
+			}
+		}
+		if (keep < numPtrs && node->compressed) {
+			keep -= keep % CLUSTER_BLOCKS;
+		}
+		if (bad) {
+			job->bad_inodes++;
+			if (job->repair) {
+				node->filesize = size < keep*DISK_BLOCK_SIZE || node->inlined ? size : keep*DISK_BLOCK_SIZE;
+				if (!index_ok && node->indirect_ptr != 0) {
+					node->indirect_ptr = 0;
+					forget_index_block(i);
+				}
+			}
+		}
+		for (int j = 0; j < keep; j++) {
+			int block_num = get_block_ptr(i, j, index_block);
+			if (block_num != 0) {
+				__sync_fetch_and_add(&job->uses[data_index(block_num)], 1);
+			}
+		}
+		if (index_ok) {
+			__sync_fetch_and_add(&job->fixed[data_index(node->indirect_ptr)], 1);
+			job->has_index[i] = true;
+		}
+	}
+	return NULL;
+}
+
+// check the fbm and reference counts of a job's data blocks against the counts. a block used more often
+// than its reference count says is double allocated; a block marked in use that nothing uses, or with a
+// count too high to ever be freed, is leaked
+static void *fsck_reconcile(void *arg) {
+	struct fsck_job *job = arg;
+	fs = job->sfs;
+	for (int i = job->first; i < job->last; i++) {
+		int users = job->uses[i] + job->fixed[i];
+		int refs = users > 256 ? 255 : users > 0 ? users - 1 : 0;
+		bool used = fs->free_bit_map[i] == '0';
+
+		if (users == 0) {
+			job->leaked += used;
+		}
+		else {
+			job->unmarked += !used;
+			job->double_allocated += fs->block_refs[i] < refs;
+			job->leaked += fs->block_refs[i] > refs;
+		}
+		// the threads share free_count, so it's worked out again once they're done
+		if (job->repair) {
+			if (users == 0 && used) {
+				fs->free_bit_map[i] = '1';
+				job->freed[i] = true;
+			}
+			else if (users > 0) {
+				fs->free_bit_map[i] = '0';
+			}
+			fs->block_refs[i] = refs;
+		}
+	}
+	return NULL;
+}
+
+// split [0, n) between FSCK_THREADS copies of job and run fn on each in its own thread
+static void run_fsck_jobs(void *(*fn)(void *), struct fsck_job *jobs, const struct fsck_job *job, int n) {
+	pthread_t threads[FSCK_THREADS];
+	for (int t = 0; t < FSCK_THREADS; t++) {
+		jobs[t] = *job;
+		jobs[t].first = (long long) n*t/FSCK_THREADS;
+		jobs[t].last = (long long) n*(t + 1)/FSCK_THREADS;
+		pthread_create(&threads[t], NULL, fn, &jobs[t]);
+	}
+	for (int t = 0; t < FSCK_THREADS; t++) {
+		pthread_join(threads[t], NULL);
+	}
+}
+
+static void fsck_shards(int dir, int nblocks, const struct dir_header *head, struct fsck_job *job,
+		struct sfs_fsck_report *found, int *dirs, int *ndirs);
+
+// check the entries of subdirectory dir like those of the root directory, and add the subdirectories
+// in it to dirs. a bad entry is removed, and so is a header that doesn't match the entries. a directory
+// with a bad size or block pointer isn't read (what's in it is left without an entry). a shard (ptrs !=
+// NULL, the 2^bits pointers of sharded directory top, with depth bits of them to dir) has to have only the
+// names that are looked up in it: one a split left behind is a bad entry
+static void fsck_dir(int dir, struct fsck_job *job, struct sfs_fsck_report *found, int *dirs, int *ndirs,
+		int top, const int *ptrs, int bits, int depth) {
+	struct inode *node = &fs->inode_table[dir];
+	int nblocks = node->filesize/DISK_BLOCK_SIZE;
+	int *index_block = NULL;
+	if (node->inlined || node->filesize % DISK_BLOCK_SIZE != 0 || nblocks < 1 || nblocks > DIR_MAX_BLOCKS
+			|| (nblocks > 12 && (!is_data_block(node->indirect_ptr) || (index_block = get_index_block(dir)) == NULL))) {
+		return;
+	}
+	for (int b = 0; b < nblocks; b++) {
+		if (!is_data_block(get_block_ptr(dir, b, index_block))) {
+			return;
+		}
+	}
+
+	struct disk_dirent *head = malloc(DISK_BLOCK_SIZE);
+	struct disk_dirent *buf = malloc(DISK_BLOCK_SIZE);
+	struct dir_header header = { DIR_MAGIC, 0, 0, depth, top };
+	int bad = 0;
+	bool head_changed = false;
+	bool moved = false;
+	if (dir_read_block(dir, 0, head) < 0) {
+		memset(head, 0, DISK_BLOCK_SIZE);
+	}
+	if (ptrs == NULL && ((struct dir_header *) head)->magic == DIR_SHARDS_MAGIC) {
+		fsck_shards(dir, nblocks, (struct dir_header *) head, job, found, dirs, ndirs);
+		free(head);
+		free(buf);
+		return;
+	}
+	for (int b = 0; b < nblocks; b++) {
+		struct disk_dirent *block = b == 0 ? head : buf;
+		bool changed = false;
+		if (b > 0 && dir_read_block(dir, b, block) < 0) {
+			memset(block, 0, DISK_BLOCK_SIZE);
+		}
+		for (int k = b == 0 ? 1 : 0; k < DIR_SLOTS; k++) {
+			int inode = block[k].inode;
+			char name[MAXFILENAME + 1];
+			header.used += inode != DIR_FREE;
+			if (inode <= DIR_FREE) {
+				continue;
+			}
+			dir_name(&block[k], name);
+			if (inode >= fs->num_inodes || !fs->inode_table[inode].occupied || job->live[inode]
+					|| (ptrs != NULL && ptrs[shard_hash(name) & ((1u << bits) - 1)] != dir)) {
+				bad++;
+				if (job->repair) {
+					block[k].inode = DIR_REMOVED;
+					changed = true;
+				}
+				continue;
+			}
+			job->live[inode] = true;
+			found->files++;
+			header.entries++;
+			if (fs->inode_table[inode].dir) {
+				dirs[(*ndirs)++] = inode;
+			}
+		}
+		if (changed && b > 0) {
+			moved |= dir_write_block(dir, b, block) > 0;
+		}
+		head_changed |= changed && b == 0;
+	}
+	// the header says how full the table is, so it has to count the entries (the bad ones too, until
+	// they're removed)
+	struct dir_header *old = (struct dir_header *) head;
+	found->bad_entries += bad;
+	if (old->magic != DIR_MAGIC || old->entries != header.entries + bad || old->used != header.used
+			|| old->depth != header.depth || old->parent != header.parent) {
+		found->bad_entries++;
+		head_changed = job->repair;
+	}
+	if (head_changed) {
+		memcpy(head, &header, sizeof(header));
+		moved |= dir_write_block(dir, 0, head) > 0;
+	}
+	if (moved) {
+		dir_flush(dir);
+	}
+	free(head);
+	free(buf);
+}
+
+struct shard_ref {
+	int shard;
+	int k;
+};
+
+static int compare_shard_refs(const void *a, const void *b) {
+	const struct shard_ref *x = a, *y = b;
+	return x->shard != y->shard ? (x->shard > y->shard) - (x->shard < y->shard) : x->k - y->k;
+}
+
+// check the shard pointers of sharded subdirectory dir (nblocks blocks, head is its header), then each of
+// its shards. the pointers to a shard of depth d have to be every 2^d'th one from the first, which is below
+// 2^d, and a shard can't be in use for anything else. if they aren't, the directory is made empty, which
+// leaves its shards and their files without an entry
+static void fsck_shards(int dir, int nblocks, const struct dir_header *head, struct fsck_job *job,
+		struct sfs_fsck_report *found, int *dirs, int *ndirs) {
+	int bits = head->depth;
+	int *ptrs = head->entries != 0 || head->used != 0 || head->parent != 0 ? NULL : dir_read_pointers(dir, head);
+	int nptrs = ptrs == NULL ? 0 : 1 << bits;
+	struct shard_ref *refs = malloc((nptrs > 0 ? nptrs : 1)*sizeof(struct shard_ref));
+	bool ok = ptrs != NULL;
+	for (int k = 0; k < nptrs; k++) {
+		refs[k].shard = ptrs[k];
+		refs[k].k = k;
+	}
+	qsort(refs, nptrs, sizeof(struct shard_ref), compare_shard_refs);
+	for (int i = 0, count; ok && i < nptrs; i += count) {
+		int shard = refs[i].shard;
+		for (count = 1; i + count < nptrs && refs[i + count].shard == shard; count++);
+		int depth = bits;
+		while (depth > 0 && (1 << (bits - depth)) < count) {
+			depth--;
+		}
+		ok = shard > ROOT_INODE && shard < fs->num_inodes && fs->inode_table[shard].occupied && fs->inode_table[shard].dir
+				&& !job->live[shard] && (1 << (bits - depth)) == count && refs[i].k < (1 << depth);
+		for (int j = 1; ok && j < count; j++) {
+			ok = refs[i + j].k == refs[i].k + (j << depth);
+		}
+	}
+	if (!ok) {
+		found->bad_entries++;
+		if (job->repair) {
+			struct disk_dirent *block = calloc(1, DISK_BLOCK_SIZE);
+			bool moved = false;
+			for (int b = nblocks - 1; b >= 0; b--) {
+				((struct dir_header *) block)->magic = b == 0 ? DIR_MAGIC : 0;
+				moved |= dir_write_block(dir, b, block) > 0;
+			}
+			if (moved) {
+				dir_flush(dir);
+			}
+			free(block);
+		}
+	}
+	else {
+		// the shards are marked in use before any is checked, so none can be an entry of another
+		for (int k = 0; k < nptrs; k++) {
+			job->live[ptrs[k]] = true;
+		}
+		for (int i = 0, count; i < nptrs; i += count) {
+			for (count = 1; i + count < nptrs && refs[i + count].shard == refs[i].shard; count++);
+			int depth = bits;
+			while (depth > 0 && (1 << (bits - depth)) < count) {
+				depth--;
+			}
+			fsck_dir(refs[i].shard, job, found, dirs, ndirs, dir, ptrs, bits, depth);
+		}
+	}
+	free(refs);
+	free(ptrs);
+}
+
+int sfs_fsck_r(sfs_t *sfs, int repair, struct sfs_fsck_report *report) {
+	fs = sfs;
+	trace(TRACE_FSCK, NULL, repair, 0, 0, 0);
+	COUNT_OP(SFS_OP_ADMIN, -1);
+	struct sfs_fsck_report found = { 0 };
+	struct fsck_job job = { fs, 0, 0, repair };
+	struct fsck_job jobs[FSCK_THREADS];
+
+	for (int i = 0; i < fs->fdt_size; i++) {
+		if (fs->fdt[i].open) {
+			printf("sfs_fsck error: files are open.\n");
+			return -1;
+		}
+	}
+
+	// 1. every directory entry needs an occupied inode of its own, and every occupied inode but the
+	// root directory's needs an entry. subdirectories are checked as they're found
+	job.live = calloc(fs->num_inodes, sizeof(bool));
+	int *dirs = malloc(fs->num_inodes*sizeof(int));
+	int ndirs = 0;
+	for (int i = 0; i < fs->num_files; i++) {
+		int inode = fs->directory[i].inode;
+		if (!fs->directory[i].occupied) {
+			continue;
+		}
+		if (inode <= ROOT_INODE || inode >= fs->num_inodes || !fs->inode_table[inode].occupied || job.live[inode]) {
+			found.bad_entries++;
+			if (repair) {
+				fs->directory[i].occupied = false;
+				name_index_remove(i);
+				fs->entry_hint = i < fs->entry_hint ? i : fs->entry_hint;
+			}
+			continue;
+		}
+		job.live[inode] = true;
+		found.files++;
+		if (fs->inode_table[inode].dir) {
+			dirs[ndirs++] = inode;
+		}
+	}
+	for (int d = 0; d < ndirs; d++) {
+		fsck_dir(dirs[d], &job, &found, dirs, &ndirs, 0, NULL, 0, 0);
+	}
+	free(dirs);
+	for (int i = ROOT_INODE + 1; i < fs->num_inodes; i++) {
+		if (fs->inode_table[i].occupied && !job.live[i]) {
+			found.orphans++;
+			if (repair) {
+				release_inode(i);
+			}
+		}
+	}
+
+	// 2. read the index blocks that will be needed
+	int *list = malloc(fs->num_inodes*sizeof(int));
+	int n = 0;
+	for (int i = 0; i < fs->num_inodes; i++) {
+		struct inode *node = &fs->inode_table[i];
+		if (job.live[i] && !node->inlined && node->filesize > 12*DISK_BLOCK_SIZE && is_data_block(node->indirect_ptr)
+				&& fs->index_cache[i] == NULL) {
+			list[n++] = i;
+		}
+	}
+	read_index_blocks(list, n);
+
+	// 3. count the block pointers, in parallel
+	job.has_index = calloc(fs->num_inodes, sizeof(bool));
+	job.uses = calloc(fs->num_data_blocks, sizeof(int));
+	job.fixed = calloc(fs->num_data_blocks, sizeof(int));
+	job.freed = calloc(fs->num_data_blocks, sizeof(bool));
+	if (fs->log_mode) {
+		for (int k = 0; k < fs->meta_blocks; k++) {
+			if (fs->meta_map[k] != 0) {
+				job.fixed[data_index(fs->meta_map[k])]++;
+			}
+		}
+	}
+	run_fsck_jobs(fsck_scan, jobs, &job, fs->num_inodes);
+	for (int t = 0; t < FSCK_THREADS; t++) {
+		found.bad_inodes += jobs[t].bad_inodes;
+	}
+
+	// 4. an index block is written in place, so it can't share its block with anything. the first file
+	// using the block keeps it, and the others get a copy of it (n is now the number of those)
+	bool *claimed = calloc(fs->num_data_blocks, sizeof(bool));
+	n = 0;
+	for (int i = 0; i < fs->num_inodes; i++) {
+		if (!job.has_index[i]) {
+			continue;
+		}
+		int b = data_index(fs->inode_table[i].indirect_ptr);
+		if (job.uses[b] == 0 && !claimed[b]) {
+			claimed[b] = true;
+			continue;
+		}
+		found.double_allocated++;
+		job.fixed[b]--;
+		list[n++] = i;
 	}
-	// if no directory entry is found, return -1
-	if (inode_num == -1) {
+	free(claimed);
+
+	// 5. check the fbm and reference counts, in parallel
+	run_fsck_jobs(fsck_reconcile, jobs, &job, fs->num_data_blocks);
+	count_free();
+	for (int t = 0; t < FSCK_THREADS; t++) {
+		found.double_allocated += jobs[t].double_allocated;
+		found.leaked += jobs[t].leaked;
+		found.unmarked += jobs[t].unmarked;
+	}
+	int problems = found.bad_inodes + found.double_allocated + found.leaked + found.unmarked + found.bad_entries + found.orphans;
+
+	// 6. copy the shared index blocks, then write everything that changed
+	if (repair && problems > 0) {
+		for (int k = 0; k < n; k++) {
+			int *index_block = get_index_block(list[k]);
+			int block_num = alloc_block(fs->inode_table[list[k]].indirect_ptr, -1);
+			if (index_block == NULL || block_num == -1) {
+				printf("sfs_fsck error: can't copy the index block of inode %d.\n", list[k]);
+				continue;
+			}
+			fs->inode_table[list[k]].indirect_ptr = block_num;
+			write_disk(block_num, 1, index_block);
+		}
+		if (fs->hashes_used) {
+			for (int i = 0; i < fs->num_data_blocks; i++) {
+				if (job.freed[i]) {
+					forget_hash(i);
+				}
+			}
+		}
+		fs->refs_dirty = true;
+		flush_fbm();
+		flush_directory();
+		flush_inode_table();
+		flush_tables();
+	}
+	free(list);
+	free(job.live);
+	free(job.has_index);
+	free(job.uses);
+	free(job.fixed);
+	free(job.freed);
+	if (report != NULL) {
+		*report = found;
+	}
+	return problems;
+}
+
+// fill entries with up to max files from directory slot *pos onwards, and move *pos past them.
+// returns the number of entries filled (0 = end of the directory)
+static int read_dir(int *pos, struct sfs_dirent *entries, int max) {
+	int n = 0;
+	for (; *pos < fs->num_files && n < max; (*pos)++) {
+		struct dir_entry *entry = &fs->directory[*pos];
+		if (!entry->occupied) {
+			continue; // removed files leave holes in the directory
+		}
+		strcpy(entries[n].name, entry->filename);
+		entries[n].inode = entry->inode;
+		entries[n].size = fs->inode_table[entry->inode].filesize;
+		entries[n].dir = fs->inode_table[entry->inode].dir;
+		n++;
+	}
+	return n;
+}
+
+int sfs_readdirplus_r(sfs_t *sfs, struct sfs_dir_cursor *cursor, struct sfs_dirent *entries, int max) {
+	fs = sfs;
+	trace(TRACE_READDIRPLUS, NULL, cursor->pos, max, 0, 0);
+	COUNT_OP(SFS_OP_READDIR, -1);
+	return read_dir(&cursor->pos, entries, max);
+}
+
+// the inode of the directory path names, or -1 if there's no such directory
+static int find_dir(const char *path) {
+	char name[MAXFILENAME + 1];
+	int where;
+	int dir = resolve(path, name);
+	if (dir >= 0 && name[0] != '\0') {
+		dir = lookup(dir, name, &where);
+	}
+	return dir >= 0 && (dir == ROOT_INODE || fs->inode_table[dir].dir) ? dir : -1;
+}
+
+int sfs_listdir_r(sfs_t *sfs, const char *path, struct sfs_dir_cursor *cursor, struct sfs_dirent *entries, int max) {
+	fs = sfs;
+	trace(TRACE_LISTDIR, path, cursor->pos, max, 0, 0);
+	COUNT_OP(SFS_OP_READDIR, -1);
+	int dir = find_dir(path);
+	if (dir == -1) {
+		printf("sfs_listdir error: directory %s not found.\n", path);
+		return -1;
+	}
+	if (dir == ROOT_INODE) {
+		return read_dir(&cursor->pos, entries, max);
+	}
+	return dir_list(dir, &cursor->pos, entries, max);
+}
+
+int sfs_getnextfilename_r(sfs_t *sfs, char* fname) {
+	fs = sfs;
+	trace(TRACE_GETNEXTFILENAME, NULL, 0, 0, 0, 0);
+	COUNT_OP(SFS_OP_READDIR, -1);
+	struct sfs_dirent entry;
+
+	// get next file in directory, copy its name into buffer. once every file has been listed, return 0
+	// and start again from the beginning next time
+	if (read_dir(&fs->get_next_file_num, &entry, 1) == 0) {
+		fs->get_next_file_num = 0;
+		return 0;
+	}
+	strcpy(fname, entry.name);
+	return 1;
+}
+
+int sfs_getfilesize_r(sfs_t *sfs, const char* path) {
+	fs = sfs;
+	trace(TRACE_GETFILESIZE, path, 0, 0, 0, 0);
+	COUNT_OP(SFS_OP_GETFILESIZE, -1);
+	char name[MAXFILENAME + 1];
+	int where;
+
+	// search directory for file and get its inode num
+	int dir = resolve(path, name);
+	int inode = dir < 0 || name[0] == '\0' ? -1 : lookup(dir, name, &where);
+
+	// if no directory entry is found, or it's a directory (which has no data), return -1
+	if (inode == -1 || fs->inode_table[inode].dir) {
 		return -1;
 	}
 	// get file size from file's inode
-	return inode_table[inode_num].filesize;
-}
\ No newline at end of file
+	return fs->inode_table[inode].filesize;
+}
+
+int sfs_stat_r(sfs_t *sfs, const char *path, struct sfs_dirent *entry) {
+	fs = sfs;
+	trace(TRACE_STAT, path, 0, 0, 0, 0);
+	COUNT_OP(SFS_OP_GETFILESIZE, -1);
+	int where;
+	int dir = resolve(path, entry->name);
+	int inode = dir < 0 ? -1 : entry->name[0] == '\0' ? ROOT_INODE : lookup(dir, entry->name, &where);
+	if (inode == -1) {
+		return -1;
+	}
+	entry->inode = inode;
+	entry->size = inode == ROOT_INODE ? 0 : fs->inode_table[inode].filesize;
+	entry->dir = inode == ROOT_INODE || fs->inode_table[inode].dir;
+	return 0;
+}
+
+void sfs_get_stats_r(sfs_t *sfs, struct sfs_stats *stats) {
+	memcpy(stats->ops, sfs->stats, sizeof(stats->ops));
+}
+
+static const char *op_names[SFS_OPS] = {
+	"mount", "fopen", "fclose", "fread", "fwrite", "pread", "pwrite", "fseek", "fmap", "remove", "clone",
+	"defrag", "import", "mkdir", "getfilesize", "readdir", "sync", "admin"
+};
+
+// upper bound in usec of the latency of the calls in s up to fraction of them (-1 = more than the last bucket)
+static long long latency_bound(const struct sfs_op_stats *s, double fraction) {
+	long long seen = 0;
+	for (int b = 0; b < SFS_LATENCY_BUCKETS - 1; b++) {
+		seen += s->latency[b];
+		if (seen >= fraction*s->calls) {
+			return 1LL << b;
+		}
+	}
+	return -1;
+}
+
+// one line for each kind of call made so far. returns the length of the whole text, like snprintf
+int sfs_stats_text(const struct sfs_stats *stats, char *buf, int size) {
+	int len = 0;
+	for (int op = 0; op < SFS_OPS; op++) {
+		const struct sfs_op_stats *s = &stats->ops[op];
+		if (s->calls == 0) {
+			continue;
+		}
+		len += snprintf(len < size ? buf + len : NULL, len < size ? size - len : 0,
+				"%-12s calls %lld  mean %.1f us  max %.1f us  p50 %lld us  p99 %lld us  bytes %lld  blocks %lld  meta %lld\n",
+				op_names[op], s->calls, s->ns/1000.0/s->calls, s->max_ns/1000.0, latency_bound(s, 0.5),
+				latency_bound(s, 0.99), s->bytes, s->blocks_allocated, s->meta_blocks);
+	}
+	if (size > 0 && len == 0) {
+		buf[0] = '\0';
+	}
+	return len;
+}
+
+// the original API works on the default file system
+int sfs_fopen(char *fname) {
+	return sfs_fopen_r(get_default_fs(), fname);
+}
+
+int sfs_fclose(int fileID) {
+	return sfs_fclose_r(get_default_fs(), fileID);
+}
+
+int sfs_remove(char* fname) {
+	return sfs_remove_r(get_default_fs(), fname);
+}
+
+int sfs_truncate(char *fname, int size) {
+	return sfs_truncate_r(get_default_fs(), fname, size);
+}
+
+int sfs_mkdir(char *path) {
+	return sfs_mkdir_r(get_default_fs(), path);
+}
+
+int sfs_rmdir(char *path) {
+	return sfs_rmdir_r(get_default_fs(), path);
+}
+
+int sfs_clone(char *src, char *dst) {
+	return sfs_clone_r(get_default_fs(), src, dst);
+}
+
+int sfs_defrag(char *fname) {
+	return sfs_defrag_r(get_default_fs(), fname);
+}
+
+int sfs_fwrite(int fileID, const char* buffer, int length) {
+	return sfs_fwrite_r(get_default_fs(), fileID, buffer, length);
+}
+
+int sfs_fread(int fileID, char* buffer, int length) {
+	return sfs_fread_r(get_default_fs(), fileID, buffer, length);
+}
+
+int sfs_pread(int fileID, char *buffer, int length, int offset) {
+	return sfs_pread_r(get_default_fs(), fileID, buffer, length, offset);
+}
+
+int sfs_pwrite(int fileID, const char *buffer, int length, int offset) {
+	return sfs_pwrite_r(get_default_fs(), fileID, buffer, length, offset);
+}
+
+int sfs_fmap(int fileID, int offset, int length, struct sfs_extent *extents, int max) {
+	return sfs_fmap_r(get_default_fs(), fileID, offset, length, extents, max);
+}
+
+int sfs_disk_fd() {
+	return sfs_disk_fd_r(get_default_fs());
+}
+
+int sfs_fseek(int fileID, int location) {
+	return sfs_fseek_r(get_default_fs(), fileID, location);
+}
+
+int sfs_fcompress(int fileID, int enable) {
+	return sfs_fcompress_r(get_default_fs(), fileID, enable);
+}
+
+void sfs_compress(int enable) {
+	sfs_compress_r(get_default_fs(), enable);
+}
+
+void sfs_dedup(int enable) {
+	sfs_dedup_r(get_default_fs(), enable);
+}
+
+int sfs_checksum(int enable) {
+	return sfs_checksum_r(get_default_fs(), enable);
+}
+
+void sfs_writeback(int enable) {
+	sfs_writeback_r(get_default_fs(), enable);
+}
+
+int sfs_sync() {
+	return sfs_sync_r(get_default_fs());
+}
+
+int sfs_fsync(int fileID) {
+	return sfs_fsync_r(get_default_fs(), fileID);
+}
+
+int sfs_snapshot(char *path) {
+	return sfs_snapshot_r(get_default_fs(), path);
+}
+
+int sfs_clean(int segments) {
+	return sfs_clean_r(get_default_fs(), segments);
+}
+
+int sfs_scrub() {
+	return sfs_scrub_r(get_default_fs());
+}
+
+int sfs_import(const struct sfs_import *files, int n) {
+	return sfs_import_r(get_default_fs(), files, n);
+}
+
+int sfs_fsck(int repair, struct sfs_fsck_report *report) {
+	return sfs_fsck_r(get_default_fs(), repair, report);
+}
+
+int sfs_getnextfilename(char* fname) {
+	return sfs_getnextfilename_r(get_default_fs(), fname);
+}
+
+int sfs_readdirplus(struct sfs_dir_cursor *cursor, struct sfs_dirent *entries, int max) {
+	return sfs_readdirplus_r(get_default_fs(), cursor, entries, max);
+}
+
+int sfs_listdir(const char *path, struct sfs_dir_cursor *cursor, struct sfs_dirent *entries, int max) {
+	return sfs_listdir_r(get_default_fs(), path, cursor, entries, max);
+}
+
+int sfs_getfilesize(const char* path) {
+	return sfs_getfilesize_r(get_default_fs(), path);
+}
+
+int sfs_stat(const char *path, struct sfs_dirent *entry) {
+	return sfs_stat_r(get_default_fs(), path, entry);
+}
+
+void sfs_get_stats(struct sfs_stats *stats) {
+	sfs_get_stats_r(get_default_fs(), stats);
+}
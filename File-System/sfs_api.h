@@ -19,6 +19,265 @@ int sfs_fread(int, char*, int);
 
 int sfs_fseek(int, int);
 
+// Positional I/O: sfs_pread/sfs_pwrite(fd, buf, length, offset) don't use or move the file pointer.
+int sfs_pread(int, char*, int, int);
+
+int sfs_pwrite(int, const char*, int, int);
+
+// Zero-copy reads: sfs_fmap(fd, offset, length, extents, max) says where a range of an open file is
+// stored in the disk image, which sfs_disk_fd() gives the file descriptor of. It returns the number
+// of extents filled (0 = end of file). An extent with pos -1 has to be read with sfs_pread.
+struct sfs_extent {
+    int offset;       // offset in the file
+    int length;
+    long long pos;    // byte offset in the disk image, or -1
+};
+
+int sfs_fmap(int, int, int, struct sfs_extent*, int);
+
+int sfs_disk_fd();
+
 int sfs_remove(char*);
 
+// sfs_truncate(name, size) makes a file size bytes long, open or not: the bytes past size are dropped,
+// or zeros are added up to it. Open files' positions past the new end move back to it. Returns -1 if
+// there's no such file, or it can't be that large.
+int sfs_truncate(char*, int);
+
+// Directories: a file name can be a path, with the names of the directories it's in separated by '/'
+// ("docs/notes.txt"; a leading '/' is ignored). A name on its own is in the root directory. sfs_mkdir
+// makes an empty directory and sfs_rmdir removes one; both return -1 on an error. Lookups, adding and
+// removing names take about the same time however large the directory is. A directory that outgrows
+// one table (about 10000 names) is split into up to 65536 of them, each using an inode, so it can hold
+// as many names as there are inodes left. sfs_getfilesize returns -1 for a directory, as directories
+// have no data to read; sfs_stat and sfs_listdir tell them apart.
+int sfs_mkdir(char*);
+
+int sfs_rmdir(char*);
+
+int sfs_clone(char*, char*);
+
+int sfs_defrag(char*);
+
+int sfs_fcompress(int, int);
+
+void sfs_compress(int);
+
+void sfs_dedup(int);
+
+int sfs_checksum(int);
+
+int sfs_scrub();
+
+// Bulk import: sfs_import(files, n) creates n new files with the given contents. Each file's data goes
+// to one run of free blocks with as few writes as possible, and the inode table, directory and free block
+// map are written once for the whole batch. Returns the number of files created (a file that exists
+// already, or has too long a name or too much data, is skipped).
+struct sfs_import {
+    const char *name;
+    const char *data;
+    int size;
+};
+
+int sfs_import(const struct sfs_import*, int);
+
+// Consistency check: sfs_fsck(0, &report) checks that the free block map and the reference counts match
+// the files' block pointers, and that the directory and the inode table agree. sfs_fsck(1, &report) also
+// fixes what it finds. It returns the number of problems found (-1 if any file is open), and fills in
+// the report if it isn't NULL.
+struct sfs_fsck_report {
+    int files;            // files checked
+    int bad_inodes;       // files with a bad size or block pointer (cut short before it)
+    int double_allocated; // blocks used more often than their reference count says (given the right count)
+    int leaked;           // blocks marked in use that nothing uses, or with too high a count (freed)
+    int unmarked;         // blocks in use that are marked free (marked in use)
+    int bad_entries;      // directory entries for free inodes, or a second entry for one (removed)
+    int orphans;          // inodes in use without a directory entry (freed)
+};
+
+int sfs_fsck(int, struct sfs_fsck_report*);
+
+int sfs_geometry(int, int);
+
+// Log-structured mode: sfs_logmode(1) makes the next fresh disk log-structured, so every write is
+// appended to a log. sfs_clean(n) frees up to n segments of it by moving their live blocks, and
+// returns how many it freed (the file system also does this itself when it runs low).
+void sfs_logmode(int);
+
+int sfs_clean(int);
+
+// Block groups: sfs_blockgroups(1) makes the next fresh disk keep a slice of the free block map and of
+// the inode table with every 1024 data blocks, and allocate each file's blocks next to its inode.
+void sfs_blockgroups(int);
+
+// Write-back: after sfs_writeback(1), writes return once the blocks are in memory, and a background
+// thread writes them to the disk a second later (sooner if many are dirty). sfs_sync() writes everything
+// out, and so does sfs_fsync(fd) (which returns -1 if fd isn't open). Unmounting also does.
+void sfs_writeback(int);
+
+int sfs_sync();
+
+int sfs_fsync(int);
+
+// RAM disk: a disk named ":memory:" is kept in memory and is gone once it's unmounted (the default
+// file system's stays until the program exits). ":memory:image" starts as a copy of the image file.
+// sfs_snapshot(path) saves the RAM disk to an image file, which can be mounted like any other disk.
+int sfs_snapshot(char*);
+
+// Tracing: sfs_trace(path) records every call made to any file system (its arguments, sizes and time, but
+// not the data) in a binary trace file, which sfs_replay can run again on a fresh disk. sfs_trace(NULL)
+// stops recording. A program run with SFS_TRACE=path set is traced from start to finish.
+int sfs_trace(const char*);
+
+// Statistics: every call is counted and timed, by kind, from when the file system is mounted (the default
+// one's from the start of the program). sfs_get_stats copies them out, and sfs_stats_text(stats, buf, size)
+// writes them as text, one line per kind of call, and returns the length of the text like snprintf.
+enum sfs_op {
+    SFS_OP_MOUNT,       // mksfs, sfs_mount
+    SFS_OP_FOPEN,
+    SFS_OP_FCLOSE,
+    SFS_OP_FREAD,
+    SFS_OP_FWRITE,      // sfs_fwrite, sfs_truncate
+    SFS_OP_PREAD,
+    SFS_OP_PWRITE,
+    SFS_OP_FSEEK,
+    SFS_OP_FMAP,
+    SFS_OP_REMOVE,
+    SFS_OP_CLONE,
+    SFS_OP_DEFRAG,
+    SFS_OP_IMPORT,
+    SFS_OP_MKDIR,       // sfs_mkdir, sfs_rmdir
+    SFS_OP_GETFILESIZE, // sfs_getfilesize, sfs_stat
+    SFS_OP_READDIR,     // sfs_getnextfilename, sfs_readdirplus, sfs_listdir
+    SFS_OP_SYNC,        // sfs_sync, sfs_fsync, sfs_snapshot
+    SFS_OP_ADMIN,       // sfs_fcompress, sfs_compress, sfs_dedup, sfs_checksum, sfs_scrub, sfs_fsck, sfs_clean, sfs_writeback
+    SFS_OPS
+};
+
+#define SFS_LATENCY_BUCKETS 24
+
+struct sfs_op_stats {
+    long long calls;
+    long long ns;               // total time spent in them
+    long long max_ns;
+    long long bytes;            // file data read or written
+    long long blocks_allocated;
+    long long meta_blocks;      // inode table, directory, free block map and other metadata blocks written
+    long long latency[SFS_LATENCY_BUCKETS]; // calls under 2^i usec (and at least 2^(i-1)), the last: the rest
+};
+
+struct sfs_stats {
+    struct sfs_op_stats ops[SFS_OPS];
+};
+
+void sfs_get_stats(struct sfs_stats*);
+
+int sfs_stats_text(const struct sfs_stats*, char*, int);
+
+// Bulk directory listing: sfs_readdirplus fills an array with the next files of the root directory
+// and their attributes, and returns how many it filled (0 = no more files). Each caller keeps
+// its own cursor, which starts at { 0 }. sfs_listdir(path, cursor, entries, max) does the same for
+// any directory (-1 = no such directory). Names added to a directory while it's listed may make
+// others be listed twice or not at all.
+struct sfs_dirent {
+    char name[MAXFILENAME + 1];
+    int inode;
+    int size;
+    int dir;          // a directory
+};
+
+struct sfs_dir_cursor {
+    int pos;
+};
+
+int sfs_readdirplus(struct sfs_dir_cursor*, struct sfs_dirent*, int);
+
+int sfs_listdir(const char*, struct sfs_dir_cursor*, struct sfs_dirent*, int);
+
+// sfs_stat(path, &entry) fills in the attributes of a file or directory ("" or "/" is the root
+// directory), and returns -1 if there's no such file.
+int sfs_stat(const char*, struct sfs_dirent*);
+
+// Handle API: several file systems can be mounted at once, each on its own disk image.
+// The functions above work on a default file system on sfs_disk.
+typedef struct sfs sfs_t;
+
+struct sfs_opts {
+    int fresh;        // make a new empty disk instead of mounting the existing one
+    int max_files;    // geometry of a new disk (0 = default)
+    int data_blocks;
+    int log_structured; // a new disk is log-structured
+    int block_groups;   // a new disk has block groups
+};
+
+sfs_t *sfs_mount(const char*, const struct sfs_opts*);
+
+void sfs_unmount(sfs_t*);
+
+int sfs_getnextfilename_r(sfs_t*, char*);
+
+int sfs_readdirplus_r(sfs_t*, struct sfs_dir_cursor*, struct sfs_dirent*, int);
+
+int sfs_getfilesize_r(sfs_t*, const char*);
+
+int sfs_fopen_r(sfs_t*, char*);
+
+int sfs_fclose_r(sfs_t*, int);
+
+int sfs_fwrite_r(sfs_t*, int, const char*, int);
+
+int sfs_fread_r(sfs_t*, int, char*, int);
+
+int sfs_fseek_r(sfs_t*, int, int);
+
+int sfs_pread_r(sfs_t*, int, char*, int, int);
+
+int sfs_pwrite_r(sfs_t*, int, const char*, int, int);
+
+int sfs_fmap_r(sfs_t*, int, int, int, struct sfs_extent*, int);
+
+int sfs_disk_fd_r(sfs_t*);
+
+int sfs_remove_r(sfs_t*, char*);
+
+int sfs_truncate_r(sfs_t*, char*, int);
+
+int sfs_mkdir_r(sfs_t*, char*);
+
+int sfs_rmdir_r(sfs_t*, char*);
+
+int sfs_listdir_r(sfs_t*, const char*, struct sfs_dir_cursor*, struct sfs_dirent*, int);
+
+int sfs_stat_r(sfs_t*, const char*, struct sfs_dirent*);
+
+int sfs_clone_r(sfs_t*, char*, char*);
+
+int sfs_defrag_r(sfs_t*, char*);
+
+int sfs_fcompress_r(sfs_t*, int, int);
+
+void sfs_compress_r(sfs_t*, int);
+
+void sfs_dedup_r(sfs_t*, int);
+
+int sfs_checksum_r(sfs_t*, int);
+
+int sfs_scrub_r(sfs_t*);
+
+int sfs_fsck_r(sfs_t*, int, struct sfs_fsck_report*);
+
+int sfs_import_r(sfs_t*, const struct sfs_import*, int);
+
+int sfs_clean_r(sfs_t*, int);
+
+void sfs_writeback_r(sfs_t*, int);
+
+int sfs_sync_r(sfs_t*);
+
+int sfs_fsync_r(sfs_t*, int);
+
+int sfs_snapshot_r(sfs_t*, char*);
+
+void sfs_get_stats_r(sfs_t*, struct sfs_stats*);
+
 #endif
@@ -0,0 +1,255 @@
+/* sfs_bench.c
+ *
+ * Throughput and latency benchmark for the file system. Measures
+ * sequential and random reads and writes for several I/O sizes, small
+ * appends, create/open/stat/remove rates and mount time, and prints the
+ * results as JSON together with the block I/O done per operation.
+ *
+ * Usage: sfs_bench [output.json]   (stdout if no file is given)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+#define FILE_BYTES (256 * 1024)   /* Fits in the direct + indirect blocks */
+#define APPEND_SIZE 64
+#define APPEND_COUNT 2000
+#define META_FILES 90             /* Leaves room below the 100 file limit */
+#define MOUNT_REPS 10
+#define IMPORT_SIZE 16384
+#define SEED 42
+
+static int io_sizes[] = { 64, 1024, 4096, 16384, 65536 };
+
+static FILE *out;
+static int first_result = 1;
+static struct disk_io_stats start_io;
+static double start_time;
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* begin() - start timing one benchmark.
+ */
+static void begin(void)
+{
+  get_io_stats(&start_io);
+  start_time = now();
+}
+
+/* report() - finish the benchmark started by begin() and print it as one
+ * JSON object. bytes is 0 for benchmarks without a throughput.
+ */
+static void report(char *name, int io_size, long ops, long bytes)
+{
+  double secs = now() - start_time;
+  struct disk_io_stats io;
+
+  get_io_stats(&io);
+  if (secs <= 0) {
+    secs = 1e-9;
+  }
+  fprintf(out, "%s    {\"name\": \"%s\", \"io_size\": %d, \"ops\": %ld, "
+          "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"usec_per_op\": %.2f, "
+          "\"mb_per_sec\": %.3f, \"reads_per_op\": %.3f, \"writes_per_op\": %.3f, "
+          "\"blocks_read_per_op\": %.3f, \"blocks_written_per_op\": %.3f}",
+          first_result ? "" : ",\n", name, io_size, ops, secs, ops / secs,
+          secs * 1e6 / ops, bytes / secs / (1024 * 1024),
+          (double)(io.reads - start_io.reads) / ops,
+          (double)(io.writes - start_io.writes) / ops,
+          (double)(io.blocks_read - start_io.blocks_read) / ops,
+          (double)(io.blocks_written - start_io.blocks_written) / ops);
+  first_result = 0;
+}
+
+static void bench_mount(void)
+{
+  int i;
+
+  begin();
+  for (i = 0; i < MOUNT_REPS; i++) {
+    close_disk();
+    mksfs(1);
+  }
+  report("mount_fresh", 0, MOUNT_REPS, 0);
+
+  begin();
+  for (i = 0; i < MOUNT_REPS; i++) {
+    close_disk();
+    mksfs(0);
+  }
+  report("mount_existing", 0, MOUNT_REPS, 0);
+}
+
+/* bench_io() - sequential then random writes and reads of one file in
+ * chunks of io_size bytes.
+ */
+static void bench_io(int io_size, char *buf)
+{
+  long ops = FILE_BYTES / io_size;
+  long i;
+  int fd;
+
+  fd = sfs_fopen("bench.dat");
+
+  begin();
+  for (i = 0; i < ops; i++) {
+    sfs_fwrite(fd, buf + i * io_size, io_size);
+  }
+  report("seq_write", io_size, ops, ops * io_size);
+
+  begin();
+  sfs_fseek(fd, 0);
+  for (i = 0; i < ops; i++) {
+    sfs_fread(fd, buf + i * io_size, io_size);
+  }
+  report("seq_read", io_size, ops, ops * io_size);
+
+  srand(SEED);
+  begin();
+  for (i = 0; i < ops; i++) {
+    long off = (rand() % ops) * io_size;
+    sfs_fseek(fd, off);
+    sfs_fwrite(fd, buf + off, io_size);
+  }
+  report("rand_write", io_size, ops, ops * io_size);
+
+  srand(SEED + 1);
+  begin();
+  for (i = 0; i < ops; i++) {
+    long off = (rand() % ops) * io_size;
+    sfs_fseek(fd, off);
+    sfs_fread(fd, buf + off, io_size);
+  }
+  report("rand_read", io_size, ops, ops * io_size);
+
+  sfs_fclose(fd);
+  sfs_remove("bench.dat");
+}
+
+static void bench_append(char *name, char *buf)
+{
+  int fd, i;
+
+  fd = sfs_fopen("append.dat");
+  begin();
+  for (i = 0; i < APPEND_COUNT; i++) {
+    sfs_fwrite(fd, buf + i * APPEND_SIZE, APPEND_SIZE);
+  }
+  report(name, APPEND_SIZE, APPEND_COUNT, (long)APPEND_COUNT * APPEND_SIZE);
+  sfs_fclose(fd);
+  sfs_remove("append.dat");
+}
+
+/* bench_meta() - create, reopen, stat and remove a directory's worth of
+ * empty files. A create or open counts the sfs_fopen and its sfs_fclose.
+ */
+static void bench_meta(void)
+{
+  char names[META_FILES][16];
+  int i;
+
+  for (i = 0; i < META_FILES; i++) {
+    sprintf(names[i], "meta%03d.txt", i);
+  }
+
+  begin();
+  for (i = 0; i < META_FILES; i++) {
+    sfs_fclose(sfs_fopen(names[i]));
+  }
+  report("create", 0, META_FILES, 0);
+
+  begin();
+  for (i = 0; i < META_FILES; i++) {
+    sfs_fclose(sfs_fopen(names[i]));
+  }
+  report("open", 0, META_FILES, 0);
+
+  begin();
+  for (i = 0; i < META_FILES; i++) {
+    sfs_getfilesize(names[i]);
+  }
+  report("stat", 0, META_FILES, 0);
+
+  begin();
+  for (i = 0; i < META_FILES; i++) {
+    sfs_remove(names[i]);
+  }
+  report("remove", 0, META_FILES, 0);
+}
+
+/* bench_import() - create a directory's worth of files with one
+ * sfs_import batch. An op is one file.
+ */
+static void bench_import(char *buf)
+{
+  struct sfs_import files[META_FILES];
+  char names[META_FILES][16];
+  int i;
+
+  for (i = 0; i < META_FILES; i++) {
+    sprintf(names[i], "imp%03d.dat", i);
+    files[i].name = names[i];
+    files[i].data = buf + i * APPEND_SIZE;
+    files[i].size = IMPORT_SIZE;
+  }
+  begin();
+  sfs_import(files, META_FILES);
+  report("import", IMPORT_SIZE, META_FILES, (long)META_FILES * IMPORT_SIZE);
+  for (i = 0; i < META_FILES; i++) {
+    sfs_remove(names[i]);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  char *buf = malloc(FILE_BYTES);
+  int i;
+
+  out = stdout;
+  if (argc > 1 && (out = fopen(argv[1], "w")) == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  for (i = 0; i < FILE_BYTES; i++) {
+    buf[i] = (char)(i * 31 + i / 1024);
+  }
+
+  fprintf(out, "{\n  \"benchmark\": \"sfs_bench\",\n  \"file_bytes\": %d,\n  \"results\": [\n",
+          FILE_BYTES);
+  bench_mount();
+  for (i = 0; i < sizeof(io_sizes) / sizeof(io_sizes[0]); i++) {
+    bench_io(io_sizes[i], buf);
+  }
+  bench_append("small_append", buf);
+
+  /* The same appends with write-back, which returns before the disk is written */
+  sfs_writeback(1);
+  bench_append("small_append_writeback", buf);
+  sfs_writeback(0);
+  bench_meta();
+  bench_import(buf);
+
+  /* The same appends on a log-structured disk */
+  sfs_logmode(1);
+  close_disk();
+  mksfs(1);
+  bench_append("small_append_log", buf);
+  fprintf(out, "\n  ]\n}\n");
+
+  if (out != stdout) {
+    fclose(out);
+  }
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,240 @@
+/* sfs_cp.c
+ *
+ * Bulk copy between a host directory and a disk image.
+ *
+ * Usage: sfs_cp -i dir [disk]   copy every regular file in dir into the
+ *                                disk (sfs_disk unless one is named)
+ *        sfs_cp -n dir [disk]   the same into a new disk just big enough
+ *                                for the files
+ *        sfs_cp -o dir [disk]   copy every file on the disk into dir,
+ *                                with its subdirectories
+ *
+ * Imports go through sfs_import, a batch of files at a time, so each
+ * file is written to one run of blocks and the metadata is only written
+ * once per batch. Exits with 1 if any file couldn't be copied.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "sfs_api.h"
+
+#define BATCH_BYTES (16 * 1024 * 1024)  /* file data read per sfs_import call */
+#define BATCH_FILES 256
+#define MAX_FILE_BYTES (268 * 1024)
+#define SLACK_BLOCKS 16                 /* extra data blocks on a new disk */
+
+/* host_path() - dir/name in a buffer of its own.
+ */
+static char *host_path(char *dir, char *name)
+{
+  char *path = malloc(strlen(dir) + strlen(name) + 2);
+
+  sprintf(path, "%s/%s", dir, name);
+  return path;
+}
+
+/* read_host_file() - read a whole host file into memory.
+ * Returns NULL if it can't be read.
+ */
+static char *read_host_file(char *path, int size)
+{
+  char *data = malloc(size > 0 ? size : 1);
+  FILE *fp = fopen(path, "rb");
+
+  if (fp == NULL || (int)fread(data, 1, size, fp) != size) {
+    fprintf(stderr, "sfs_cp: can't read %s\n", path);
+    free(data);
+    data = NULL;
+  }
+  if (fp != NULL) {
+    fclose(fp);
+  }
+  return data;
+}
+
+/* new_disk() - make a disk with room for every regular file in dir.
+ */
+static sfs_t *new_disk(char *dir, char *disk)
+{
+  struct sfs_opts opts = { 1, 0, SLACK_BLOCKS };
+  struct dirent *ent;
+  struct stat st;
+  DIR *d = opendir(dir);
+
+  if (d == NULL) {
+    perror(dir);
+    return NULL;
+  }
+  while ((ent = readdir(d)) != NULL) {
+    char *path = host_path(dir, ent->d_name);
+
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+      int blocks = (st.st_size + 1023) / 1024;
+
+      opts.max_files++;
+      opts.data_blocks += blocks + (blocks > 12);
+    }
+    free(path);
+  }
+  closedir(d);
+  if (opts.max_files == 0) {
+    opts.max_files = 1;
+  }
+  return sfs_mount(disk, &opts);
+}
+
+/* import_dir() - copy every regular file in dir into the disk.
+ * Returns the number of files that couldn't be copied.
+ */
+static int import_dir(sfs_t *fs, char *dir)
+{
+  struct sfs_import batch[BATCH_FILES];
+  struct dirent *ent;
+  struct stat st;
+  long bytes = 0;
+  int n = 0, failed = 0, done = 0;
+  int i;
+  DIR *d = opendir(dir);
+
+  if (d == NULL) {
+    perror(dir);
+    return 1;
+  }
+  while (!done) {
+    char *path;
+
+    ent = readdir(d);
+    done = ent == NULL;
+    if (!done) {
+      path = host_path(dir, ent->d_name);
+      if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        free(path);
+        continue;
+      }
+      if (st.st_size > MAX_FILE_BYTES) {
+        fprintf(stderr, "sfs_cp: %s is too large\n", path);
+        failed++;
+        free(path);
+        continue;
+      }
+      batch[n].name = strdup(ent->d_name);
+      batch[n].size = st.st_size;
+      batch[n].data = read_host_file(path, st.st_size);
+      free(path);
+      if (batch[n].data == NULL) {
+        free((char *)batch[n].name);
+        failed++;
+        continue;
+      }
+      bytes += st.st_size;
+      n++;
+    }
+
+    /* Import a batch once it's full, and what's left at the end */
+    if (n > 0 && (done || n == BATCH_FILES || bytes >= BATCH_BYTES)) {
+      failed += n - sfs_import_r(fs, batch, n);
+      for (i = 0; i < n; i++) {
+        free((char *)batch[i].name);
+        free((char *)batch[i].data);
+      }
+      n = 0;
+      bytes = 0;
+    }
+  }
+  closedir(d);
+  return failed;
+}
+
+/* export_dir() - copy every file in directory path of the disk ("" for
+ * the root directory) into host directory dir, and each subdirectory
+ * into a host directory of its own, made with mkdir.
+ * Returns the number of files that couldn't be copied.
+ */
+static int export_dir(sfs_t *fs, char *path, char *dir, char *buf)
+{
+  struct sfs_dir_cursor cursor = { 0 };
+  struct sfs_dirent entries[64];
+  int failed = 0;
+  int n, i;
+
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    perror(dir);
+    return 1;
+  }
+  while ((n = sfs_listdir_r(fs, path, &cursor, entries, 64)) > 0) {
+    for (i = 0; i < n; i++) {
+      char *name = path[0] == '\0' ? strdup(entries[i].name) : host_path(path, entries[i].name);
+      char *host = host_path(dir, entries[i].name);
+      int fd;
+      FILE *fp;
+
+      if (entries[i].dir) {
+        failed += export_dir(fs, name, host, buf);
+        free(name);
+        free(host);
+        continue;
+      }
+      fd = sfs_fopen_r(fs, name);
+      fp = fd < 0 ? NULL : fopen(host, "wb");
+      if (fd < 0 || fp == NULL ||
+          (entries[i].size > 0 && sfs_pread_r(fs, fd, buf, entries[i].size, 0) != entries[i].size) ||
+          (int)fwrite(buf, 1, entries[i].size, fp) != entries[i].size) {
+        fprintf(stderr, "sfs_cp: can't copy %s to %s\n", name, host);
+        failed++;
+      }
+      if (fd >= 0) {
+        sfs_fclose_r(fs, fd);
+      }
+      if (fp != NULL) {
+        fclose(fp);
+      }
+      free(name);
+      free(host);
+    }
+  }
+  if (n < 0) {
+    fprintf(stderr, "sfs_cp: can't list %s\n", path[0] == '\0' ? "/" : path);
+    failed++;
+  }
+  return failed;
+}
+
+/* export_disk() - copy every file on the disk into dir, keeping its
+ * directories.
+ * Returns the number of files that couldn't be copied.
+ */
+static int export_disk(sfs_t *fs, char *dir)
+{
+  char *buf = malloc(MAX_FILE_BYTES);
+  int failed = export_dir(fs, "", dir, buf);
+
+  free(buf);
+  return failed;
+}
+
+int
+main(int argc, char **argv)
+{
+  char *disk = argc > 3 ? argv[3] : "sfs_disk";
+  int failed;
+  sfs_t *fs;
+
+  if (argc < 3 || (strcmp(argv[1], "-i") != 0 && strcmp(argv[1], "-n") != 0 && strcmp(argv[1], "-o") != 0)) {
+    fprintf(stderr, "usage: sfs_cp -i|-n|-o dir [disk]\n");
+    return 2;
+  }
+  fs = strcmp(argv[1], "-n") == 0 ? new_disk(argv[2], disk) : sfs_mount(disk, NULL);
+  if (fs == NULL) {
+    return 2;
+  }
+  failed = strcmp(argv[1], "-o") == 0 ? export_disk(fs, argv[2]) : import_dir(fs, argv[2]);
+  sfs_unmount(fs);
+  if (failed > 0) {
+    fprintf(stderr, "sfs_cp: %d files not copied\n", failed);
+  }
+  return failed > 0;
+}
@@ -0,0 +1,24 @@
+/* sfs_defrag.c
+ *
+ * Offline defragmenter. Mounts the existing sfs_disk and rewrites each
+ * fragmented file (or only the file named on the command line) into one
+ * contiguous run of blocks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sfs_api.h"
+
+int
+main(int argc, char **argv)
+{
+  int moved;
+
+  mksfs(0);
+  moved = sfs_defrag(argc > 1 ? argv[1] : NULL);
+  if (moved < 0) {
+    return 1;
+  }
+  printf("sfs_defrag: moved %d blocks\n", moved);
+  return 0;
+}
@@ -0,0 +1,52 @@
+/* sfs_fsck.c
+ *
+ * Offline consistency checker. Mounts an existing disk (sfs_disk unless
+ * one is named on the command line), checks the free block map and the
+ * reference counts against the files' block pointers and the directory
+ * against the inode table, and with -r repairs what it finds.
+ *
+ * Usage: sfs_fsck [-r] [disk]
+ * Exits with 0 if the disk is consistent, 1 if problems were found (and
+ * repaired with -r), 2 if the disk couldn't be checked.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+
+int
+main(int argc, char **argv)
+{
+  struct sfs_fsck_report report;
+  char *disk = "sfs_disk";
+  int repair = 0;
+  int problems, i;
+  sfs_t *fs;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-r") == 0) {
+      repair = 1;
+    }
+    else {
+      disk = argv[i];
+    }
+  }
+  fs = sfs_mount(disk, NULL);
+  if (fs == NULL) {
+    return 2;
+  }
+  problems = sfs_fsck_r(fs, repair, &report);
+  if (problems < 0) {
+    sfs_unmount(fs);
+    return 2;
+  }
+  printf("sfs_fsck: %d files, %d problems%s\n", report.files, problems,
+         problems > 0 && repair ? " (repaired)" : "");
+  printf("  bad inodes: %d\n  double allocated blocks: %d\n  leaked blocks: %d\n"
+         "  in use but marked free: %d\n  bad directory entries: %d\n  orphaned inodes: %d\n",
+         report.bad_inodes, report.double_allocated, report.leaked, report.unmarked,
+         report.bad_entries, report.orphans);
+  sfs_unmount(fs);
+  return problems > 0;
+}
@@ -0,0 +1,519 @@
+/* sfs_replay.c
+ *
+ * Runs a trace recorded with sfs_trace (or SFS_TRACE=file) again on fresh
+ * disks, one for each file system in the trace, and prints the throughput
+ * and the latency of each kind of call as JSON.
+ *
+ * Usage: sfs_replay [-t] trace [output.json]   (stdout if no file is given)
+ *
+ * Calls are replayed one after another from a single thread, as fast as
+ * they go, or with -t at the times they were first made. Writes are done
+ * with made-up data of the recorded sizes. The disks are called
+ * replay_disk.1, replay_disk.2, ... and are removed at the end.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sfs_api.h"
+#include "sfs_trace.h"
+
+#define MAX_NAME 4096       /* File names are paths */
+
+static char *op_names[TRACE_OPS] = {
+  NULL, "mksfs", "mount", "unmount", "geometry", "logmode", "blockgroups",
+  "fopen", "fclose", "fwrite", "fread", "fseek", "pread", "pwrite", "fmap",
+  "remove", "clone", "defrag", "import", "import_file", "fcompress",
+  "compress", "dedup", "checksum", "scrub", "fsck", "clean", "writeback",
+  "sync", "fsync", "snapshot", "readdirplus", "getnextfilename", "getfilesize",
+  "mkdir", "rmdir", "listdir", "stat", "truncate"
+};
+
+/* One file system of the trace. The legacy calls (mksfs, sfs_geometry,
+ * ...) are replayed with sfs_mount, so the geometry and modes they set
+ * are kept here until the next mount.
+ */
+struct replay_fs {
+  sfs_t *fs;
+  struct sfs_opts opts;
+  int *fds;           /* replayed fd of each fd in the trace (-1 = none) */
+  int nfds;
+};
+
+/* Latencies of one kind of call, in usec */
+struct op_stats {
+  double *usec;
+  long count;
+  long cap;
+  long long bytes;
+};
+
+static struct replay_fs *fss;
+static int nfss;
+static struct op_stats stats[TRACE_OPS];
+static char *data;
+static int data_size;
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void disk_name(char *buf, int id)
+{
+  sprintf(buf, "replay_disk.%d", id);
+}
+
+/* get_fs() - the file system numbered id in the trace, grown as new ones
+ * turn up.
+ */
+static struct replay_fs *get_fs(int id)
+{
+  int i;
+
+  if (id >= nfss) {
+    fss = realloc(fss, (id + 1) * sizeof(*fss));
+    for (i = nfss; i <= id; i++) {
+      memset(&fss[i], 0, sizeof(fss[i]));
+    }
+    nfss = id + 1;
+  }
+  return &fss[id];
+}
+
+/* mount() - (re)mount a file system of the trace. The first mount of
+ * each one always makes a fresh disk.
+ */
+static void mount(int id, int fresh)
+{
+  struct replay_fs *r = get_fs(id);
+  char name[32];
+
+  disk_name(name, id);
+  if (r->fs != NULL) {
+    sfs_unmount(r->fs);
+  }
+  r->opts.fresh = fresh || r->fds == NULL;
+  r->fs = sfs_mount(name, &r->opts);
+  if (r->fds == NULL) {
+    r->fds = malloc(sizeof(int));
+    r->fds[0] = -1;
+    r->nfds = 1;
+  }
+}
+
+/* get_mounted() - the file system a call is made on, mounted fresh if the
+ * trace began after it was mounted.
+ */
+static sfs_t *get_mounted(int id)
+{
+  if (get_fs(id)->fs == NULL) {
+    mount(id, 1);
+  }
+  return fss[id].fs;
+}
+
+/* map_fd() - the replayed fd of an fd in the trace. fds opened before the
+ * trace began are used as they are.
+ */
+static int map_fd(int id, int fd)
+{
+  struct replay_fs *r = get_fs(id);
+
+  if (fd >= 0 && fd < r->nfds && r->fds[fd] >= 0) {
+    return r->fds[fd];
+  }
+  return fd;
+}
+
+static void set_fd(int id, int fd, int replayed)
+{
+  struct replay_fs *r = get_fs(id);
+  int i;
+
+  if (fd < 0) {
+    return;
+  }
+  if (fd >= r->nfds) {
+    r->fds = realloc(r->fds, (fd + 1) * sizeof(int));
+    for (i = r->nfds; i <= fd; i++) {
+      r->fds[i] = -1;
+    }
+    r->nfds = fd + 1;
+  }
+  r->fds[fd] = replayed;
+}
+
+/* get_data() - a buffer of at least size bytes of made-up file data.
+ */
+static char *get_data(int size)
+{
+  int i;
+
+  if (size > data_size) {
+    data = realloc(data, size);
+    for (i = data_size; i < size; i++) {
+      data[i] = (char)(i * 31 + i / 1024);
+    }
+    data_size = size;
+  }
+  return data;
+}
+
+static int read_record(FILE *fp, struct trace_record *rec, char *name)
+{
+  if (fread(rec, sizeof(*rec), 1, fp) != 1 || rec->op == 0 || rec->op >= TRACE_OPS ||
+      rec->name_len >= MAX_NAME || fread(name, 1, rec->name_len, fp) != rec->name_len) {
+    return 0;
+  }
+  name[rec->name_len] = '\0';
+  return 1;
+}
+
+/* replay_import() - replay an sfs_import of n files, which are the next n
+ * records of the trace. Returns the bytes imported (-1 = the trace ends).
+ */
+static long long replay_import(FILE *fp, sfs_t *fs, int n)
+{
+  struct sfs_import *files = malloc((n > 0 ? n : 1) * sizeof(*files));
+  char name[MAX_NAME];
+  struct trace_record rec;
+  long long bytes = 0;
+  int i, count;
+
+  for (i = 0; i < n; i++) {
+    if (!read_record(fp, &rec, name) || rec.op != TRACE_IMPORT_FILE) {
+      bytes = -1;
+      break;
+    }
+    files[i].name = strdup(name);
+    files[i].size = rec.args[0];
+    files[i].data = get_data(rec.args[0]);
+    bytes += rec.args[0];
+  }
+  if (bytes >= 0) {
+    sfs_import_r(fs, files, n);
+  }
+  for (count = i, i = 0; i < count; i++) {
+    free((char *)files[i].name);
+  }
+  free(files);
+  return bytes;
+}
+
+/* replay() - make one call of the trace. Returns the bytes it read or
+ * wrote (-1 = the trace ends).
+ */
+static long long replay(FILE *fp, struct trace_record *rec, char *name)
+{
+  struct replay_fs *r = get_fs(rec->fs);
+  int *a = rec->args;
+  long long bytes = 0;
+  sfs_t *fs;
+
+  switch (rec->op) {
+  case TRACE_MKSFS:
+    mount(rec->fs, a[0]);
+    return 0;
+  case TRACE_MOUNT:
+    r->opts.max_files = a[1];
+    r->opts.data_blocks = a[2];
+    r->opts.log_structured = (a[0] & TRACE_LOG) != 0;
+    r->opts.block_groups = (a[0] & TRACE_GROUPS) != 0;
+    mount(rec->fs, a[0] & TRACE_FRESH);
+    return 0;
+  case TRACE_UNMOUNT:
+    if (r->fs != NULL) {
+      sfs_unmount(r->fs);
+      r->fs = NULL;
+    }
+    return 0;
+  case TRACE_GEOMETRY:
+    r->opts.max_files = a[0];
+    r->opts.data_blocks = a[1];
+    return 0;
+  case TRACE_LOGMODE:
+    r->opts.log_structured = a[0];
+    return 0;
+  case TRACE_BLOCKGROUPS:
+    r->opts.block_groups = a[0];
+    return 0;
+  }
+
+  fs = get_mounted(rec->fs);
+  if (fs == NULL) {
+    return 0;
+  }
+  switch (rec->op) {
+  case TRACE_FOPEN:
+    set_fd(rec->fs, a[0], sfs_fopen_r(fs, name));
+    break;
+  case TRACE_FCLOSE:
+    sfs_fclose_r(fs, map_fd(rec->fs, a[0]));
+    break;
+  case TRACE_FWRITE:
+    bytes = sfs_fwrite_r(fs, map_fd(rec->fs, a[0]), get_data(a[1]), a[1]);
+    break;
+  case TRACE_FREAD:
+    bytes = sfs_fread_r(fs, map_fd(rec->fs, a[0]), get_data(a[1]), a[1]);
+    break;
+  case TRACE_FSEEK:
+    sfs_fseek_r(fs, map_fd(rec->fs, a[0]), a[1]);
+    break;
+  case TRACE_PREAD:
+    bytes = sfs_pread_r(fs, map_fd(rec->fs, a[0]), get_data(a[1]), a[1], a[2]);
+    break;
+  case TRACE_PWRITE:
+    bytes = sfs_pwrite_r(fs, map_fd(rec->fs, a[0]), get_data(a[1]), a[1], a[2]);
+    break;
+  case TRACE_FMAP: {
+    struct sfs_extent *extents = malloc((a[3] > 0 ? a[3] : 1) * sizeof(*extents));
+
+    sfs_fmap_r(fs, map_fd(rec->fs, a[0]), a[1], a[2], extents, a[3]);
+    free(extents);
+    break;
+  }
+  case TRACE_REMOVE:
+    sfs_remove_r(fs, name);
+    break;
+  case TRACE_CLONE:
+    sfs_clone_r(fs, name, name + strlen(name) + 1);
+    break;
+  case TRACE_DEFRAG:
+    sfs_defrag_r(fs, rec->name_len > 0 ? name : NULL);
+    break;
+  case TRACE_IMPORT:
+    return replay_import(fp, fs, a[0]);
+  case TRACE_FCOMPRESS:
+    sfs_fcompress_r(fs, map_fd(rec->fs, a[0]), a[1]);
+    break;
+  case TRACE_COMPRESS:
+    sfs_compress_r(fs, a[0]);
+    break;
+  case TRACE_DEDUP:
+    sfs_dedup_r(fs, a[0]);
+    break;
+  case TRACE_CHECKSUM:
+    sfs_checksum_r(fs, a[0]);
+    break;
+  case TRACE_SCRUB:
+    sfs_scrub_r(fs);
+    break;
+  case TRACE_FSCK: {
+    struct sfs_fsck_report report;
+
+    sfs_fsck_r(fs, a[0], &report);
+    break;
+  }
+  case TRACE_CLEAN:
+    sfs_clean_r(fs, a[0]);
+    break;
+  case TRACE_WRITEBACK:
+    sfs_writeback_r(fs, a[0]);
+    break;
+  case TRACE_SYNC:
+    sfs_sync_r(fs);
+    break;
+  case TRACE_FSYNC:
+    sfs_fsync_r(fs, map_fd(rec->fs, a[0]));
+    break;
+  case TRACE_SNAPSHOT: {
+    char path[32];
+
+    /* Not over the image the trace saved */
+    sprintf(path, "replay_snapshot.%d", rec->fs);
+    sfs_snapshot_r(fs, path);
+    remove(path);
+    break;
+  }
+  case TRACE_READDIRPLUS: {
+    struct sfs_dir_cursor cursor;
+    struct sfs_dirent *entries = malloc((a[1] > 0 ? a[1] : 1) * sizeof(*entries));
+
+    cursor.pos = a[0];
+    sfs_readdirplus_r(fs, &cursor, entries, a[1]);
+    free(entries);
+    break;
+  }
+  case TRACE_GETNEXTFILENAME: {
+    char fname[MAXFILENAME + 1];
+
+    sfs_getnextfilename_r(fs, fname);
+    break;
+  }
+  case TRACE_GETFILESIZE:
+    sfs_getfilesize_r(fs, name);
+    break;
+  case TRACE_MKDIR:
+    sfs_mkdir_r(fs, name);
+    break;
+  case TRACE_RMDIR:
+    sfs_rmdir_r(fs, name);
+    break;
+  case TRACE_LISTDIR: {
+    struct sfs_dir_cursor cursor;
+    struct sfs_dirent *entries = malloc((a[1] > 0 ? a[1] : 1) * sizeof(*entries));
+
+    cursor.pos = a[0];
+    sfs_listdir_r(fs, name, &cursor, entries, a[1]);
+    free(entries);
+    break;
+  }
+  case TRACE_STAT: {
+    struct sfs_dirent entry;
+
+    sfs_stat_r(fs, name, &entry);
+    break;
+  }
+  case TRACE_TRUNCATE:
+    sfs_truncate_r(fs, name, a[0]);
+    break;
+  }
+  return bytes > 0 ? bytes : 0;
+}
+
+static void add_latency(int op, double usec, long long bytes)
+{
+  struct op_stats *s = &stats[op];
+
+  if (s->count == s->cap) {
+    s->cap = s->cap > 0 ? 2 * s->cap : 64;
+    s->usec = realloc(s->usec, s->cap * sizeof(double));
+  }
+  s->usec[s->count++] = usec;
+  s->bytes += bytes;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* report() - print the totals and the latencies of each kind of call.
+ */
+static void report(FILE *out, char *trace, int timed, double secs)
+{
+  long ops = 0;
+  long long bytes = 0;
+  int first = 1;
+  int op;
+
+  for (op = 1; op < TRACE_OPS; op++) {
+    ops += stats[op].count;
+    bytes += stats[op].bytes;
+  }
+  if (secs <= 0) {
+    secs = 1e-9;
+  }
+  fprintf(out, "{\n  \"trace\": \"%s\",\n  \"timing\": \"%s\",\n  \"ops\": %ld,\n  \"seconds\": %.6f,\n"
+          "  \"ops_per_sec\": %.1f,\n  \"mb_per_sec\": %.3f,\n  \"results\": [\n",
+          trace, timed ? "original" : "fast", ops, secs, ops / secs, bytes / secs / (1024 * 1024));
+  for (op = 1; op < TRACE_OPS; op++) {
+    struct op_stats *s = &stats[op];
+    double total = 0;
+    long i;
+
+    if (s->count == 0) {
+      continue;
+    }
+    qsort(s->usec, s->count, sizeof(double), cmp_double);
+    for (i = 0; i < s->count; i++) {
+      total += s->usec[i];
+    }
+    fprintf(out, "%s    {\"op\": \"%s\", \"ops\": %ld, \"bytes\": %lld, \"mb_per_sec\": %.3f, "
+            "\"usec_mean\": %.2f, \"usec_p50\": %.2f, \"usec_p99\": %.2f, \"usec_max\": %.2f}",
+            first ? "" : ",\n", op_names[op], s->count, s->bytes,
+            total > 0 ? s->bytes / (total / 1e6) / (1024 * 1024) : 0.0, total / s->count,
+            s->usec[s->count / 2], s->usec[s->count * 99 / 100], s->usec[s->count - 1]);
+    first = 0;
+  }
+  fprintf(out, "\n  ]\n}\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  struct trace_record rec;
+  char name[MAX_NAME];
+  char magic[8];
+  int version = 0;
+  int timed = 0;
+  int arg = 1;
+  int i;
+  double start, done;
+  FILE *fp, *out = stdout;
+
+  if (arg < argc && strcmp(argv[arg], "-t") == 0) {
+    timed = 1;
+    arg++;
+  }
+  if (arg >= argc) {
+    fprintf(stderr, "usage: sfs_replay [-t] trace [output.json]\n");
+    return 2;
+  }
+  fp = fopen(argv[arg], "rb");
+  if (fp == NULL) {
+    perror(argv[arg]);
+    return 2;
+  }
+  if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0 ||
+      fread(&version, sizeof(int), 1, fp) != 1 || version != TRACE_VERSION) {
+    fprintf(stderr, "sfs_replay: %s is not an sfs trace\n", argv[arg]);
+    return 2;
+  }
+  if (arg + 1 < argc && (out = fopen(argv[arg + 1], "w")) == NULL) {
+    perror(argv[arg + 1]);
+    return 2;
+  }
+
+  start = now();
+  while (read_record(fp, &rec, name)) {
+    double t;
+    long long bytes;
+
+    /* Wait until the time the call was made at in the trace */
+    if (timed) {
+      double wait = rec.time / 1e9 - (now() - start);
+
+      if (wait > 0) {
+        struct timespec ts;
+
+        ts.tv_sec = (time_t)wait;
+        ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+      }
+    }
+    t = now();
+    bytes = replay(fp, &rec, name);
+    if (bytes < 0) {
+      break;
+    }
+    add_latency(rec.op, (now() - t) * 1e6, bytes);
+  }
+  done = now();
+  fclose(fp);
+  report(out, argv[arg], timed, done - start);
+
+  for (i = 0; i < nfss; i++) {
+    if (fss[i].fs != NULL) {
+      sfs_unmount(fss[i].fs);
+    }
+    if (fss[i].fds != NULL) {
+      disk_name(name, i);
+      remove(name);
+      free(fss[i].fds);
+    }
+  }
+  if (out != stdout) {
+    fclose(out);
+  }
+  free(fss);
+  free(data);
+  return 0;
+}
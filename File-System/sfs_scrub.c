@@ -0,0 +1,23 @@
+/* sfs_scrub.c
+ *
+ * Offline scrubber. Mounts the existing sfs_disk and checks every block
+ * against its checksum. Exits with 1 if any block is corrupt.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sfs_api.h"
+
+int
+main(int argc, char **argv)
+{
+  int bad;
+
+  mksfs(0);
+  bad = sfs_scrub();
+  if (bad < 0) {
+    return 2;
+  }
+  printf("sfs_scrub: %d corrupt blocks\n", bad);
+  return bad > 0;
+}
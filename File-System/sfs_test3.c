@@ -0,0 +1,1569 @@
+/* sfs_test3.c
+ *
+ * Tests for the file system extensions (file clones, defragmentation,
+ * compression, deduplication, checksums).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sfs_api.h"
+#include "disk_emu.h"
+#include "sfs_trace.h"
+
+#define CLONE_BYTES 20000       /* Big enough to use the index block */
+#define MANY_FILES 3000
+#define NUM_THREADS 4
+
+/* fill_pattern() - fill a buffer with a byte pattern that depends on seed.
+ */
+static void fill_pattern(char *buf, int n, int seed)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    buf[i] = (char)((i * 7 + seed) % 251);
+  }
+}
+
+/* check_file() - read a whole file and compare it against expected.
+ * Returns the number of errors found.
+ */
+static int check_file(char *name, char *expected, int n)
+{
+  char *buf = malloc(n);
+  int fd, readsize, i;
+  int errors = 0;
+
+  fd = sfs_fopen(name);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: failed to open %s\n", name);
+    free(buf);
+    return 1;
+  }
+  sfs_fseek(fd, 0);
+  readsize = sfs_fread(fd, buf, n);
+  if (readsize != n) {
+    fprintf(stderr, "ERROR: read %d bytes from %s, expected %d\n", readsize, name, n);
+    errors++;
+  }
+  for (i = 0; i < readsize; i++) {
+    if (buf[i] != expected[i]) {
+      fprintf(stderr, "ERROR: wrong byte in %s at %d (%d,%d)\n", name, i, buf[i], expected[i]);
+      errors++;
+      break;
+    }
+  }
+  sfs_fclose(fd);
+  free(buf);
+  return errors;
+}
+
+/* check_file_r() - check_file() for a mounted file system.
+ */
+static int check_file_r(sfs_t *fs, char *name, char *expected, int n)
+{
+  char *buf = malloc(n);
+  int fd, readsize;
+  int errors = 0;
+
+  fd = sfs_fopen_r(fs, name);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: failed to open %s\n", name);
+    free(buf);
+    return 1;
+  }
+  readsize = sfs_pread_r(fs, fd, buf, n, 0);
+  if (readsize != n || memcmp(buf, expected, n) != 0) {
+    fprintf(stderr, "ERROR: wrong contents in %s (read %d bytes, expected %d)\n", name, readsize, n);
+    errors++;
+  }
+  sfs_fclose_r(fs, fd);
+  free(buf);
+  return errors;
+}
+
+/* corrupt_block() - find the disk block that starts with the n bytes at
+ * data and flip one of its bytes behind the file system's back.
+ * Returns 0 if no block matched.
+ */
+static int corrupt_block(char *data, int n)
+{
+  char block[1024];
+  int i;
+
+  for (i = 1; read_blocks(i, 1, block) == 1; i++) {
+    if (memcmp(block, data, n) == 0) {
+      block[100] ^= 0x40;
+      write_blocks(i, 1, block);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* find_ints() - find two ints, one after the other, in an image read
+ * into memory. Used to find a packed inode by its flags and size.
+ * Returns a pointer to the first one, or NULL.
+ */
+static int *find_ints(char *image, long n, int a, int b)
+{
+  int *p = (int *)image;
+  long i;
+
+  for (i = 0; i + 1 < n / 4; i++) {
+    if (p[i] == a && p[i + 1] == b) {
+      return p + i;
+    }
+  }
+  return NULL;
+}
+
+/* fs_worker() - mount a file system of its own, then write and check a
+ * few files on it. Run by several threads at once.
+ * Returns the number of errors found.
+ */
+static void *fs_worker(void *arg)
+{
+  long id = (long)arg;
+  struct sfs_opts opts = { 1, 20, 1024 };
+  char path[32], name[32];
+  char buf[3000], check[3000];
+  long errors = 0;
+  sfs_t *fs;
+  int i, fd;
+
+  sprintf(path, "sfs_disk_t%ld", id);
+  fs = sfs_mount(path, &opts);
+  if (fs == NULL) {
+    return (void *)1;
+  }
+  for (i = 0; i < 20; i++) {
+    sprintf(name, "t%ld_%d", id, i);
+    fill_pattern(buf, sizeof(buf), id * 100 + i);
+    fd = sfs_fopen_r(fs, name);
+    sfs_fwrite_r(fs, fd, buf, sizeof(buf));
+    sfs_fseek_r(fs, fd, 0);
+    if (sfs_fread_r(fs, fd, check, sizeof(check)) != sizeof(check) ||
+        memcmp(buf, check, sizeof(check)) != 0) {
+      errors++;
+    }
+    sfs_fclose_r(fs, fd);
+  }
+  sfs_unmount(fs);
+  remove(path);
+  return (void *)errors;
+}
+
+/* The main testing program
+ */
+int
+main(int argc, char **argv)
+{
+  char *orig = malloc(CLONE_BYTES);
+  char *changed = malloc(CLONE_BYTES);
+  char *mixed = malloc(CLONE_BYTES);
+  int error_count = 0;
+  int fds[2];
+  int fd, i;
+  char name[32];
+
+  mksfs(1);
+
+  /* Clone a file, then overwrite part of the clone and append to the
+   * source. Each file must only see its own writes.
+   */
+  fill_pattern(orig, CLONE_BYTES, 1);
+  fd = sfs_fopen("src.txt");
+  if (sfs_fwrite(fd, orig, CLONE_BYTES) != CLONE_BYTES) {
+    fprintf(stderr, "ERROR: writing src.txt\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+
+  if (sfs_clone("src.txt", "clone.txt") != 0) {
+    fprintf(stderr, "ERROR: cloning src.txt\n");
+    error_count++;
+  }
+  if (sfs_clone("src.txt", "clone.txt") == 0) {
+    fprintf(stderr, "ERROR: clone over an existing file succeeded\n");
+    error_count++;
+  }
+  if (sfs_clone("missing.txt", "other.txt") == 0) {
+    fprintf(stderr, "ERROR: clone of a missing file succeeded\n");
+    error_count++;
+  }
+  if (sfs_getfilesize("clone.txt") != CLONE_BYTES) {
+    fprintf(stderr, "ERROR: clone has size %d\n", sfs_getfilesize("clone.txt"));
+    error_count++;
+  }
+  error_count += check_file("clone.txt", orig, CLONE_BYTES);
+
+  /* Write across a block boundary in the direct blocks and one in the
+   * indirect blocks of the clone.
+   */
+  memcpy(changed, orig, CLONE_BYTES);
+  memset(changed + 1000, 'x', 100);
+  memset(changed + 15000, 'y', 2000);
+  fd = sfs_fopen("clone.txt");
+  sfs_fseek(fd, 1000);
+  sfs_fwrite(fd, changed + 1000, 100);
+  sfs_fseek(fd, 15000);
+  sfs_fwrite(fd, changed + 15000, 2000);
+  sfs_fclose(fd);
+
+  error_count += check_file("clone.txt", changed, CLONE_BYTES);
+  error_count += check_file("src.txt", orig, CLONE_BYTES);
+
+  /* Removing the source must leave the clone's shared blocks alone.
+   */
+  if (sfs_remove("src.txt") != 0) {
+    fprintf(stderr, "ERROR: removing src.txt\n");
+    error_count++;
+  }
+  fd = sfs_fopen("filler.txt");
+  sfs_fwrite(fd, orig, CLONE_BYTES);
+  sfs_fclose(fd);
+  error_count += check_file("clone.txt", changed, CLONE_BYTES);
+  sfs_remove("clone.txt");
+  sfs_remove("filler.txt");
+
+  /* Append to two files in turn so their blocks could interleave, then
+   * defragment them and check the contents survive, also after a remount.
+   */
+  fill_pattern(orig, CLONE_BYTES, 3);
+  fill_pattern(changed, CLONE_BYTES, 5);
+  fds[0] = sfs_fopen("a.txt");
+  fds[1] = sfs_fopen("b.txt");
+  for (i = 0; i < CLONE_BYTES; i += 500) {
+    sfs_fwrite(fds[0], orig + i, 500);
+    sfs_fwrite(fds[1], changed + i, 500);
+  }
+  sfs_fclose(fds[0]);
+  sfs_fclose(fds[1]);
+  if (sfs_defrag(NULL) < 0) {
+    fprintf(stderr, "ERROR: defragmenting\n");
+    error_count++;
+  }
+  if (sfs_defrag("missing.txt") != -1) {
+    fprintf(stderr, "ERROR: defragmenting a missing file succeeded\n");
+    error_count++;
+  }
+  error_count += check_file("a.txt", orig, CLONE_BYTES);
+  error_count += check_file("b.txt", changed, CLONE_BYTES);
+
+  mksfs(0);
+  error_count += check_file("a.txt", orig, CLONE_BYTES);
+  error_count += check_file("b.txt", changed, CLONE_BYTES);
+  sfs_remove("a.txt");
+  sfs_remove("b.txt");
+
+  /* Positional reads and writes leave the file pointer alone, and a read
+   * at the end of the file returns nothing.
+   */
+  fill_pattern(orig, CLONE_BYTES, 9);
+  fd = sfs_fopen("pos.txt");
+  if (sfs_pwrite(fd, orig, CLONE_BYTES, 0) != CLONE_BYTES) {
+    fprintf(stderr, "ERROR: positional write of pos.txt\n");
+    error_count++;
+  }
+  sfs_fseek(fd, 100);
+  memset(mixed, 0, CLONE_BYTES);
+  if (sfs_pread(fd, mixed, 3000, 12000) != 3000 || memcmp(mixed, orig + 12000, 3000) != 0) {
+    fprintf(stderr, "ERROR: wrong data from positional read\n");
+    error_count++;
+  }
+  if (sfs_pread(fd, mixed, 100, CLONE_BYTES) != 0) {
+    fprintf(stderr, "ERROR: positional read at the end of the file returned data\n");
+    error_count++;
+  }
+  if (sfs_fread(fd, mixed, 10) != 10 || memcmp(mixed, orig + 100, 10) != 0) {
+    fprintf(stderr, "ERROR: positional I/O moved the file pointer\n");
+    error_count++;
+  }
+
+  /* The extents sfs_fmap gives, read straight from the disk image (or
+   * with sfs_pread where they can't be), hold the file's data.
+   */
+  {
+    struct sfs_extent ext[4];
+    int n, j, got = 0;
+
+    memset(mixed, 0, CLONE_BYTES);
+    while (got < CLONE_BYTES - 500 && (n = sfs_fmap(fd, 500 + got, CLONE_BYTES, ext, 4)) > 0) {
+      for (j = 0; j < n; j++) {
+        if (ext[j].offset != 500 + got ||
+            (ext[j].pos >= 0 ? pread(sfs_disk_fd(), mixed + got, ext[j].length, ext[j].pos)
+                             : sfs_pread(fd, mixed + got, ext[j].length, ext[j].offset)) != ext[j].length) {
+          fprintf(stderr, "ERROR: bad extent at offset %d of pos.txt\n", ext[j].offset);
+          error_count++;
+        }
+        got += ext[j].length;
+      }
+    }
+    if (got != CLONE_BYTES - 500 || memcmp(mixed, orig + 500, got) != 0) {
+      fprintf(stderr, "ERROR: mapped extents of pos.txt don't hold its data\n");
+      error_count++;
+    }
+    if (sfs_fmap(fd, CLONE_BYTES, 100, ext, 4) != 0) {
+      fprintf(stderr, "ERROR: mapped past the end of pos.txt\n");
+      error_count++;
+    }
+  }
+  sfs_fclose(fd);
+  sfs_remove("pos.txt");
+
+  /* sfs_truncate cuts a file short while it's open, without touching a
+   * clone that shares its blocks, fills it with zeros when it grows
+   * again, and moves a file pointer past the new end back to it. A file
+   * kept in its inode is truncated the same way.
+   */
+  {
+    struct sfs_fsck_report report;
+
+    fill_pattern(orig, CLONE_BYTES, 41);
+    fd = sfs_fopen("trunc.txt");
+    sfs_fwrite(fd, orig, CLONE_BYTES);
+    sfs_clone("trunc.txt", "trunc2.txt");
+    if (sfs_truncate("trunc.txt", 5123) != 0 || sfs_getfilesize("trunc.txt") != 5123 ||
+        sfs_fread(fd, mixed, 10) != 0 || sfs_truncate("trunc.txt", CLONE_BYTES) != 0 ||
+        sfs_fread(fd, mixed, CLONE_BYTES) != CLONE_BYTES - 5123) {
+      fprintf(stderr, "ERROR: wrong sizes truncating an open file\n");
+      error_count++;
+    }
+    sfs_fclose(fd);
+    memcpy(changed, orig, 5123);
+    memset(changed + 5123, 0, CLONE_BYTES - 5123);
+    error_count += check_file("trunc.txt", changed, CLONE_BYTES);
+    error_count += check_file("trunc2.txt", orig, CLONE_BYTES);
+    fd = sfs_fopen("small.txt");
+    sfs_fwrite(fd, orig, 40);
+    sfs_fclose(fd);
+    memcpy(changed, orig, 10);
+    memset(changed + 10, 0, 20);
+    if (sfs_truncate("small.txt", 10) != 0 || sfs_truncate("small.txt", 30) != 0 ||
+        sfs_truncate("missing.txt", 0) != -1 || sfs_truncate("trunc.txt", 268 * 1024 + 1) != -1) {
+      fprintf(stderr, "ERROR: wrong sfs_truncate results\n");
+      error_count++;
+    }
+    error_count += check_file("small.txt", changed, 30);
+    if (sfs_truncate("trunc.txt", 0) != 0 || sfs_getfilesize("trunc.txt") != 0 || sfs_fsck(0, &report) != 0) {
+      fprintf(stderr, "ERROR: sfs_fsck found problems after truncating files\n");
+      error_count++;
+    }
+    sfs_remove("trunc.txt");
+    sfs_remove("trunc2.txt");
+    sfs_remove("small.txt");
+  }
+
+  /* A tiny file is kept in its inode, so reading it doesn't read the
+   * disk, and it moves to a data block when it grows past that.
+   */
+  {
+    struct disk_io_stats before, after;
+
+    fill_pattern(orig, 100, 25);
+    fd = sfs_fopen("tiny.txt");
+    sfs_fwrite(fd, orig, 30);
+    sfs_fwrite(fd, orig + 30, 10);
+    sfs_fclose(fd);
+    mksfs(0);
+    get_io_stats(&before);
+    error_count += check_file("tiny.txt", orig, 40);
+    get_io_stats(&after);
+    if (after.blocks_read != before.blocks_read) {
+      fprintf(stderr, "ERROR: reading a tiny file read %ld blocks\n", after.blocks_read - before.blocks_read);
+      error_count++;
+    }
+    fd = sfs_fopen("tiny.txt");
+    sfs_fwrite(fd, orig + 40, 60);
+    sfs_fclose(fd);
+    mksfs(0);
+    error_count += check_file("tiny.txt", orig, 100);
+    sfs_remove("tiny.txt");
+  }
+
+  /* With write-back on, writes stay in memory (where reads find them)
+   * until they're synced. After sfs_fsync, another mount of the disk
+   * sees them.
+   */
+  {
+    struct disk_io_stats before, after;
+    sfs_t *other;
+    int j;
+
+    sfs_writeback(1);
+    fill_pattern(orig, CLONE_BYTES, 27);
+    get_io_stats(&before);
+    fd = sfs_fopen("wb.txt");
+    for (j = 0; j < CLONE_BYTES; j += 500) {
+      sfs_fwrite(fd, orig + j, 500);
+    }
+    get_io_stats(&after);
+    if (after.writes - before.writes >= CLONE_BYTES / 500) {
+      fprintf(stderr, "ERROR: %ld disk writes for %d writes with write-back on\n",
+              after.writes - before.writes, CLONE_BYTES / 500);
+      error_count++;
+    }
+    if (sfs_pread(fd, mixed, CLONE_BYTES, 0) != CLONE_BYTES || memcmp(mixed, orig, CLONE_BYTES) != 0) {
+      fprintf(stderr, "ERROR: wrong contents in wb.txt before it was synced\n");
+      error_count++;
+    }
+    if (sfs_fsync(fd) != 0 || sfs_fsync(-1) != -1) {
+      fprintf(stderr, "ERROR: sfs_fsync\n");
+      error_count++;
+    }
+    sfs_fclose(fd);
+    error_count += check_file("wb.txt", orig, CLONE_BYTES);
+    other = sfs_mount("sfs_disk", NULL);
+    if (other == NULL) {
+      fprintf(stderr, "ERROR: mounting sfs_disk a second time\n");
+      return ++error_count;
+    }
+    error_count += check_file_r(other, "wb.txt", orig, CLONE_BYTES);
+    sfs_unmount(other);
+    sfs_writeback(0);
+    sfs_remove("wb.txt");
+  }
+
+  /* Write a compressible file in small pieces, overwrite part of it and
+   * clone it, then check both files, also after a remount.
+   */
+  for (i = 0; i < CLONE_BYTES; i++) {
+    orig[i] = "log line: all systems nominal\n"[i % 30];
+  }
+  orig[12345] = '#';
+  fd = sfs_fopen("log.txt");
+  if (sfs_fcompress(fd, 1) != 0) {
+    fprintf(stderr, "ERROR: enabling compression on log.txt\n");
+    error_count++;
+  }
+  for (i = 0; i < CLONE_BYTES; i += 777) {
+    sfs_fwrite(fd, orig + i, i + 777 < CLONE_BYTES ? 777 : CLONE_BYTES - i);
+  }
+  if (sfs_fcompress(fd, 0) == 0) {
+    fprintf(stderr, "ERROR: changed compression of a non-empty file\n");
+    error_count++;
+  }
+  memcpy(orig + 5000, "overwritten", 11);
+  sfs_fseek(fd, 5000);
+  sfs_fwrite(fd, "overwritten", 11);
+  sfs_fclose(fd);
+  error_count += check_file("log.txt", orig, CLONE_BYTES);
+
+  sfs_clone("log.txt", "log2.txt");
+  memcpy(changed, orig, CLONE_BYTES);
+  memset(changed + 9000, 'z', 3000);
+  fd = sfs_fopen("log2.txt");
+  sfs_fseek(fd, 9000);
+  sfs_fwrite(fd, changed + 9000, 3000);
+  sfs_fclose(fd);
+
+  /* New files follow the file system's compression setting, which
+   * survives a remount.
+   */
+  sfs_compress(1);
+  memcpy(mixed, orig, CLONE_BYTES / 2);
+  fill_pattern(mixed + CLONE_BYTES / 2, CLONE_BYTES / 2, 9);
+  fd = sfs_fopen("mixed.txt");
+  sfs_fwrite(fd, mixed, CLONE_BYTES);
+  sfs_fclose(fd);
+
+  mksfs(0);
+  error_count += check_file("log.txt", orig, CLONE_BYTES);
+  error_count += check_file("log2.txt", changed, CLONE_BYTES);
+  error_count += check_file("mixed.txt", mixed, CLONE_BYTES);
+  sfs_remove("log.txt");
+  sfs_remove("log2.txt");
+  sfs_remove("mixed.txt");
+  sfs_compress(0);
+
+  /* With dedup on, copies of the same data share blocks. Changing one
+   * copy must not affect the others, before or after a remount.
+   */
+  sfs_dedup(1);
+  fill_pattern(orig, CLONE_BYTES, 11);
+  memcpy(changed, orig, CLONE_BYTES);
+  memset(changed + 3000, 'd', 1500);
+  fds[0] = sfs_fopen("dup1.txt");
+  fds[1] = sfs_fopen("dup2.txt");
+  sfs_fwrite(fds[0], orig, CLONE_BYTES);
+  sfs_fwrite(fds[1], orig, CLONE_BYTES);
+  sfs_fseek(fds[1], 3000);
+  sfs_fwrite(fds[1], changed + 3000, 1500);
+  sfs_fclose(fds[0]);
+  sfs_fclose(fds[1]);
+  error_count += check_file("dup1.txt", orig, CLONE_BYTES);
+  error_count += check_file("dup2.txt", changed, CLONE_BYTES);
+
+  mksfs(0);
+  sfs_remove("dup1.txt");
+  fd = sfs_fopen("dup3.txt");
+  sfs_fwrite(fd, changed, CLONE_BYTES);
+  sfs_fclose(fd);
+  error_count += check_file("dup2.txt", changed, CLONE_BYTES);
+  error_count += check_file("dup3.txt", changed, CLONE_BYTES);
+  sfs_remove("dup2.txt");
+  sfs_remove("dup3.txt");
+  sfs_dedup(0);
+
+  /* With checksums on, a block corrupted on disk is caught by both
+   * sfs_fread and sfs_scrub.
+   */
+  fill_pattern(orig, CLONE_BYTES, 13);
+  fd = sfs_fopen("sum.txt");
+  sfs_fwrite(fd, orig, CLONE_BYTES);
+  sfs_fclose(fd);
+  if (sfs_checksum(1) != 0) {
+    fprintf(stderr, "ERROR: enabling checksums\n");
+    error_count++;
+  }
+  error_count += check_file("sum.txt", orig, CLONE_BYTES);
+  mksfs(0);
+  if (sfs_scrub() != 0) {
+    fprintf(stderr, "ERROR: scrub of a clean disk found errors\n");
+    error_count++;
+  }
+  if (!corrupt_block(orig + 2048, 64)) {
+    fprintf(stderr, "ERROR: couldn't find a block of sum.txt to corrupt\n");
+    error_count++;
+  }
+  fd = sfs_fopen("sum.txt");
+  sfs_fseek(fd, 0);
+  if (sfs_fread(fd, changed, CLONE_BYTES) != -1) {
+    fprintf(stderr, "ERROR: read of a corrupt block succeeded\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+  if (sfs_scrub() != 1) {
+    fprintf(stderr, "ERROR: scrub didn't find the corrupt block\n");
+    error_count++;
+  }
+  sfs_remove("sum.txt");
+
+  /* sfs_defrag leaves a fragmented file with a corrupt block where it
+   * is, so the block isn't copied with a good checksum and the bad copy
+   * freed: reads still fail and sfs_scrub finds as many bad blocks.
+   */
+  fill_pattern(orig, CLONE_BYTES, 31);
+  memset(changed, 0, CLONE_BYTES);
+  for (i = 0; i < CLONE_BYTES; i += 1024) {
+    fd = sfs_fopen("frag.txt");
+    sfs_fwrite(fd, orig + i, CLONE_BYTES - i < 1024 ? CLONE_BYTES - i : 1024);
+    sfs_fclose(fd);
+    fd = sfs_fopen("other.txt");
+    sfs_fwrite(fd, changed, 1024);
+    sfs_fclose(fd);
+  }
+  mksfs(0);
+  if (!corrupt_block(orig + 15 * 1024, 64)) {
+    fprintf(stderr, "ERROR: couldn't find a block of frag.txt to corrupt\n");
+    error_count++;
+  }
+  i = sfs_scrub();
+  sfs_defrag("frag.txt");
+  fd = sfs_fopen("frag.txt");
+  sfs_fseek(fd, 0);
+  if (sfs_fread(fd, mixed, CLONE_BYTES) != -1 || i < 1 || sfs_scrub() != i) {
+    fprintf(stderr, "ERROR: defragmenting made a corrupt block look good\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+  sfs_remove("frag.txt");
+  sfs_remove("other.txt");
+  sfs_checksum(0);
+
+  /* A tiny disk holds exactly as many files as it was made for, and
+   * keeps its geometry across a remount.
+   */
+  if (sfs_geometry(0, 64) == 0) {
+    fprintf(stderr, "ERROR: accepted a disk with no files\n");
+    error_count++;
+  }
+  sfs_geometry(4, 64);
+  mksfs(1);
+  for (i = 0; i < 4; i++) {
+    sprintf(name, "tiny%d.txt", i);
+    fd = sfs_fopen(name);
+    sfs_fwrite(fd, name, strlen(name));
+    sfs_fclose(fd);
+  }
+  if (sfs_fopen("extra.txt") >= 0) {
+    fprintf(stderr, "ERROR: created more files than the disk was made for\n");
+    error_count++;
+  }
+  mksfs(0);
+  if (sfs_getfilesize("tiny3.txt") != 9) {
+    fprintf(stderr, "ERROR: tiny3.txt has size %d after remount\n", sfs_getfilesize("tiny3.txt"));
+    error_count++;
+  }
+  if (sfs_fopen("extra.txt") >= 0) {
+    fprintf(stderr, "ERROR: geometry was lost on remount\n");
+    error_count++;
+  }
+
+  /* A large disk holds thousands of files, with all of them open at once.
+   */
+  sfs_geometry(MANY_FILES, 8192);
+  mksfs(1);
+  for (i = 0; i < MANY_FILES; i++) {
+    sprintf(name, "f%d", i);
+    fd = sfs_fopen(name);
+    if (fd < 0) {
+      fprintf(stderr, "ERROR: failed to create file %d of %d\n", i, MANY_FILES);
+      error_count++;
+      break;
+    }
+    sfs_fwrite(fd, (char *)&i, sizeof(i));
+  }
+  mksfs(0);
+  for (i = 0; i < MANY_FILES; i += 97) {
+    int value = -1;
+    sprintf(name, "f%d", i);
+    fd = sfs_fopen(name);
+    sfs_fseek(fd, 0);
+    if (sfs_fread(fd, (char *)&value, sizeof(value)) != sizeof(value) || value != i) {
+      fprintf(stderr, "ERROR: wrong contents in %s after remount\n", name);
+      error_count++;
+    }
+    sfs_fclose(fd);
+  }
+
+  /* List the large directory in batches, with holes left by removed
+   * files, while a second cursor and sfs_getnextfilename list it too.
+   */
+  {
+    struct sfs_dirent entries[64];
+    struct sfs_dir_cursor cursor = { 0 };
+    struct sfs_dir_cursor other = { 0 };
+    int n, j, listed = 0, seen = 0;
+
+    for (i = 0; i < MANY_FILES; i += 10) {
+      sprintf(name, "f%d", i);
+      sfs_remove(name);
+    }
+    if (sfs_readdirplus(&other, entries, 1) != 1 || strcmp(entries[0].name, "f1") != 0) {
+      fprintf(stderr, "ERROR: first listed file is not f1\n");
+      error_count++;
+    }
+    while ((n = sfs_readdirplus(&cursor, entries, 64)) > 0) {
+      for (j = 0; j < n; j++) {
+        sprintf(name, "f%d", listed + listed / 9 + 1);
+        if (strcmp(entries[j].name, name) != 0 || entries[j].size != sizeof(int)) {
+          fprintf(stderr, "ERROR: listed %s with size %d, expected %s\n",
+                  entries[j].name, entries[j].size, name);
+          error_count++;
+          break;
+        }
+        listed++;
+      }
+    }
+    if (listed != MANY_FILES - MANY_FILES / 10) {
+      fprintf(stderr, "ERROR: listed %d files, expected %d\n", listed, MANY_FILES - MANY_FILES / 10);
+      error_count++;
+    }
+    if (sfs_readdirplus(&other, entries, 1) != 1 || strcmp(entries[0].name, "f2") != 0) {
+      fprintf(stderr, "ERROR: second cursor lost its place\n");
+      error_count++;
+    }
+    for (j = 0; j < 2; j++) {
+      seen = 0;
+      while (sfs_getnextfilename(name)) {
+        seen++;
+      }
+      if (seen != listed) {
+        fprintf(stderr, "ERROR: sfs_getnextfilename pass %d listed %d files, expected %d\n",
+                j + 1, seen, listed);
+        error_count++;
+      }
+    }
+  }
+  sfs_geometry(100, 4096);
+
+  /* Two file systems mounted at once keep their files apart, from each
+   * other and from the default file system.
+   */
+  {
+    struct sfs_opts opts = { 1, 10, 512 };
+    sfs_t *a = sfs_mount("sfs_disk_a", &opts);
+    sfs_t *b = sfs_mount("sfs_disk_b", &opts);
+    pthread_t threads[NUM_THREADS];
+    void *res;
+
+    fill_pattern(orig, CLONE_BYTES, 15);
+    fill_pattern(changed, CLONE_BYTES, 17);
+    fds[0] = sfs_fopen_r(a, "same.txt");
+    fds[1] = sfs_fopen_r(b, "same.txt");
+    sfs_fwrite_r(a, fds[0], orig, CLONE_BYTES);
+    sfs_fwrite_r(b, fds[1], changed, 1000);
+    sfs_fclose_r(a, fds[0]);
+    sfs_fclose_r(b, fds[1]);
+    if (sfs_getfilesize("same.txt") != -1) {
+      fprintf(stderr, "ERROR: a mounted file system's file is in the default one\n");
+      error_count++;
+    }
+    sfs_unmount(a);
+    sfs_unmount(b);
+
+    a = sfs_mount("sfs_disk_a", NULL);
+    b = sfs_mount("sfs_disk_b", NULL);
+    if (a == NULL || b == NULL) {
+      fprintf(stderr, "ERROR: remounting sfs_disk_a and sfs_disk_b\n");
+      return ++error_count;
+    }
+    if (sfs_getfilesize_r(a, "same.txt") != CLONE_BYTES || sfs_getfilesize_r(b, "same.txt") != 1000) {
+      fprintf(stderr, "ERROR: wrong file sizes after remounting two file systems\n");
+      error_count++;
+    }
+    fd = sfs_fopen_r(b, "same.txt");
+    sfs_fseek_r(b, fd, 0);
+    if (sfs_fread_r(b, fd, mixed, 1000) != 1000 || memcmp(mixed, changed, 1000) != 0) {
+      fprintf(stderr, "ERROR: wrong contents in sfs_disk_b\n");
+      error_count++;
+    }
+    sfs_unmount(a);
+    sfs_unmount(b);
+    remove("sfs_disk_a");
+    remove("sfs_disk_b");
+
+    if (sfs_mount("missing_disk", NULL) != NULL) {
+      fprintf(stderr, "ERROR: mounted a disk that doesn't exist\n");
+      error_count++;
+    }
+
+    /* Each thread works on its own file system, in parallel.
+     */
+    for (i = 0; i < NUM_THREADS; i++) {
+      pthread_create(&threads[i], NULL, fs_worker, (void *)(long)i);
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+      pthread_join(threads[i], &res);
+      if (res != NULL) {
+        fprintf(stderr, "ERROR: thread %d found %ld errors\n", i, (long)res);
+        error_count += (long)res;
+      }
+    }
+  }
+
+
+  /* A log-structured disk keeps files written in small interleaved
+   * pieces, and rewritten many times over its size so the cleaner has to
+   * run, across remounts.
+   */
+  {
+    struct sfs_opts opts = { 1, 10, 1024, 1 };
+    sfs_t *lfs = sfs_mount("sfs_disk_log", &opts);
+    int pass, j;
+
+    if (lfs == NULL) {
+      fprintf(stderr, "ERROR: making a log-structured disk\n");
+      return ++error_count;
+    }
+    for (j = 0; j < 5; j++) {
+      sprintf(name, "lfs%d", j);
+      fds[0] = sfs_fopen_r(lfs, name);
+      sfs_fclose_r(lfs, fds[0]);
+    }
+    fill_pattern(orig, CLONE_BYTES, 21);
+    for (i = 0; i < CLONE_BYTES; i += 100) {
+      for (j = 0; j < 5; j++) {
+        sprintf(name, "lfs%d", j);
+        fd = sfs_fopen_r(lfs, name);
+        sfs_fwrite_r(lfs, fd, orig + i, 100);
+        sfs_fclose_r(lfs, fd);
+      }
+    }
+    sfs_unmount(lfs);
+    lfs = sfs_mount("sfs_disk_log", NULL);
+    for (j = 0; j < 5; j++) {
+      sprintf(name, "lfs%d", j);
+      error_count += check_file_r(lfs, name, orig, CLONE_BYTES);
+    }
+
+    for (pass = 0; pass < 20; pass++) {
+      for (j = 0; j < 5; j++) {
+        sprintf(name, "lfs%d", j);
+        fill_pattern(changed, CLONE_BYTES, pass * 5 + j);
+        fd = sfs_fopen_r(lfs, name);
+        if (sfs_pwrite_r(lfs, fd, changed, CLONE_BYTES, 0) != CLONE_BYTES) {
+          fprintf(stderr, "ERROR: rewrite %d of %s failed\n", pass, name);
+          error_count++;
+          pass = 20;
+        }
+        sfs_fclose_r(lfs, fd);
+      }
+    }
+    sfs_remove_r(lfs, "lfs4");
+    sfs_clone_r(lfs, "lfs3", "copy");
+    fd = sfs_fopen_r(lfs, "copy");
+    sfs_pwrite_r(lfs, fd, orig, 3000, 0);
+    sfs_fclose_r(lfs, fd);
+    sfs_clean_r(lfs, 100);
+
+    /* The last write to sfs_disk_log is not followed by an unmount, so
+     * the next mount has to roll the log forward to find it.
+     */
+    fd = sfs_fopen_r(lfs, "last");
+    sfs_fwrite_r(lfs, fd, orig, 5000);
+    sfs_fclose_r(lfs, fd);
+    {
+      sfs_t *again = sfs_mount("sfs_disk_log", NULL);
+      if (again == NULL) {
+        fprintf(stderr, "ERROR: remounting sfs_disk_log\n");
+        return ++error_count;
+      }
+      for (j = 0; j < 4; j++) {
+        sprintf(name, "lfs%d", j);
+        fill_pattern(changed, CLONE_BYTES, 19 * 5 + j);
+        error_count += check_file_r(again, name, changed, CLONE_BYTES);
+      }
+      fill_pattern(changed, CLONE_BYTES, 19 * 5 + 3);
+      memcpy(mixed, orig, 3000);
+      memcpy(mixed + 3000, changed + 3000, CLONE_BYTES - 3000);
+      error_count += check_file_r(again, "copy", mixed, CLONE_BYTES);
+      error_count += check_file_r(again, "last", orig, 5000);
+      if (sfs_getfilesize_r(again, "lfs4") != -1) {
+        fprintf(stderr, "ERROR: removed file is back after remounting\n");
+        error_count++;
+      }
+      sfs_unmount(again);
+    }
+    sfs_unmount(lfs);
+    remove("sfs_disk_log");
+  }
+
+  /* On a disk with block groups, files are spread over the groups by
+   * inode, and files too big for their inode's group spill into the next
+   * ones, across a remount.
+   */
+  {
+    struct sfs_opts opts = { 1, 60, 3000, 0, 1 };
+    sfs_t *grp = sfs_mount("sfs_disk_grp", &opts);
+    int big_bytes = 250 * 1024;
+    char *big = malloc(big_bytes);
+    struct sfs_extent first_ext, last_ext;
+    int j;
+
+    if (grp == NULL) {
+      fprintf(stderr, "ERROR: making a disk with block groups\n");
+      return ++error_count;
+    }
+    for (j = 0; j < 60; j++) {
+      sprintf(name, "g%d", j);
+      fill_pattern(orig, 5000, j);
+      fd = sfs_fopen_r(grp, name);
+      sfs_fwrite_r(grp, fd, orig, 5000);
+      if (j == 0) {
+        sfs_fmap_r(grp, fd, 0, 1, &first_ext, 1);
+      }
+      if (j == 59) {
+        sfs_fmap_r(grp, fd, 0, 1, &last_ext, 1);
+      }
+      sfs_fclose_r(grp, fd);
+    }
+    if (first_ext.pos < 0 || last_ext.pos < first_ext.pos + 1024L * 1024) {
+      fprintf(stderr, "ERROR: the first and last files are in the same block group\n");
+      error_count++;
+    }
+    for (j = 0; j < 10; j++) {
+      sprintf(name, "g%d", j);
+      fill_pattern(big, big_bytes, 100 + j);
+      fd = sfs_fopen_r(grp, name);
+      if (sfs_pwrite_r(grp, fd, big, big_bytes, 0) != big_bytes) {
+        fprintf(stderr, "ERROR: writing %d bytes to %s on a disk with block groups\n", big_bytes, name);
+        error_count++;
+      }
+      sfs_fclose_r(grp, fd);
+    }
+    sfs_unmount(grp);
+
+    grp = sfs_mount("sfs_disk_grp", NULL);
+    if (grp == NULL) {
+      fprintf(stderr, "ERROR: remounting sfs_disk_grp\n");
+      return ++error_count;
+    }
+    for (j = 0; j < 60; j++) {
+      sprintf(name, "g%d", j);
+      if (j < 10) {
+        fill_pattern(big, big_bytes, 100 + j);
+        error_count += check_file_r(grp, name, big, big_bytes);
+      }
+      else {
+        fill_pattern(orig, 5000, j);
+        error_count += check_file_r(grp, name, orig, 5000);
+      }
+    }
+    sfs_unmount(grp);
+    remove("sfs_disk_grp");
+    free(big);
+  }
+
+  /* A disk striped over three image files in chunks of 4 blocks holds
+   * its files across a remount, and all three files get a share.
+   */
+  {
+    struct sfs_opts opts = { 1, 10, 1024 };
+    char *stripes[] = { "sfs_disk_s0", "sfs_disk_s1", "sfs_disk_s2" };
+    sfs_t *sfs = sfs_mount("sfs_disk_s0,sfs_disk_s1,sfs_disk_s2@4", &opts);
+    struct sfs_extent ext;
+    struct stat st;
+
+    if (sfs == NULL) {
+      fprintf(stderr, "ERROR: making a striped disk\n");
+      return ++error_count;
+    }
+    fill_pattern(orig, CLONE_BYTES, 23);
+    fd = sfs_fopen_r(sfs, "striped");
+    sfs_fwrite_r(sfs, fd, orig, CLONE_BYTES);
+    if (sfs_fmap_r(sfs, fd, 0, 1000, &ext, 1) != 1 || ext.pos != -1) {
+      fprintf(stderr, "ERROR: sfs_fmap gave an image offset on a striped disk\n");
+      error_count++;
+    }
+    sfs_fclose_r(sfs, fd);
+    sfs_unmount(sfs);
+
+    sfs = sfs_mount("sfs_disk_s0,sfs_disk_s1,sfs_disk_s2@4", NULL);
+    if (sfs == NULL) {
+      fprintf(stderr, "ERROR: remounting the striped disk\n");
+      return ++error_count;
+    }
+    error_count += check_file_r(sfs, "striped", orig, CLONE_BYTES);
+    sfs_unmount(sfs);
+    for (i = 0; i < 3; i++) {
+      if (stat(stripes[i], &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "ERROR: stripe file %s is missing or empty\n", stripes[i]);
+        error_count++;
+      }
+      remove(stripes[i]);
+    }
+  }
+
+  /* A 3 GB disk (made sparse, so it's quick) keeps files whose blocks
+   * are past the first 2 GB of the image.
+   */
+  {
+    struct sfs_opts opts = { 1, 10, 3000000 };
+    sfs_t *huge = sfs_mount("sfs_disk_huge", &opts);
+    struct sfs_extent ext;
+    struct stat st;
+
+    if (huge == NULL) {
+      fprintf(stderr, "ERROR: making a 3 GB disk\n");
+      return ++error_count;
+    }
+    fill_pattern(orig, CLONE_BYTES, 29);
+    for (i = 0; i < 10; i++) {
+      sprintf(name, "huge%d", i);
+      fd = sfs_fopen_r(huge, name);
+      sfs_fwrite_r(huge, fd, orig, CLONE_BYTES);
+      sfs_fclose_r(huge, fd);
+    }
+    fd = sfs_fopen_r(huge, "huge9");
+    if (sfs_fmap_r(huge, fd, 0, 1000, &ext, 1) != 1 || ext.pos < 2147483648LL) {
+      fprintf(stderr, "ERROR: the last file on the 3 GB disk isn't past 2 GB\n");
+      error_count++;
+    }
+    else if (pread(sfs_disk_fd_r(huge), mixed, 1000, ext.pos) != 1000 || memcmp(mixed, orig, 1000) != 0) {
+      fprintf(stderr, "ERROR: wrong data past 2 GB in the disk image\n");
+      error_count++;
+    }
+    sfs_fclose_r(huge, fd);
+    sfs_unmount(huge);
+
+    huge = sfs_mount("sfs_disk_huge", NULL);
+    if (huge == NULL) {
+      fprintf(stderr, "ERROR: remounting the 3 GB disk\n");
+      return ++error_count;
+    }
+    for (i = 0; i < 10; i++) {
+      sprintf(name, "huge%d", i);
+      error_count += check_file_r(huge, name, orig, CLONE_BYTES);
+    }
+    sfs_unmount(huge);
+    if (stat("sfs_disk_huge", &st) != 0 || st.st_size < 3000000LL * 1024) {
+      fprintf(stderr, "ERROR: sfs_disk_huge is smaller than 3 GB\n");
+      error_count++;
+    }
+    remove("sfs_disk_huge");
+  }
+
+  /* A RAM disk does no disk I/O, keeps its files while it's mounted, and
+   * can be saved to an image file and loaded from one.
+   */
+  {
+    struct sfs_opts opts = { 1 };
+    sfs_t *ram = sfs_mount(":memory:", &opts);
+    sfs_t *saved;
+
+    if (ram == NULL) {
+      fprintf(stderr, "ERROR: making a RAM disk\n");
+      return ++error_count;
+    }
+    fill_pattern(orig, CLONE_BYTES, 31);
+    fd = sfs_fopen_r(ram, "ram.txt");
+    sfs_fwrite_r(ram, fd, orig, CLONE_BYTES);
+    sfs_fclose_r(ram, fd);
+    if (sfs_disk_fd_r(ram) != -1) {
+      fprintf(stderr, "ERROR: a RAM disk has a file descriptor\n");
+      error_count++;
+    }
+    error_count += check_file_r(ram, "ram.txt", orig, CLONE_BYTES);
+    remove("sfs_disk_snap");
+    if (sfs_snapshot_r(ram, "sfs_disk_snap") != 0) {
+      fprintf(stderr, "ERROR: saving a RAM disk\n");
+      error_count++;
+    }
+    sfs_unmount(ram);
+
+    saved = sfs_mount("sfs_disk_snap", NULL);
+    if (saved == NULL) {
+      fprintf(stderr, "ERROR: mounting a saved RAM disk\n");
+      return ++error_count;
+    }
+    error_count += check_file_r(saved, "ram.txt", orig, CLONE_BYTES);
+    sfs_unmount(saved);
+
+    /* Changes to a loaded copy don't reach the image */
+    ram = sfs_mount(":memory:sfs_disk_snap", NULL);
+    if (ram == NULL) {
+      fprintf(stderr, "ERROR: loading a RAM disk from a file\n");
+      return ++error_count;
+    }
+    error_count += check_file_r(ram, "ram.txt", orig, CLONE_BYTES);
+    sfs_remove_r(ram, "ram.txt");
+    sfs_unmount(ram);
+    saved = sfs_mount("sfs_disk_snap", NULL);
+    if (saved == NULL) {
+      fprintf(stderr, "ERROR: remounting a saved RAM disk\n");
+      return ++error_count;
+    }
+    error_count += check_file_r(saved, "ram.txt", orig, CLONE_BYTES);
+    sfs_unmount(saved);
+    remove("sfs_disk_snap");
+
+    if (sfs_mount(":memory:", NULL) != NULL) {
+      fprintf(stderr, "ERROR: mounted an empty RAM disk\n");
+      error_count++;
+    }
+  }
+
+  /* sfs_fsck finds and repairs damage done to the inode table and
+   * directory behind the file system's back: a block given to a second
+   * file, a pointer outside the disk, a pointer to a free block, an
+   * entry for a free inode and an inode without an entry.
+   */
+  {
+    struct sfs_opts opts = { 1, 10, 500 };
+    struct sfs_fsck_report report;
+    char *image = malloc(600 * 1024);
+    int *fa, *fb, *fc, *fd_inode;
+    char entry[16] = "fe";
+    long n = 0;
+    FILE *fp;
+    sfs_t *fsck = sfs_mount("sfs_disk_fsck", &opts);
+
+    if (fsck == NULL) {
+      fprintf(stderr, "ERROR: making a disk to check\n");
+      return ++error_count;
+    }
+    /* Plain files with no blocks in common, so their inodes can be found
+     * and the damage is the same with compression or dedup on
+     */
+    fill_pattern(orig, CLONE_BYTES, 37);
+    for (i = 0; i < 5; i++) {
+      sprintf(name, "f%c", 'a' + i);
+      fill_pattern(mixed, 3000 + i, i);
+      fd = sfs_fopen_r(fsck, name);
+      sfs_fcompress_r(fsck, fd, 0);
+      sfs_fwrite_r(fsck, fd, i == 0 ? orig : mixed, i == 0 ? CLONE_BYTES : 3000 + i);
+      sfs_fclose_r(fsck, fd);
+    }
+    if (sfs_fsck_r(fsck, 0, &report) != 0 || report.files != 5) {
+      fprintf(stderr, "ERROR: sfs_fsck found problems on a clean disk\n");
+      error_count++;
+    }
+    sfs_unmount(fsck);
+
+    fp = fopen("sfs_disk_fsck", "r+b");
+    if (fp != NULL) {
+      n = fread(image, 1, 600 * 1024, fp);
+    }
+    fa = find_ints(image, n, 1, CLONE_BYTES);
+    fb = find_ints(image, n, 1, 3001);
+    fc = find_ints(image, n, 1, 3002);
+    fd_inode = find_ints(image, n, 1, 3003);
+    if (fa == NULL || fb == NULL || fc == NULL || fd_inode == NULL) {
+      fprintf(stderr, "ERROR: couldn't find the inodes to damage\n");
+      free(image);
+      return ++error_count;
+    }
+    fb[2] = fa[2];                  /* fb's first block is also fa's */
+    fb[3] = fb[4] + 1;              /* a free block */
+    fc[3] = 0xffffff;               /* past the end of the disk */
+    fd_inode[0] = 0;                /* fd's inode is free */
+    for (i = 0; i + 20 <= n; i += 4) {
+      if (memcmp(image + i, entry, 16) == 0) {
+        *(int *)(image + i + 16) = -1;  /* fe loses its entry */
+        break;
+      }
+    }
+    fseek(fp, 0, SEEK_SET);
+    fwrite(image, 1, n, fp);
+    fclose(fp);
+    free(image);
+
+    fsck = sfs_mount("sfs_disk_fsck", NULL);
+    if (fsck == NULL) {
+      fprintf(stderr, "ERROR: remounting the damaged disk\n");
+      return ++error_count;
+    }
+    /* fb's two old blocks, fc's two blocks after the bad one, and the
+     * three blocks each of fd and fe are leaked
+     */
+    for (i = 0; i < 2; i++) {
+      if (sfs_fsck_r(fsck, i, &report) != 15 || report.files != 3 || report.bad_inodes != 1 ||
+          report.double_allocated != 1 || report.leaked != 10 || report.unmarked != 1 ||
+          report.bad_entries != 1 || report.orphans != 1) {
+        fprintf(stderr, "ERROR: sfs_fsck found %d bad inodes, %d double allocated, %d leaked, %d unmarked, "
+                "%d bad entries and %d orphans in %d files\n", report.bad_inodes, report.double_allocated,
+                report.leaked, report.unmarked, report.bad_entries, report.orphans, report.files);
+        error_count++;
+      }
+    }
+    if (sfs_fsck_r(fsck, 0, &report) != 0) {
+      fprintf(stderr, "ERROR: sfs_fsck didn't repair everything\n");
+      error_count++;
+    }
+    if (sfs_getfilesize_r(fsck, "fc") != 1024 || sfs_getfilesize_r(fsck, "fd") != -1 ||
+        sfs_getfilesize_r(fsck, "fe") != -1) {
+      fprintf(stderr, "ERROR: wrong files after sfs_fsck\n");
+      error_count++;
+    }
+
+    /* fa and fb now share fa's first block, so writing fb copies it */
+    fd = sfs_fopen_r(fsck, "fb");
+    sfs_pwrite_r(fsck, fd, "changed", 7, 0);
+    sfs_fclose_r(fsck, fd);
+    error_count += check_file_r(fsck, "fa", orig, CLONE_BYTES);
+    sfs_remove_r(fsck, "fa");
+    sfs_remove_r(fsck, "fb");
+    sfs_unmount(fsck);
+
+    fsck = sfs_mount("sfs_disk_fsck", NULL);
+    if (fsck == NULL || sfs_fsck_r(fsck, 0, &report) != 0 || report.files != 1) {
+      fprintf(stderr, "ERROR: sfs_fsck found problems after removing the repaired files\n");
+      error_count++;
+    }
+    if (fsck != NULL) {
+      sfs_unmount(fsck);
+    }
+    remove("sfs_disk_fsck");
+  }
+
+  /* sfs_import creates a batch of files, each in one run of blocks,
+   * and skips the ones it can't create.
+   */
+  {
+    struct sfs_opts opts = { 1, 10, 500 };
+    struct sfs_import files[5];
+    struct sfs_extent ext[4];
+    struct sfs_fsck_report report;
+    char *big = calloc(1, 300 * 1024);
+    sfs_t *imp = sfs_mount("sfs_disk_imp", &opts);
+
+    if (imp == NULL) {
+      fprintf(stderr, "ERROR: making a disk to import into\n");
+      return ++error_count;
+    }
+    fill_pattern(orig, CLONE_BYTES, 41);
+    files[0].name = "imp_tiny";
+    files[0].data = orig;
+    files[0].size = 20;
+    files[1].name = "imp_small";
+    files[1].data = orig;
+    files[1].size = 5000;
+    files[2].name = "imp_big";
+    files[2].data = orig;
+    files[2].size = CLONE_BYTES;
+    files[3].name = "imp_small";        /* exists by then */
+    files[3].data = orig;
+    files[3].size = 10;
+    files[4].name = "imp_huge";         /* more than a file can hold */
+    files[4].data = big;
+    files[4].size = 300 * 1024;
+    if (sfs_import_r(imp, files, 5) != 3) {
+      fprintf(stderr, "ERROR: sfs_import didn't create exactly 3 files\n");
+      error_count++;
+    }
+    free(big);
+    fd = sfs_fopen_r(imp, "imp_big");
+    if (sfs_fmap_r(imp, fd, 0, CLONE_BYTES, ext, 4) != 1) {
+      fprintf(stderr, "ERROR: an imported file isn't in one run of blocks\n");
+      error_count++;
+    }
+    sfs_fclose_r(imp, fd);
+    sfs_unmount(imp);
+
+    imp = sfs_mount("sfs_disk_imp", NULL);
+    if (imp == NULL) {
+      fprintf(stderr, "ERROR: remounting after an import\n");
+      return ++error_count;
+    }
+    error_count += check_file_r(imp, "imp_tiny", orig, 20);
+    error_count += check_file_r(imp, "imp_small", orig, 5000);
+    error_count += check_file_r(imp, "imp_big", orig, CLONE_BYTES);
+    if (sfs_fsck_r(imp, 0, &report) != 0 || report.files != 3) {
+      fprintf(stderr, "ERROR: sfs_fsck found problems after an import\n");
+      error_count++;
+    }
+    sfs_unmount(imp);
+    remove("sfs_disk_imp");
+  }
+
+  /* sfs_trace records each call once (not the calls it makes itself),
+   * with the fd sfs_fopen returned and the sizes of reads and writes.
+   */
+  {
+    static int expect[][3] = {        /* op, first two args */
+      { TRACE_MOUNT, TRACE_FRESH, 10 }, { TRACE_FOPEN, 0, 0 },
+      { TRACE_PWRITE, 0, 3000 }, { TRACE_PREAD, 0, 1000 },
+      { TRACE_FSYNC, 0, 0 }, { TRACE_FCLOSE, 0, 0 },
+      { TRACE_CLONE, 0, 0 }, { TRACE_REMOVE, 0, 0 }, { TRACE_UNMOUNT, 0, 0 }
+    };
+    struct sfs_opts opts = { 1, 10, 100 };
+    struct trace_record rec;
+    char magic[8], name[40];
+    int version, n = 0;
+    FILE *fp;
+    sfs_t *tr;
+
+    fill_pattern(orig, 3000, 43);
+    if (sfs_trace("sfs_test.trace") != 0) {
+      fprintf(stderr, "ERROR: starting a trace\n");
+      return ++error_count;
+    }
+    tr = sfs_mount(MEMORY_DISK, &opts);
+    fd = sfs_fopen_r(tr, "traced");
+    sfs_pwrite_r(tr, fd, orig, 3000, 0);
+    sfs_pread_r(tr, fd, changed, 1000, 500);
+    sfs_fsync_r(tr, fd);
+    sfs_fclose_r(tr, fd);
+    sfs_clone_r(tr, "traced", "traced2");
+    sfs_remove_r(tr, "traced");
+    sfs_unmount(tr);
+    sfs_trace(NULL);
+
+    fp = fopen("sfs_test.trace", "rb");
+    if (fp == NULL || fread(magic, 1, 8, fp) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0 ||
+        fread(&version, sizeof(int), 1, fp) != 1 || version != TRACE_VERSION) {
+      fprintf(stderr, "ERROR: the trace doesn't start with its header\n");
+      error_count++;
+    }
+    while (fp != NULL && fread(&rec, sizeof(rec), 1, fp) == 1 && rec.name_len < sizeof(name) &&
+           fread(name, 1, rec.name_len, fp) == rec.name_len) {
+      name[rec.name_len] = '\0';
+      if (rec.op == TRACE_MOUNT) {
+        rec.args[0] &= TRACE_FRESH;     /* whatever modes the build forces */
+      }
+      if (n >= 9 || rec.op != expect[n][0] || rec.fs != 1 ||
+          (rec.op != TRACE_FOPEN && rec.args[0] != expect[n][1]) || rec.args[1] != expect[n][2]) {
+        fprintf(stderr, "ERROR: call %d of the trace isn't what was called\n", n);
+        error_count++;
+        break;
+      }
+      if ((rec.op == TRACE_FOPEN && (rec.args[0] != fd || strcmp(name, "traced") != 0)) ||
+          (rec.op == TRACE_CLONE && (rec.name_len != 14 || strcmp(name + 7, "traced2") != 0)) ||
+          (rec.op == TRACE_PREAD && rec.args[2] != 500) ||
+          rec.time < 0) {
+        fprintf(stderr, "ERROR: wrong arguments recorded for call %d\n", n);
+        error_count++;
+      }
+      n++;
+    }
+    if (n != 9) {
+      fprintf(stderr, "ERROR: the trace has %d calls instead of 9\n", n);
+      error_count++;
+    }
+    if (fp != NULL) {
+      fclose(fp);
+    }
+    remove("sfs_test.trace");
+  }
+
+  /* Every call is counted under its own kind (a pread isn't also a
+   * read), with the bytes it moved, the blocks it allocated and the
+   * metadata blocks it wrote.
+   */
+  {
+    struct sfs_opts opts = { 1, 10, 100 };
+    struct sfs_stats stats;
+    struct sfs_op_stats *w = &stats.ops[SFS_OP_FWRITE];
+    char text[2048];
+    long long in_buckets = 0;
+    sfs_t *st = sfs_mount(MEMORY_DISK, &opts);
+
+    fill_pattern(orig, 5000, 47);
+    fd = sfs_fopen_r(st, "counted");
+    sfs_fcompress_r(st, fd, 0);
+    sfs_fwrite_r(st, fd, orig, 3000);
+    sfs_fwrite_r(st, fd, orig + 3000, 2000);
+    sfs_pread_r(st, fd, changed, 1000, 100);
+    sfs_pread_r(st, fd, changed, 1000, 4500);
+    sfs_fclose_r(st, fd);
+    sfs_get_stats_r(st, &stats);
+    for (i = 0; i < SFS_LATENCY_BUCKETS; i++) {
+      in_buckets += w->latency[i];
+    }
+    if (stats.ops[SFS_OP_MOUNT].calls != 1 || stats.ops[SFS_OP_FOPEN].calls != 1 ||
+        w->calls != 2 || stats.ops[SFS_OP_PREAD].calls != 2 ||
+        stats.ops[SFS_OP_FREAD].calls != 0 || stats.ops[SFS_OP_FCLOSE].calls != 1) {
+      fprintf(stderr, "ERROR: calls counted under the wrong kind\n");
+      error_count++;
+    }
+    if (w->bytes != 5000 || stats.ops[SFS_OP_PREAD].bytes != 1500) {
+      fprintf(stderr, "ERROR: wrong bytes counted (%lld written, %lld read)\n",
+              w->bytes, stats.ops[SFS_OP_PREAD].bytes);
+      error_count++;
+    }
+    if (w->blocks_allocated < 5 || w->meta_blocks == 0 || stats.ops[SFS_OP_FOPEN].meta_blocks == 0 ||
+        stats.ops[SFS_OP_PREAD].blocks_allocated != 0) {
+      fprintf(stderr, "ERROR: wrong blocks counted for writes\n");
+      error_count++;
+    }
+    if (in_buckets != 2 || w->ns <= 0 || w->max_ns > w->ns) {
+      fprintf(stderr, "ERROR: write latencies not counted\n");
+      error_count++;
+    }
+    if (sfs_stats_text(&stats, text, sizeof(text)) != strlen(text) || strstr(text, "fwrite") == NULL ||
+        strstr(text, "fread") != NULL) {
+      fprintf(stderr, "ERROR: wrong stats text\n");
+      error_count++;
+    }
+    /* Moving an inline file to a block rewrites its old bytes, which
+     * aren't the caller's and so aren't counted again.
+     */
+    fd = sfs_fopen_r(st, "promoted");
+    sfs_fwrite_r(st, fd, orig, 30);
+    sfs_fwrite_r(st, fd, orig + 30, 100);
+    sfs_pwrite_r(st, fd, orig, 10, 200);
+    sfs_fclose_r(st, fd);
+    sfs_get_stats_r(st, &stats);
+    if (w->bytes != 5130 || stats.ops[SFS_OP_PWRITE].bytes != 10) {
+      fprintf(stderr, "ERROR: wrong bytes counted across an inline promotion (%lld written, %lld at offsets)\n",
+              w->bytes, stats.ops[SFS_OP_PWRITE].bytes);
+      error_count++;
+    }
+    sfs_unmount(st);
+  }
+
+  /* Names that aren't in the directory are answered by its name filter,
+   * which has to follow creates, clones, removes and remounts.
+   */
+  {
+    struct sfs_opts opts = { 1, 200, 300 };
+    char name[32];
+    sfs_t *nf = sfs_mount("sfs_disk_names", &opts);
+
+    for (i = 0; i < 200; i++) {
+      sprintf(name, "name%03d.txt", i);
+      sfs_fclose_r(nf, sfs_fopen_r(nf, name));
+    }
+    for (i = 0; i < 200; i += 2) {
+      sprintf(name, "name%03d.txt", i);
+      sfs_remove_r(nf, name);
+    }
+    sfs_clone_r(nf, "name001.txt", "name000.txt");
+    sfs_unmount(nf);
+    nf = sfs_mount("sfs_disk_names", NULL);
+    for (i = 0; i < 400; i++) {
+      int expect = i < 200 && (i % 2 == 1 || i == 0) ? 0 : -1;
+
+      sprintf(name, "name%03d.txt", i);
+      if (sfs_getfilesize_r(nf, name) != expect) {
+        fprintf(stderr, "ERROR: %s %s after a remount\n", name, expect == 0 ? "is missing" : "still exists");
+        error_count++;
+        break;
+      }
+    }
+    if (sfs_remove_r(nf, "name002.txt") != -1 || sfs_remove_r(nf, "name000.txt") != 0 ||
+        sfs_getfilesize_r(nf, "name000.txt") != -1 || sfs_getfilesize_r(nf, "name001.txt") != 0) {
+      fprintf(stderr, "ERROR: wrong files removed\n");
+      error_count++;
+    }
+    sfs_unmount(nf);
+    remove("sfs_disk_names");
+  }
+
+  /* Subdirectories: files in nested directories, a directory large enough
+   * for its table to be rebuilt several times, listing, removing and
+   * remounting.
+   */
+  {
+    struct sfs_opts opts = { 1, 3000, 4000 };
+    struct sfs_dir_cursor cursor = { 0 };
+    struct sfs_dirent entries[64], entry;
+    struct sfs_fsck_report report;
+    char name[32];
+    int n, listed, odd;
+    sfs_t *dfs = sfs_mount("sfs_disk_dirs", &opts);
+
+    if (sfs_mkdir_r(dfs, "a") != 0 || sfs_mkdir_r(dfs, "/a/b") != 0 || sfs_mkdir_r(dfs, "a") != -1 ||
+        sfs_mkdir_r(dfs, "x/y") != -1 || sfs_mkdir_r(dfs, "a/b/12345678901234567") != -1) {
+      fprintf(stderr, "ERROR: wrong sfs_mkdir results\n");
+      error_count++;
+    }
+    for (i = 0; i < 2000; i++) {
+      sprintf(name, "a/b/f%04d", i);
+      fd = sfs_fopen_r(dfs, name);
+      if (i == 7) {
+        sfs_fwrite_r(dfs, fd, orig, CLONE_BYTES);
+      }
+      if (fd < 0 || sfs_fclose_r(dfs, fd) != 0) {
+        fprintf(stderr, "ERROR: can't create %s\n", name);
+        error_count++;
+        break;
+      }
+    }
+    if (sfs_stat_r(dfs, "a", &entry) != 0 || !entry.dir || sfs_stat_r(dfs, "/", &entry) != 0 || !entry.dir ||
+        sfs_getfilesize_r(dfs, "a") != -1 ||
+        sfs_stat_r(dfs, "a/b/f0007", &entry) != 0 || entry.dir || entry.size != CLONE_BYTES ||
+        strcmp(entry.name, "f0007") != 0 || sfs_stat_r(dfs, "a/f0007", &entry) != -1 ||
+        sfs_stat_r(dfs, "a/b/f0007/c", &entry) != -1) {
+      fprintf(stderr, "ERROR: wrong sfs_stat results\n");
+      error_count++;
+    }
+    if (sfs_fopen_r(dfs, "a/b") != -1 || sfs_remove_r(dfs, "a") != -1 || sfs_rmdir_r(dfs, "a") != -1 ||
+        sfs_rmdir_r(dfs, "a/b/f0007") != -1 || sfs_fopen_r(dfs, "missing/f") != -1) {
+      fprintf(stderr, "ERROR: a directory was used as a file, or a file as a directory\n");
+      error_count++;
+    }
+    for (i = 0; i < 2000; i += 2) {
+      sprintf(name, "a/b/f%04d", i);
+      sfs_remove_r(dfs, name);
+    }
+    sfs_clone_r(dfs, "a/b/f0007", "a/copy");
+    sfs_unmount(dfs);
+
+    dfs = sfs_mount("sfs_disk_dirs", NULL);
+    error_count += check_file_r(dfs, "a/b/f0007", orig, CLONE_BYTES);
+    error_count += check_file_r(dfs, "/a/copy", orig, CLONE_BYTES);
+    listed = odd = 0;
+    while ((n = sfs_listdir_r(dfs, "a/b", &cursor, entries, 64)) > 0) {
+      for (i = 0; i < n; i++) {
+        listed++;
+        odd += (entries[i].name[4] - '0') % 2 == 1 && !entries[i].dir;
+      }
+    }
+    if (n != 0 || listed != 1000 || odd != 1000 || sfs_getfilesize_r(dfs, "a/b/f0010") != -1 ||
+        sfs_getfilesize_r(dfs, "a/b/f1999") != 0) {
+      fprintf(stderr, "ERROR: wrong files in a/b after a remount (%d listed)\n", listed);
+      error_count++;
+    }
+    if (sfs_fsck_r(dfs, 0, &report) != 0 || report.files != 1000 + 3) {
+      fprintf(stderr, "ERROR: sfs_fsck found problems in a disk with subdirectories\n");
+      error_count++;
+    }
+    for (i = 1; i < 2000; i += 2) {
+      sprintf(name, "/a/b/f%04d", i);
+      sfs_remove_r(dfs, name);
+    }
+    cursor.pos = 0;
+    if (sfs_listdir_r(dfs, "a/b", &cursor, entries, 64) != 0 || sfs_rmdir_r(dfs, "a/b") != 0 ||
+        sfs_rmdir_r(dfs, "a") != -1 || sfs_remove_r(dfs, "a/copy") != 0 || sfs_rmdir_r(dfs, "a") != 0 ||
+        sfs_stat_r(dfs, "a", &entry) != -1 || sfs_listdir_r(dfs, "a", &cursor, entries, 64) != -1) {
+      fprintf(stderr, "ERROR: directories not removed\n");
+      error_count++;
+    }
+    if (sfs_fsck_r(dfs, 0, &report) != 0 || report.files != 0) {
+      fprintf(stderr, "ERROR: sfs_fsck found problems after removing the directories\n");
+      error_count++;
+    }
+    sfs_unmount(dfs);
+    remove("sfs_disk_dirs");
+
+    /* Once the disk has no room to rebuild a directory's table larger,
+     * creating files in it fails, and the ones made before are all still
+     * there.
+     */
+    opts.data_blocks = 80;
+    dfs = sfs_mount("sfs_disk_dirs", &opts);
+    sfs_mkdir_r(dfs, "full");
+    for (i = 0; i < 3000; i++) {
+      sprintf(name, "full/f%04d", i);
+      if ((fd = sfs_fopen_r(dfs, name)) < 0) {
+        break;
+      }
+      sfs_fclose_r(dfs, fd);
+    }
+    for (n = 0; n < i; n++) {
+      sprintf(name, "full/f%04d", n);
+      if (sfs_getfilesize_r(dfs, name) != 0) {
+        break;
+      }
+    }
+    if (i == 3000 || n != i || sfs_fsck_r(dfs, 0, &report) != 0 || report.files != i + 1) {
+      fprintf(stderr, "ERROR: files lost when a directory couldn't grow (%d of %d found)\n", n, i);
+      error_count++;
+    }
+    sfs_unmount(dfs);
+    remove("sfs_disk_dirs");
+
+    /* A directory with more names than one table can hold is split into
+     * shards: every name is still found, listed once and checked by
+     * sfs_fsck, also after remounting, and the shards go with the directory.
+     */
+    opts.max_files = 15000;
+    opts.data_blocks = 4000;
+    dfs = sfs_mount("sfs_disk_dirs", &opts);
+    sfs_mkdir_r(dfs, "big");
+    for (i = 0; i < 12500; i++) {
+      sprintf(name, "big/f%05d", i);
+      if ((fd = sfs_fopen_r(dfs, name)) < 0) {
+        break;
+      }
+      sfs_fclose_r(dfs, fd);
+    }
+    for (n = 0; n < 12500; n += 3) {
+      sprintf(name, "big/f%05d", n);
+      sfs_remove_r(dfs, name);
+    }
+    sfs_unmount(dfs);
+    opts.fresh = 0;
+    dfs = sfs_mount("sfs_disk_dirs", &opts);
+    for (n = 0; n < 12500; n++) {
+      sprintf(name, "big/f%05d", n);
+      if (sfs_getfilesize_r(dfs, name) != (n % 3 == 0 ? -1 : 0)) {
+        break;
+      }
+    }
+    cursor.pos = 0;
+    listed = 0;
+    while ((odd = sfs_listdir_r(dfs, "big", &cursor, entries, 64)) > 0) {
+      listed += odd;
+    }
+    if (i != 12500 || n != 12500 || listed != 12500 - 4167 || sfs_fsck_r(dfs, 0, &report) != 0 ||
+        report.files != 12500 - 4167 + 1) {
+      fprintf(stderr, "ERROR: wrong names in a sharded directory (%d created, %d found, %d listed)\n", i, n, listed);
+      error_count++;
+    }
+    for (n = 0; n < 12500; n++) {
+      sprintf(name, "big/f%05d", n);
+      sfs_remove_r(dfs, name);
+    }
+    if (sfs_rmdir_r(dfs, "big") != 0 || sfs_fsck_r(dfs, 0, &report) != 0 || report.files != 0) {
+      fprintf(stderr, "ERROR: sharded directory not removed\n");
+      error_count++;
+    }
+    sfs_unmount(dfs);
+    remove("sfs_disk_dirs");
+  }
+
+  free(orig);
+  free(changed);
+  free(mixed);
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
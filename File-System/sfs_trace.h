@@ -0,0 +1,66 @@
+#ifndef SFS_TRACE_H
+#define SFS_TRACE_H
+// Binary trace of sfs calls, written by sfs_trace and read back by sfs_replay. The file starts with
+// TRACE_MAGIC and TRACE_VERSION, followed by one struct trace_record per call (in the byte order of the
+// machine that wrote it), each followed by name_len bytes of file name. Only the sizes of reads and writes
+// are recorded, not the data.
+
+#define TRACE_MAGIC "SFSTRACE"
+#define TRACE_VERSION 1
+
+enum trace_op {
+	TRACE_MKSFS = 1,     // arg 0 = fresh
+	TRACE_MOUNT,         // name = disk, args = TRACE_FRESH | TRACE_LOG | TRACE_GROUPS, max files, data blocks
+	TRACE_UNMOUNT,
+	TRACE_GEOMETRY,      // max files, data blocks
+	TRACE_LOGMODE,       // enable
+	TRACE_BLOCKGROUPS,   // enable
+	TRACE_FOPEN,         // name, fd returned (only recorded if the file could be opened)
+	TRACE_FCLOSE,        // fd
+	TRACE_FWRITE,        // fd, length
+	TRACE_FREAD,         // fd, length
+	TRACE_FSEEK,         // fd, location
+	TRACE_PREAD,         // fd, length, offset
+	TRACE_PWRITE,        // fd, length, offset
+	TRACE_FMAP,          // fd, offset, length, max
+	TRACE_REMOVE,        // name
+	TRACE_CLONE,         // name = source and destination, separated by a 0 byte
+	TRACE_DEFRAG,        // name (none = every file)
+	TRACE_IMPORT,        // number of files, each recorded next as a TRACE_IMPORT_FILE
+	TRACE_IMPORT_FILE,   // name, size
+	TRACE_FCOMPRESS,     // fd, enable
+	TRACE_COMPRESS,      // enable
+	TRACE_DEDUP,         // enable
+	TRACE_CHECKSUM,      // enable
+	TRACE_SCRUB,
+	TRACE_FSCK,          // repair
+	TRACE_CLEAN,         // segments
+	TRACE_WRITEBACK,     // enable
+	TRACE_SYNC,
+	TRACE_FSYNC,         // fd
+	TRACE_SNAPSHOT,      // name = image file
+	TRACE_READDIRPLUS,   // cursor position, max
+	TRACE_GETNEXTFILENAME,
+	TRACE_GETFILESIZE,   // name
+	TRACE_MKDIR,         // name
+	TRACE_RMDIR,         // name
+	TRACE_LISTDIR,       // name, cursor position, max
+	TRACE_STAT,          // name
+	TRACE_TRUNCATE,      // name, size
+	TRACE_OPS
+};
+
+#define TRACE_FRESH 1
+#define TRACE_LOG 2
+#define TRACE_GROUPS 4
+
+struct trace_record {
+	long long time; // ns since the trace was started
+	unsigned char op;
+	unsigned char pad;
+	unsigned short name_len;
+	int fs; // the file system, numbered from 1 in the order they're first used
+	int args[4];
+};
+
+#endif